@@ -27,9 +27,23 @@
 #define METAL_STONE_TEXTURE 11
 #define MIRROR_TEXTURE 12
 
+/* World units per lightmap texel for static lights */
+#define LIGHTMAP_TEXEL_SIZE 4.f
+
+/*
+ * Frames are drawn straight into the locked streaming texture, unless they have to be
+ * expanded from the palette or debug stepping presents them while they're drawn
+ */
+#if !defined(RAYCASTER_PIXEL_FORMAT_INDEXED8) && !(defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING))
+  #define DEMO_DRAW_INTO_TEXTURE
+#endif
+
 SDL_Window* window = NULL;
 SDL_Renderer *sdl_renderer = NULL;
 SDL_Texture *texture = NULL;
+#ifdef DEMO_DRAW_INTO_TEXTURE
+static bool texture_locked = false;
+#endif
 
 static renderer rend;
 static camera cam;
@@ -54,6 +68,11 @@ static struct {
 } moving_sector;
 
 static SDL_Surface *textures[32];
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+static Uint8 *texture_indices[32];
+#else
+static palettized_texture palettized_textures[32];
+#endif
 
 static struct {
   float forward, turn, raise, pitch;
@@ -67,6 +86,7 @@ static void create_crossing_and_splitting_sectors(void);
 static void create_mirrors_and_large_sky(void);
 static void load_level(int);
 static void process_camera_movement(const float delta_time);
+static void benchmark_map_cache_cell_sizes(level_data*);
 
 M_INLINED void
 demo_texture_sampler_scaled(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
@@ -74,11 +94,28 @@ demo_texture_sampler_scaled(texture_ref, float, float, uint8_t, uint8_t*, uint8_
 M_INLINED void
 demo_texture_sampler_normalized(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
 
+#ifndef RAYCASTER_PIXEL_FORMAT_INDEXED8
+M_INLINED void
+demo_texture_sampler_column(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
+
+M_INLINED void
+demo_texture_sampler_plane(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
+#endif
+
 #if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
 static void
 demo_renderer_step(const renderer*);
 #endif
 
+static SDL_Surface*
+load_texture(const char*);
+
+static void
+update_texture(const pixel_type*);
+
+static const pixel_type*
+finish_frame();
+
 M_INLINED vec2i
 renderer_size_in_window(int wndw, int wndh)
 {
@@ -95,14 +132,23 @@ renderer_size_in_window(int wndw, int wndh)
   }
 }
 
+/* Must match the layout the renderer writes, see pixel_type */
 M_INLINED SDL_PixelFormat
 renderer_pixel_format(SDL_Renderer *renderer)
 {
-  if (!strcmp("metal", SDL_GetRendererName(renderer))) {
-    return SDL_PIXELFORMAT_ABGR8888;
-  } else {
-    return SDL_PIXELFORMAT_ARGB8888;
-  }
+  M_UNUSED(renderer);
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+  /* Expanded from the palette in update_texture */
+  return SDL_PIXELFORMAT_ARGB8888;
+#elif defined(RAYCASTER_PIXEL_FORMAT_RGB565)
+  return SDL_PIXELFORMAT_RGB565;
+#elif defined(RAYCASTER_PIXEL_FORMAT_ABGR8888)
+  return SDL_PIXELFORMAT_ABGR8888;
+#elif defined(RAYCASTER_PIXEL_FORMAT_XRGB8888)
+  return SDL_PIXELFORMAT_XRGB8888;
+#else
+  return SDL_PIXELFORMAT_ARGB8888;
+#endif
 }
 
 SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
@@ -115,6 +161,7 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
   int i;
   int level = 0;
   int vsync = 0;
+  bool cell_benchmark = false;
 
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "-level")) {
@@ -128,6 +175,8 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
       aspect_ratio = (double)atoi(argv[i+1]) / atoi(argv[i+2]);
     } else if (!strcmp(argv[i], "-vsync")) {
       vsync = atoi(argv[i+1]);
+    } else if (!strcmp(argv[i], "-cellbench")) {
+      cell_benchmark = true;
     }
   }
 
@@ -165,32 +214,66 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
 
   SDL_SetTextureScaleMode(texture, nearest?SDL_SCALEMODE_NEAREST:SDL_SCALEMODE_LINEAR);
 
-  textures[SMALL_BRICKS_TEXTURE] = IMG_Load("res/small_bricks.png");
-  textures[LARGE_BRICKS_TEXTURE] = IMG_Load("res/large_bricks.png");
-  textures[FLOOR_TEXTURE] = IMG_Load("res/floor.png");
-  textures[CEILING_TEXTURE] = IMG_Load("res/ceiling.png");
-  textures[WOOD_TEXTURE] = IMG_Load("res/wood.png");
-  textures[SKY_TEXTURE] = IMG_Load("res/sky.png");
-  textures[METAL_GRATING] = IMG_Load("res/grating.png");
-  textures[METAL_BARS] = IMG_Load("res/bars.png");
-  textures[GRASS_TEXTURE] = IMG_Load("res/grass.png");
-  textures[DIRT_TEXTURE] = IMG_Load("res/dirt.png");
-  textures[STONEWALL_TEXTURE] = IMG_Load("res/stonewall.png");
-  textures[METAL_STONE_TEXTURE] = IMG_Load("res/metal_stone.png");
-  textures[MIRROR_TEXTURE] = IMG_Load("res/mirror.png");
+  textures[SMALL_BRICKS_TEXTURE] = load_texture("res/small_bricks.png");
+  textures[LARGE_BRICKS_TEXTURE] = load_texture("res/large_bricks.png");
+  textures[FLOOR_TEXTURE] = load_texture("res/floor.png");
+  textures[CEILING_TEXTURE] = load_texture("res/ceiling.png");
+  textures[WOOD_TEXTURE] = load_texture("res/wood.png");
+  textures[SKY_TEXTURE] = load_texture("res/sky.png");
+  textures[METAL_GRATING] = load_texture("res/grating.png");
+  textures[METAL_BARS] = load_texture("res/bars.png");
+  textures[GRASS_TEXTURE] = load_texture("res/grass.png");
+  textures[DIRT_TEXTURE] = load_texture("res/dirt.png");
+  textures[STONEWALL_TEXTURE] = load_texture("res/stonewall.png");
+  textures[METAL_STONE_TEXTURE] = load_texture("res/metal_stone.png");
+  textures[MIRROR_TEXTURE] = load_texture("res/mirror.png");
+
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  /* Quantize every texture to the renderer's palette once */
+  for (int i = 0; i < 32; ++i) {
+    const SDL_Surface *surface = textures[i];
+
+    if (!surface) { continue; }
+
+    texture_indices[i] = malloc(surface->w * surface->h);
+
+    for (int y = 0; y < surface->h; ++y) {
+      for (int x = 0; x < surface->w; ++x) {
+        const Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * SDL_BYTESPERPIXEL(surface->format);
+        texture_indices[i][y * surface->w + x] = renderer_palette_index(&rend, p[0], p[1], p[2]);
+      }
+    }
+  }
+#else
+  /* Sample from 4 or 8-bit palette indices, so more of each texture stays in cache */
+  for (int i = 0; i < 32; ++i) {
+    if (textures[i] && !palettized_texture_create(&palettized_textures[i], textures[i]->pixels, textures[i]->w, textures[i]->h, textures[i]->pitch)) {
+      return -1;
+    }
+  }
+#endif
 
   load_level(level);
 
+  if (cell_benchmark) {
+    benchmark_map_cache_cell_sizes(demo_level);
+  }
+
   last_ticks = SDL_GetTicks();
 
   texture_sampler_scaled = demo_texture_sampler_scaled;
   texture_sampler_normalized = demo_texture_sampler_normalized;
+#ifndef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  texture_sampler_column = demo_texture_sampler_column;
+  texture_sampler_plane = demo_texture_sampler_plane;
+#endif
 
   return 0;
 }
 
 void SDL_AppQuit(void *appstate, SDL_AppResult result)
 {
+  finish_frame();
   renderer_destroy(&rend);
 }
 
@@ -200,6 +283,9 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event)
     if (event->type == SDL_EVENT_QUIT) {
       return SDL_APP_SUCCESS;
     } else if (event->type == SDL_EVENT_KEY_DOWN) {
+      /* Some keys modify the level, which can't happen while a frame is being drawn */
+      finish_frame();
+
       if (event->key.key == SDLK_W) { movement.forward = 1.f; }
       else if (event->key.key == SDLK_S) { movement.forward = -1.f; }
       
@@ -232,18 +318,18 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event)
 
       if (event->key.key == SDLK_HOME) {
         cam.entity.sector->ceiling.height += 2;
-        sector_update_floor_ceiling_limits(cam.entity.sector);
+        level_data_update_sector_heights(cam.entity.level, cam.entity.sector);
       } else if (event->key.key == SDLK_END) {
         cam.entity.sector->ceiling.height = M_MAX(cam.entity.sector->floor.height, cam.entity.sector->ceiling.height - 2);
-        sector_update_floor_ceiling_limits(cam.entity.sector);
+        level_data_update_sector_heights(cam.entity.level, cam.entity.sector);
       }
 
       if (event->key.key == SDLK_PAGEUP) {
         cam.entity.sector->floor.height = M_MIN(cam.entity.sector->ceiling.height, cam.entity.sector->floor.height + 2);
-        sector_update_floor_ceiling_limits(cam.entity.sector);
+        level_data_update_sector_heights(cam.entity.level, cam.entity.sector);
       } else if (event->key.key == SDLK_PAGEDOWN) {
         cam.entity.sector->floor.height -= 2;
-        sector_update_floor_ceiling_limits(cam.entity.sector);
+        level_data_update_sector_heights(cam.entity.level, cam.entity.sector);
       }
 
       if (event->key.key == SDLK_K) {
@@ -281,6 +367,7 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event)
 
     } else if (event->type == SDL_EVENT_WINDOW_RESIZED) {
       printf("Resize buffer to %dx%d\n", event->window.data1 / scale, event->window.data2 / scale);
+      finish_frame();
       renderer_resize(&rend, renderer_size_in_window(event->window.data1, event->window.data2));
       SDL_DestroyTexture(texture);
       texture = SDL_CreateTexture(sdl_renderer, renderer_pixel_format(sdl_renderer), SDL_TEXTUREACCESS_STREAMING, rend.buffer_size.x, rend.buffer_size.y);
@@ -310,6 +397,12 @@ SDL_AppIterate(void *userdata)
     fps_update_timer += delta_time;
   }
 
+  /* The renderer works on its own copy of the camera, so it can move while the previous frame is drawn */
+  process_camera_movement(delta_time);
+
+  /* Previous frame has to be finished before the level can be animated */
+  const pixel_type *frame = finish_frame();
+
   if (dynamic_light) {
     /* Light moves up and down */
     light_set_position(dynamic_light, VEC3F(
@@ -355,14 +448,26 @@ SDL_AppIterate(void *userdata)
         }
       }
 
-      sector_update_floor_ceiling_limits(moving_sector.ref);
+      level_data_update_sector_heights(demo_level, moving_sector.ref);
     }
   }
 
-  process_camera_movement(delta_time);
+#if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
+  /* Stepping presents the renderer's own buffer while it's being drawn */
+  M_UNUSED(frame);
   renderer_draw(&rend, &cam);
+  update_texture(rend.buffer);
+#elif defined(DEMO_DRAW_INTO_TEXTURE)
+  /* The previous frame was drawn into the texture, finish_frame handed it back to SDL */
+  M_UNUSED(frame);
+#else
+  /* Next frame is drawn in the background while the previous one is presented */
+  renderer_submit(&rend, &cam);
 
-  SDL_UpdateTexture(texture, NULL, rend.buffer, rend.buffer_size.x*sizeof(pixel_type));
+  if (frame) {
+    update_texture(frame);
+  }
+#endif
 
 #ifdef RAYCASTER_DEBUG
   SDL_SetRenderDrawColor(sdl_renderer, 255, 0, 255, SDL_ALPHA_OPAQUE);
@@ -401,6 +506,23 @@ SDL_AppIterate(void *userdata)
     SDL_RenderDebugText(sdl_renderer, 4, y, "[0 ... 5] - Change level"); y+=h;
   }
 
+#ifdef DEMO_DRAW_INTO_TEXTURE
+  {
+    void *pixels;
+    int pitch;
+
+    /*
+     * Next frame is drawn in the background while this one is presented. SDL has
+     * already taken the texture's contents for the draw queued above, and uploads
+     * the new ones when finish_frame unlocks it.
+     */
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch)) {
+      texture_locked = true;
+      renderer_submit_into(&rend, &cam, pixels, pitch);
+    }
+  }
+#endif
+
   SDL_RenderPresent(sdl_renderer);
 
   return SDL_APP_CONTINUE;
@@ -535,6 +657,11 @@ create_demo_level(void)
   light_z = dynamic_light->entity.z;
   light_movement_range = 48;
 
+  level_data_add_static_light(demo_level, VEC3F(400, 900, 64), 250, 0.9f);
+  level_data_add_static_light(demo_level, VEC3F(292, 650, 160), 200, 0.8f);
+  level_data_add_static_light(demo_level, VEC3F(150, -100, 96), 200, 1.0f);
+  level_data_bake_lightmaps(demo_level, LIGHTMAP_TEXEL_SIZE);
+
   /* Configure some transparent textures */
   linedef_set_middle_texture(
     level_data_find_linedef(demo_level, VEC2F(0, 0), VEC2F(400, 0)),
@@ -800,6 +927,68 @@ create_mirrors_and_large_sky(void)
   map_builder_free(&builder);
 }
 
+/*
+ * Time shadow rays from random points on the walls to the lights of the level
+ * through map caches with different cell sizes. The first row is the size the
+ * level would get by default.
+ */
+static void
+benchmark_map_cache_cell_sizes(level_data *level)
+{
+  static const float cell_sizes[] = { 0.f, 32.f, 48.f, 64.f, 76.f, 96.f, 128.f, 192.f, 256.f, 384.f, 512.f };
+  const size_t rays_count = 100000;
+  size_t i, s, blocked;
+  vec3f *starts, *ends;
+  const linedef *line;
+  const sector *sect;
+  map_cache cache;
+  uint64_t begin;
+  double elapsed;
+  float t;
+
+  if (!level->linedefs_count || !level->lights_count) {
+    printf("Map cache benchmark needs a level with lights\n");
+    return;
+  }
+
+  starts = malloc(rays_count * sizeof(vec3f));
+  ends = malloc(rays_count * sizeof(vec3f));
+
+  srand(48);
+
+  for (i = 0; i < rays_count; ++i) {
+    line = &level->linedefs[rand() % level->linedefs_count];
+    sect = line->side[0].sector;
+    t = (float)rand() / RAND_MAX;
+    starts[i] = VEC3F(
+      line->v0->point.x + (t * line->direction.x),
+      line->v0->point.y + (t * line->direction.y),
+      sect->floor.height + (((float)rand() / RAND_MAX) * (sect->ceiling.height - sect->floor.height))
+    );
+    ends[i] = entity_world_position(&level->lights[rand() % level->lights_count].entity);
+  }
+
+  printf("Cell size    Cells  Linedef refs  ns/ray  Blocked\n");
+
+  for (s = 0; s < sizeof(cell_sizes) / sizeof(cell_sizes[0]); ++s) {
+    cache = (map_cache) { 0 };
+    map_cache_process_level_data(&cache, level, cell_sizes[s]);
+
+    begin = SDL_GetPerformanceCounter();
+    for (i = 0, blocked = 0; i < rays_count; ++i) {
+      blocked += map_cache_intersect_3d(&cache, starts[i], ends[i]);
+    }
+    elapsed = (double)(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+
+    printf("%9.1f %8u %13u %7.1f %8zu\n", cache.cell_size, cache.w * cache.h, cache.references_count, elapsed * 1e9 / rays_count, blocked);
+
+    map_cache_destroy(&cache);
+  }
+
+  free(starts);
+  free(ends);
+}
+
 static void
 load_level(int n)
 {
@@ -820,6 +1009,32 @@ load_level(int n)
   case 5: create_mirrors_and_large_sky(); break;
   default: create_grid_level(); break;
   }
+
+#ifndef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  /* Textures on walls get a column-major copy for demo_texture_sampler_column */
+  for (size_t i = 0; i < demo_level->linedefs_count; ++i) {
+    for (int side = 0; side < 2; ++side) {
+      for (int t = 0; t < 3; ++t) {
+        const texture_ref ref = demo_level->linedefs[i].side[side].texture[t];
+
+        if (ref != TEXTURE_NONE && textures[ref]) {
+          palettized_texture_create_columns(&palettized_textures[ref]);
+        }
+      }
+    }
+  }
+
+  /* Floor and ceiling textures get a tiled copy for demo_texture_sampler_plane */
+  for (size_t i = 0; i < demo_level->sectors_count; ++i) {
+    const texture_ref refs[2] = { demo_level->sectors[i].floor.texture, demo_level->sectors[i].ceiling.texture };
+
+    for (int t = 0; t < 2; ++t) {
+      if (refs[t] != TEXTURE_NONE && textures[refs[t]]) {
+        palettized_texture_create_tiles(&palettized_textures[refs[t]]);
+      }
+    }
+  }
+#endif
   
   camera_init(&cam, demo_level);
 }
@@ -842,17 +1057,22 @@ demo_texture_sampler_scaled(
   const SDL_Surface *surface = textures[texture];
   const int32_t x = (int32_t)floorf(fx) & (surface->w-1); // / mip_level) * mip_level;
   const int32_t y = (int32_t)floorf(fy) & (surface->h-1); // / mip_level) * mip_level;
-  const Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * SDL_BYTESPERPIXEL(surface->format);
   
-  if (pixel)
-    memcpy(pixel, p, 3);
-
   /*
    * Only masked textures are supported for now, so any pixel
    * with a non-zero mask value will be drawn.
    */
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  const Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * SDL_BYTESPERPIXEL(surface->format);
+
+  if (pixel)
+    pixel[0] = texture_indices[texture][y * surface->w + x];
+
   if (mask)
     *mask = p[3];
+#else
+  palettized_texture_sample(&palettized_textures[texture], x, y, pixel, mask);
+#endif
 }
 
 /*
@@ -873,24 +1093,132 @@ demo_texture_sampler_normalized(
   const SDL_Surface *surface = textures[texture];
   int32_t x = (int32_t)(fx * (surface->w-1)); // / mip_level) * mip_level;
   int32_t y = (int32_t)(fy * (surface->h-1)); // / mip_level) * mip_level;
-  const Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * SDL_BYTESPERPIXEL(surface->format);
   
-  if (pixel)
-    memcpy(pixel, p, 3);
-
   /*
    * Only masked textures are supported for now, so any pixel
    * with a non-zero mask value will be drawn.
    */
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  const Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * SDL_BYTESPERPIXEL(surface->format);
+
+  if (pixel)
+    pixel[0] = texture_indices[texture][y * surface->w + x];
+
   if (mask)
     *mask = p[3];
+#else
+  palettized_texture_sample(&palettized_textures[texture], x, y, pixel, mask);
+#endif
+}
+
+#ifndef RAYCASTER_PIXEL_FORMAT_INDEXED8
+/*
+ * Wall sampler: same coordinates as demo_texture_sampler_scaled,
+ * but reads the column-major copy when the texture has one.
+ */
+M_INLINED void
+demo_texture_sampler_column(
+  texture_ref texture,
+  float fx,
+  float fy,
+  uint8_t mip_level,
+  uint8_t *pixel,
+  uint8_t *mask
+) {
+  M_UNUSED(mip_level);
+
+  const palettized_texture *tex = &palettized_textures[texture];
+  const int32_t x = (int32_t)floorf(fx) & (tex->width-1);
+  const int32_t y = (int32_t)floorf(fy) & (tex->height-1);
+
+  if (tex->columns) {
+    palettized_texture_sample_column(tex, x, y, pixel, mask);
+  } else {
+    palettized_texture_sample(tex, x, y, pixel, mask);
+  }
+}
+
+/*
+ * Floor and ceiling sampler: same coordinates as demo_texture_sampler_scaled,
+ * but reads the tiled copy when the texture has one.
+ */
+M_INLINED void
+demo_texture_sampler_plane(
+  texture_ref texture,
+  float fx,
+  float fy,
+  uint8_t mip_level,
+  uint8_t *pixel,
+  uint8_t *mask
+) {
+  M_UNUSED(mip_level);
+
+  const palettized_texture *tex = &palettized_textures[texture];
+  const int32_t x = (int32_t)floorf(fx) & (tex->width-1);
+  const int32_t y = (int32_t)floorf(fy) & (tex->height-1);
+
+  if (tex->tiles) {
+    palettized_texture_sample_tiled(tex, x, y, pixel, mask);
+  } else {
+    palettized_texture_sample(tex, x, y, pixel, mask);
+  }
+}
+#endif
+
+/* Load a texture as RGBA bytes, the samplers read the mask from the alpha channel */
+static SDL_Surface*
+load_texture(const char *path)
+{
+  SDL_Surface *loaded = IMG_Load(path), *converted;
+
+  if (!loaded) {
+    return NULL;
+  }
+
+  converted = SDL_ConvertSurface(loaded, SDL_PIXELFORMAT_RGBA32);
+  SDL_DestroySurface(loaded);
+
+  return converted;
+}
+
+/* Copy a finished frame into the streaming texture */
+static void
+update_texture(const pixel_type *pixels)
+{
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  void *dst;
+  int pitch;
+
+  if (SDL_LockTexture(texture, NULL, &dst, &pitch)) {
+    renderer_expand_frame(&rend, pixels, dst, pitch);
+    SDL_UnlockTexture(texture);
+  }
+#else
+  SDL_UpdateTexture(texture, NULL, pixels, rend.buffer_size.x*sizeof(pixel_type));
+#endif
+}
+
+/* Wait for the frame in flight, handing the texture back to SDL if it was drawn into it */
+static const pixel_type*
+finish_frame()
+{
+  const pixel_type *frame = renderer_wait(&rend);
+
+#ifdef DEMO_DRAW_INTO_TEXTURE
+  if (texture_locked) {
+    SDL_UnlockTexture(texture);
+    texture_locked = false;
+  }
+#endif
+
+  return frame;
 }
 
 #if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
 static void
 demo_renderer_step(const renderer *r)
 {
-  SDL_UpdateTexture(texture, NULL, r->buffer, r->buffer_size.x*sizeof(pixel_type));
+  update_texture(r->buffer);
   SDL_SetRenderDrawColor(sdl_renderer, 0, 128, 255, SDL_ALPHA_OPAQUE);
   SDL_RenderClear(sdl_renderer);
   SDL_RenderTexture(sdl_renderer, texture, NULL, NULL);
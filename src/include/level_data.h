@@ -17,6 +17,11 @@ typedef struct level_data {
   linedef linedefs[8192];
   sector sectors[2048];
   light lights[64];
+#ifdef RAYCASTER_LIGHTMAPS
+  /* Lights only seen through lightmaps, not counting towards the 64 above */
+  light **static_lights;
+  size_t static_lights_count;
+#endif
   vec2f min,
         max;
   map_cache cache;
@@ -35,9 +40,32 @@ level_data_create_sector_from_polygon(level_data*, struct polygon*);
 light*
 level_data_add_light(level_data*, vec3f, float, float);
 
+/*
+ * Light that never moves. With lightmaps it lights nothing until
+ * level_data_bake_lightmaps, otherwise it's the same as level_data_add_light.
+ */
+light*
+level_data_add_static_light(level_data*, vec3f, float, float);
+
 void
 level_data_update_lights(level_data*);
 
+/*
+ * Rasterize static lights with their shadows into lightmaps of 'texel_size' units on
+ * every wall side, floor and ceiling they reach, replacing any baked before.
+ * Does nothing without lightmaps.
+ */
+void
+level_data_bake_lightmaps(level_data*, float texel_size);
+
+/*
+ * Call after changing the floor or ceiling height of a sector instead of
+ * sector_update_floor_ceiling_limits, so that the map cache sees the new heights
+ * and cached shadows and the shadow maps of lights around it are redone.
+ */
+void
+level_data_update_sector_heights(level_data*, sector*);
+
 M_INLINED linedef*
 level_data_find_linedef(level_data *this, vec2f p0, vec2f p1)
 {
@@ -2,21 +2,265 @@
 #define RAYCASTER_LIGHT_INCLUDED
 
 #include "entity.h"
+#include "maths.h"
 
 #define MAX_LIGHTS_PER_SURFACE 4
 
+/* Floors and ceilings fade in over this distance as a light gets level with them */
+#define VERTICAL_FADE_DIST 2.5f
+
 void
 level_data_update_lights(struct level_data*);
 
+#ifdef RAYCASTER_SHADOW_MAPS
+#define SHADOW_MAP_ANGLES 1024
+#define SHADOW_MAP_OPENINGS 4
+#define SHADOW_MAP_BIAS 0.25f
+#define SHADOW_MAP_VISIBLE 0
+#define SHADOW_MAP_HIDDEN 1
+#define SHADOW_MAP_UNKNOWN 2
+
+/* Two sided line the light passes through at 'distance' while between its floor and ceiling */
+typedef struct {
+  float distance;
+  int32_t floor,
+          ceiling;
+} shadow_map_opening;
+
+/*
+ * Occluders around the light in one angle of its shadow map. Everything further than
+ * 'far' is hidden when 'complete', otherwise there were more openings than fit and
+ * the map can't tell.
+ */
+typedef struct {
+  float far;
+  uint8_t openings_count;
+  bool complete;
+  shadow_map_opening openings[SHADOW_MAP_OPENINGS];
+} shadow_map_angle;
+#endif
+
 typedef struct light {
   entity entity;
   float radius,
         radius_sq,
         radius_sq_inverse;
   float strength;
+#ifdef RAYCASTER_SHADOW_CACHE
+  /* Bumped whenever shadows cast by this light may have changed */
+  uint32_t shadow_version;
+#endif
+#ifdef RAYCASTER_SHADOW_MAPS
+  /* SHADOW_MAP_ANGLES angles around the light, built when it's added or moved */
+  shadow_map_angle *shadow_map;
+#endif
 } light;
 
 void
 light_set_position(light *this, vec3f position);
 
+#ifdef RAYCASTER_SHADOW_MAPS
+/* Cast the shadow map rays of the light against the map cache, call when the map around it changes */
+void
+light_update_shadow_map(light *this);
+
+/*
+ * Pseudo angle of a direction in [0, 4), growing monotonically counter clockwise from
+ * the x axis like the real angle but without any trigonometry
+ */
+M_INLINED float
+light_shadow_map_direction_angle(float dx, float dy)
+{
+  if (dy >= 0.f) {
+    return dx >= 0.f ? dy / (dx + dy) : 1.f - (dx / (dy - dx));
+  }
+  return dx < 0.f ? 2.f - (dy / (-dx - dy)) : 3.f + (dx / (dx - dy));
+}
+
+/* Whether the light reaches 'pos' per its shadow map, SHADOW_MAP_UNKNOWN when the map can't tell */
+M_INLINED uint8_t
+light_shadow_map_test(const light *this, vec3f pos, vec3f light_pos)
+{
+  const float dx = pos.x - light_pos.x, dy = pos.y - light_pos.y;
+  const float d = sqrtf((dx * dx) + (dy * dy)) - SHADOW_MAP_BIAS;
+  const shadow_map_angle *angle;
+  register uint8_t i;
+  float z;
+
+  if (!this->shadow_map) {
+    return SHADOW_MAP_UNKNOWN;
+  }
+
+  if (d <= 0.f) {
+    return SHADOW_MAP_VISIBLE;
+  }
+
+  angle = &this->shadow_map[(uint32_t)(light_shadow_map_direction_angle(dx, dy) * (SHADOW_MAP_ANGLES / 4)) % SHADOW_MAP_ANGLES];
+
+  for (i = 0; i < angle->openings_count && angle->openings[i].distance < d; ++i) {
+    z = light_pos.z + ((pos.z - light_pos.z) * (angle->openings[i].distance / (d + SHADOW_MAP_BIAS)));
+    if (z < angle->openings[i].floor || z > angle->openings[i].ceiling) {
+      return SHADOW_MAP_HIDDEN;
+    }
+  }
+
+  if (d <= angle->far) {
+    return SHADOW_MAP_VISIBLE;
+  }
+
+  return angle->complete ? SHADOW_MAP_HIDDEN : SHADOW_MAP_UNKNOWN;
+}
+#endif
+
+typedef struct shadow_cache shadow_cache;
+
+/* Surfaces lit in the frame keep shadow caches, the deferred lighting pass has none to keep them on */
+#if defined(RAYCASTER_DYNAMIC_SHADOWS) && defined(RAYCASTER_SHADOW_CACHE) && !defined(RAYCASTER_DEFERRED_LIGHTING)
+  #define SHADOW_CACHES
+#endif
+
+#if defined(RAYCASTER_SHADOW_CACHE) || defined(RAYCASTER_LIGHTMAPS)
+/*
+ * Texels laid over a wall (u along the line from p0, v up from z_min) or a floor or
+ * ceiling (u and v along x and y from the minimum corner). Shadow caches and
+ * lightmaps keep one and store their own kind of texels in it, row by row.
+ */
+typedef struct {
+  vec2f origin, axis, size;
+  float z_min,
+        texel_size_inverse;
+  uint16_t w, h;
+  bool vertical;
+} surface_grid;
+
+surface_grid
+surface_grid_vertical(vec2f p0, vec2f p1, float z_min, float z_max, float texel_size);
+
+surface_grid
+surface_grid_horizontal(vec2f min, vec2f max, float texel_size);
+
+/* Zeroed storage for the texels of the grid, 'texel_size' bytes each */
+void*
+surface_grid_alloc_texels(const surface_grid*, size_t texel_size);
+
+/* World position of the center of a texel, at height 'z' on floors and ceilings */
+vec3f
+surface_grid_texel_position(const surface_grid*, uint16_t x, uint16_t y, float z);
+
+/* Position of 'pos' on the surface in texels, negative or past w and h outside of it */
+M_INLINED vec2f
+surface_grid_texel_coordinates(const surface_grid *this, vec3f pos)
+{
+  const vec2f local = vec2f_sub(VEC2F(pos.x, pos.y), this->origin);
+
+  if (this->vertical) {
+    return VEC2F(math_dot2(local, this->axis) * this->texel_size_inverse, (pos.z - this->z_min) * this->texel_size_inverse);
+  }
+
+  return VEC2F(local.x * this->texel_size_inverse, local.y * this->texel_size_inverse);
+}
+#endif
+
+#ifdef RAYCASTER_SHADOW_CACHE
+#define SHADOW_CACHE_TEXEL_SIZE 2.f
+#define SHADOW_CACHE_UNKNOWN 0
+#define SHADOW_CACHE_VISIBLE 1
+#define SHADOW_CACHE_HIDDEN 2
+
+/*
+ * Light visibility from points on a wall segment or a floor or ceiling, in texels of
+ * SHADOW_CACHE_TEXEL_SIZE units. Each texel has a byte per light slot, which is
+ * SHADOW_CACHE_UNKNOWN until the renderer casts a ray for it. Slots are given to
+ * the surface's lights when its light list or their shadows change, never while
+ * rendering, so the renderer only reads them.
+ */
+struct shadow_cache {
+  surface_grid grid;
+  const light *lights[MAX_LIGHTS_PER_SURFACE];
+  uint32_t versions[MAX_LIGHTS_PER_SURFACE];
+  uint8_t *texels;
+};
+
+shadow_cache*
+shadow_cache_create_vertical(vec2f p0, vec2f p1, float z_min, float z_max);
+
+shadow_cache*
+shadow_cache_create_horizontal(vec2f min, vec2f max);
+
+void
+shadow_cache_destroy(shadow_cache*);
+
+/*
+ * Give each of the surface's lights a slot. Lights keeping theirs keep its texels,
+ * unless their shadow_version changed, the slots of lights no longer in the list
+ * are handed to new ones after clearing them.
+ */
+void
+shadow_cache_assign_lights(shadow_cache*, light *const *lights, uint8_t count);
+
+/* Slot holding valid texels for 'lt', or MAX_LIGHTS_PER_SURFACE when there is none */
+M_INLINED uint8_t
+shadow_cache_find_slot(const shadow_cache *this, const light *lt)
+{
+  register uint8_t i;
+  for (i = 0; i < MAX_LIGHTS_PER_SURFACE; ++i) {
+    if (this->lights[i] == lt && this->versions[i] == lt->shadow_version) {
+      return i;
+    }
+  }
+  return MAX_LIGHTS_PER_SURFACE;
+}
+
+/* Light slots of the texel at 'pos', NULL when it's outside of the cache */
+M_INLINED uint8_t*
+shadow_cache_texel(const shadow_cache *this, vec3f pos)
+{
+  const vec2f uv = surface_grid_texel_coordinates(&this->grid, pos);
+  int32_t x, y;
+
+  if (uv.x < 0.f || uv.y < 0.f) {
+    return NULL;
+  }
+
+  x = (int32_t)uv.x;
+  y = (int32_t)uv.y;
+
+  if (x >= this->grid.w || y >= this->grid.h) {
+    return NULL;
+  }
+
+  return &this->texels[((y * this->grid.w) + x) * MAX_LIGHTS_PER_SURFACE];
+}
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+/*
+ * Baked brightness of a wall side or a floor or ceiling: the sector brightness raised
+ * by every static light reaching the texel center. Lookups outside of it are clamped
+ * to the nearest texel.
+ */
+typedef struct lightmap {
+  surface_grid grid;
+  float *texels;
+} lightmap;
+
+lightmap*
+lightmap_create_vertical(vec2f p0, vec2f p1, float z_min, float z_max, float texel_size, float brightness);
+
+lightmap*
+lightmap_create_horizontal(vec2f min, vec2f max, float texel_size, float brightness);
+
+void
+lightmap_destroy(lightmap*);
+
+M_INLINED float
+lightmap_sample(const lightmap *this, vec3f pos)
+{
+  const vec2f uv = surface_grid_texel_coordinates(&this->grid, pos);
+  const int32_t x = (int32_t)uv.x, y = (int32_t)uv.y;
+
+  return this->texels[(M_MIN(M_MAX(y, 0), this->grid.h - 1) * this->grid.w) + M_MIN(M_MAX(x, 0), this->grid.w - 1)];
+}
+#endif
+
 #endif
@@ -28,6 +28,10 @@ typedef struct linedef_segment {
   vec2f p0, p1;
   light *lights[MAX_LIGHTS_PER_SURFACE];
   uint8_t lights_count;
+#ifdef RAYCASTER_SHADOW_CACHE
+  /* Created when a light first reaches the segment */
+  shadow_cache *shadows;
+#endif
 } linedef_segment;
 
 typedef struct linedef {
@@ -38,6 +42,10 @@ typedef struct linedef {
     linedef_segment *segments;
     linedef_flags flags;
     vec2f normal;
+#ifdef RAYCASTER_LIGHTMAPS
+    /* Static lights on the side, NULL when none reach it */
+    lightmap *lightmap;
+#endif
   } side[2];
   vec2f direction;
   int32_t max_floor_height,
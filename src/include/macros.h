@@ -29,6 +29,13 @@
   #define IF_DEBUG(S)
 #endif
 
+/* Seconds for debug timings. clock() adds up the time of every thread, so OpenMP builds use the wall clock */
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #define M_SECONDS() omp_get_wtime()
+#else
+  #define M_SECONDS() ((double)clock() / CLOCKS_PER_SEC)
+#endif
+
 // https://stackoverflow.com/questions/2124339/c-preprocessor-va-args-number-of-arguments
 // #define M_NARG(...) M__NARG_(_,##__VA_ARGS__,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0)
 // #define M__NARG_(_,...) M__ARG_N(__VA_ARGS__)
@@ -4,43 +4,132 @@
 #include "types.h"
 #include "light.h"
 
-#define CELL_SIZE 76.f
+/* Cell size for levels without linedefs to choose one from */
+#define MAP_CACHE_DEFAULT_CELL_SIZE 76.f
+#define MAP_CACHE_MIN_CELL_SIZE 32.f
+#define MAP_CACHE_MAX_CELL_SIZE 1024.f
+
+/* Chosen cell sizes grow so there are at most this many cells per linedef */
+#define MAP_CACHE_MAX_CELLS_PER_LINEDEF 64
+
+/* Cells per side of the coarse blocks ray walks use to skip empty space */
+#define MAP_CACHE_BLOCK_SIZE 4
+
+/* Number of rays map_cache_intersect_3d_n traces together */
+#define MAP_CACHE_PACKET_SIZE 4
 
 struct level_data;
 struct linedef;
 struct map_cache_cell;
 
 typedef struct map_cache_cell {
-  uint8_t count, lights_count;
-  struct linedef **linedefs;
+  /* Range of the cell's linedefs in map_cache.references */
+  uint32_t offset, count;
+  uint8_t lights_count;
   light *lights[MAX_LIGHTS_PER_SURFACE];
+#ifdef RAYCASTER_SHADOW_CACHE
+  /* Floor and ceiling shadows, created when a light first reaches the cell */
+  shadow_cache *shadows[2];
+#endif
 } map_cache_cell;
 
+/*
+ * What ray tests need of every linedef as SoA arrays indexed like the level's
+ * linedefs, so they don't chase linedef and vertex pointers. One-sided linedefs
+ * block at any height, their floor and ceiling limits are FLT_MAX and -FLT_MAX.
+ */
+typedef struct map_cache_linedefs {
+  size_t count;
+  float *v0_x, *v0_y, *direction_x, *direction_y, *max_floor_height, *min_ceiling_height;
+} map_cache_linedefs;
+
 typedef struct map_cache {
   vec2f origin;
+  float cell_size, cell_size_inverse;
   uint32_t cell_count;
   uint16_t w, h;
   map_cache_cell *cells;
+  /* Linedef indices of all cells, each cell's are stored one after another */
+  uint32_t *references;
+  uint32_t references_count;
+  map_cache_linedefs linedefs;
+  /* Coarse level over the cells, one flag per MAP_CACHE_BLOCK_SIZE² block telling if any of them has linedefs */
+  uint16_t blocks_w, blocks_h;
+  bool *blocks;
 } map_cache;
 
+/*
+ * Build the cells of the level, 'cell_size' of 0 chooses one with map_cache_auto_cell_size.
+ * Given sizes are used as they are and have to keep the cell counts within INT16_MAX.
+ */
+void
+map_cache_process_level_data(map_cache*, struct level_data*, float cell_size);
+
+/*
+ * Cell size for the level, about the average linedef length so cells hold only a
+ * few linedefs each, but no smaller than what keeps the cell count per linedef
+ * under MAP_CACHE_MAX_CELLS_PER_LINEDEF across the level bounds. Levels too large
+ * for INT16_MAX cells of MAP_CACHE_MAX_CELL_SIZE get larger cells.
+ */
+float
+map_cache_auto_cell_size(const struct level_data*);
+
+void
+map_cache_destroy(map_cache*);
+
+/* Copy the geometry and floor and ceiling limits of the linedef at given index again */
 void
-map_cache_process_level_data(map_cache*, struct level_data*);
+map_cache_update_linedef(map_cache*, size_t, const struct linedef*);
 
 void
 map_cache_process_light(map_cache*, struct light*, vec3f);
 
+#ifdef SHADOW_CACHES
+/* Create the shadow caches of lit cells and give their lights slots again, call when shadows changed */
+void
+map_cache_update_shadow_caches(map_cache*);
+#endif
+
 bool
 map_cache_intersect_3d(const map_cache*, vec3f, vec3f);
 
+/*
+ * map_cache_intersect_3d for up to MAP_CACHE_PACKET_SIZE rays at once. The cells
+ * the rays cross are gathered first and every linedef in them is tested against
+ * all of the rays together. Returns a bitmask of the blocked rays.
+ */
+uint8_t
+map_cache_intersect_3d_n(const map_cache*, const vec3f*, const vec3f*, uint8_t);
+
 M_INLINED map_cache_cell *
 map_cache_cell_at(const map_cache *this, const vec2f world_position)
 {
   const vec2f local_position = vec2f_sub(world_position, this->origin);
-  uint16_t x = local_position.x / CELL_SIZE;
-  uint16_t y = local_position.y / CELL_SIZE;
+  uint16_t x = local_position.x * this->cell_size_inverse;
+  uint16_t y = local_position.y * this->cell_size_inverse;
+  if (x < 0 || y < 0 || x >= this->w || y >= this->h) {
+    return NULL;
+  }
+  return &this->cells[y*this->w+x];
+}
+
+/*
+ * Same as map_cache_cell_at, but also returns the world space bounds of the cell so
+ * callers walking across the map can skip the lookup until they leave it. The bounds
+ * are empty when there is no cell at given position.
+ */
+M_INLINED map_cache_cell *
+map_cache_cell_at_bounded(const map_cache *this, const vec2f world_position, vec2f *min, vec2f *max)
+{
+  const vec2f local_position = vec2f_sub(world_position, this->origin);
+  uint16_t x = local_position.x * this->cell_size_inverse;
+  uint16_t y = local_position.y * this->cell_size_inverse;
   if (x < 0 || y < 0 || x >= this->w || y >= this->h) {
+    *min = *max = world_position;
     return NULL;
   }
+  *min = VEC2F(this->origin.x + (x * this->cell_size), this->origin.y + (y * this->cell_size));
+  *max = VEC2F(min->x + this->cell_size, min->y + this->cell_size);
   return &this->cells[y*this->w+x];
 }
 
@@ -227,4 +227,33 @@ math_point_on_line_segment(vec2f P, vec2f B, vec2f A, float precision) {
   return true;
 }
 
+/*
+ * 16.16 fixed point, used by the span loops with RAYCASTER_FIXED_POINT. Shifting
+ * a negative value right rounds it down, which is what the texture lookups need.
+ */
+typedef int32_t fixed32;
+
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+
+M_INLINED fixed32
+fixed_from_float(float f) {
+  return (fixed32)(f * FIXED_ONE);
+}
+
+M_INLINED float
+fixed_to_float(fixed32 f) {
+  return f * (1.f / FIXED_ONE);
+}
+
+M_INLINED int32_t
+fixed_floor(fixed32 f) {
+  return f >> FIXED_SHIFT;
+}
+
+M_INLINED fixed32
+fixed_mul(fixed32 a, fixed32 b) {
+  return (fixed32)(((int64_t)a * b) >> FIXED_SHIFT);
+}
+
 #endif
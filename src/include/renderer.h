@@ -7,19 +7,104 @@
 struct camera;
 struct level_data;
 
+/*
+ * Output pixel format, picked at build time with RAYCASTER_PIXEL_FORMAT. Channel
+ * names are listed from the most significant bits down, like SDL_PIXELFORMAT_*.
+ * XRGB8888 leaves the top byte zero instead of filling in an opaque alpha.
+ * INDEXED8 writes palette indices, see renderer_set_palette.
+ */
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+typedef uint8_t pixel_type;
+#elif defined(RAYCASTER_PIXEL_FORMAT_RGB565)
+typedef uint16_t pixel_type;
+#else
 typedef uint32_t pixel_type;
+#endif
 typedef pixel_type* frame_buffer;
 
 #define RENDERER_DRAW_DISTANCE 16384.f
+#define RENDERER_FRAME_BUFFERS 2
+#define RENDERER_PALETTE_SIZE 256
+#define RENDERER_COLORMAP_ROWS 64
+#define RENDERER_COLORMAP_MAX_LIGHT 2.f
+
+struct renderer_worker;
+struct renderer_plane_cache;
+struct renderer_sky;
+struct renderer_visibility;
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+#define RENDERER_LIGHT_TILE_SIZE 16
+
+/* Surface types in the top two bits of renderer_gbuffer_texel.surface, below them is the sector index */
+#define RENDERER_SURFACE_NONE 0
+#define RENDERER_SURFACE_WALL 1
+#define RENDERER_SURFACE_FLOOR 2
+#define RENDERER_SURFACE_CEILING 3
+#define RENDERER_SURFACE_SHIFT 14
+#define RENDERER_SURFACE_SECTOR_MASK ((1 << RENDERER_SURFACE_SHIFT) - 1)
+
+/*
+ * What the geometry pass leaves for the lighting pass at every pixel: world position
+ * (height rounded to whole units), the texel (or palette index in albedo[0]), the
+ * level lights the surface can see as a bit mask and the distance dimming. Pixels
+ * with RENDERER_SURFACE_NONE were written to the output directly (sky, black fill).
+ */
+typedef struct {
+  float x, y;
+  uint64_t lights;
+  int16_t z;
+  uint16_t surface;
+  uint8_t albedo[3];
+  uint8_t dimming;
+#ifdef RAYCASTER_LIGHTMAPS
+  /* Lightmap value, or sector brightness where there's no lightmap */
+  float brightness;
+#endif
+} renderer_gbuffer_texel;
+#endif
+
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+/*
+ * Palette for indexed rendering and the colormaps replacing per-pixel light math.
+ * Row N maps every index to the closest color to it lit by N * MAX_LIGHT / ROWS.
+ */
+typedef struct {
+  uint32_t colors[RENDERER_PALETTE_SIZE];
+  uint8_t colormap[RENDERER_COLORMAP_ROWS][RENDERER_PALETTE_SIZE];
+  uint8_t black;
+} renderer_palette;
+#endif
 
 typedef struct {
   volatile frame_buffer buffer;
   volatile float *depth_values;
   vec2i buffer_size;
   uint32_t tick;
+  struct renderer_plane_cache *plane_cache;
+  struct renderer_sky *sky;
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  /* Linedefs and vertices seen in the current frame */
+  struct renderer_visibility *visibility;
+#endif
+
+  /* Frames drawn through renderer_submit, allocated on first use */
+  pixel_type *frames[RENDERER_FRAME_BUFFERS];
+  uint8_t frame_index;
+  /* Destination of the last submitted frame, NULL when there is none */
+  pixel_type *submitted_frame;
+  struct renderer_worker *worker;
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  renderer_palette palette;
+#endif
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  renderer_gbuffer_texel *gbuffer;
+#endif
 
   struct {
     struct level_data *level;
+    pixel_type *buffer;
+    uint32_t buffer_stride;
     vec2f view_position;
     float unit_size, view_z;
     int32_t half_w, half_h, pitch_offset;
@@ -39,6 +124,62 @@ renderer_destroy(renderer *this);
 void
 renderer_draw(renderer *this, struct camera *camera);
 
+/*
+ * Draw into 'dst' instead of the renderer's own buffer. It has to hold buffer_size
+ * pixels with rows 'pitch_bytes' apart (a multiple of sizeof(pixel_type)). Every
+ * pixel is written, so it doesn't need to be cleared beforehand.
+ */
+void
+renderer_draw_into(renderer *this, struct camera *camera, pixel_type *dst, size_t pitch_bytes);
+
+/*
+ * Start drawing a frame into the next internal frame buffer. The camera is copied,
+ * so the caller is free to move it right away. With RAYCASTER_ASYNC_RENDERING the
+ * frame is drawn on a background thread, otherwise before this returns. Only one
+ * frame is in flight at a time, submitting another one waits for it first. Level
+ * data must not be modified until renderer_wait returns.
+ */
+void
+renderer_submit(renderer *this, struct camera *camera);
+
+/*
+ * renderer_submit drawing into 'dst' instead, same as renderer_draw_into. It has to
+ * stay valid and untouched by the caller until renderer_wait returns.
+ */
+void
+renderer_submit_into(renderer *this, struct camera *camera, pixel_type *dst, size_t pitch_bytes);
+
+/*
+ * Wait for the last submitted frame and return its pixels, or NULL when nothing was
+ * submitted since init or resize. Frames from renderer_submit are buffer_size.x wide
+ * and tightly packed, and stay untouched until the second renderer_submit after
+ * this. Frames from renderer_submit_into are returned as the 'dst' they were given.
+ */
+const pixel_type*
+renderer_wait(renderer *this);
+
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+/*
+ * Replace the palette (RENDERER_PALETTE_SIZE RGB triplets) and rebuild the colormaps. Texture samplers
+ * return palette indices in the first channel instead of RGB, so textures should
+ * be quantized with renderer_palette_index after this. renderer_init sets up
+ * an RGB 3-3-2 palette.
+ */
+void
+renderer_set_palette(renderer *this, const uint8_t *colors);
+
+/* Closest palette entry to the given color */
+uint8_t
+renderer_palette_index(const renderer *this, uint8_t r, uint8_t g, uint8_t b);
+
+/*
+ * Expand an indexed frame (buffer_size pixels, tightly packed) into ARGB8888 pixels
+ * with rows 'pitch_bytes' apart.
+ */
+void
+renderer_expand_frame(const renderer *this, const pixel_type *src, uint32_t *dst, size_t pitch_bytes);
+#endif
+
 #if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
   extern void (*renderer_step)(const renderer*);
 #endif
@@ -10,6 +10,28 @@
 
 #define LINEDEFS(...) M_NARG(__VA_ARGS__), (linedef[]) { __VA_ARGS__ }
 
+/*
+ * Linedef origins and directions as SoA arrays (padded to a multiple of 4) so
+ * the renderer can test a ray against several linedefs at once without going
+ * through linedef and vertex pointers. 'facing' is 1 or -1 depending on which
+ * side of the linedef the sector is on.
+ */
+typedef struct sector_geometry {
+  size_t      count, capacity;
+  float       *v0_x, *v0_y, *direction_x, *direction_y, *facing;
+  linedef     **linedefs;
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  /* Range of screen columns each linedef covers (visible geometry only) */
+  float       *column_min, *column_max;
+  /*
+   * Per-frame projection of each linedef (visible geometry only). Both 1/depth
+   * and line_det/depth are linear in the camera plane x, so primary rays can
+   * interpolate them across the screen instead of intersecting the linedef.
+   */
+  float       *inverse_depth, *inverse_depth_step, *texture_u, *texture_u_step;
+#endif
+} sector_geometry;
+
 typedef struct sector {
   struct {
     int32_t     height;
@@ -18,10 +40,10 @@ typedef struct sector {
   size_t      linedefs_count;  
   float       brightness;
   linedef     **linedefs;
-#ifdef RAYCASTER_PRERENDER_VISCHECK
-  uint32_t    last_visibility_check_tick;
-  linedef     **visible_linedefs;
-  size_t      visible_linedefs_count;
+  sector_geometry geometry;
+#ifdef RAYCASTER_LIGHTMAPS
+  /* Static lights on the floor and the ceiling, NULL when none reach them */
+  lightmap    *lightmaps[2];
 #endif
 } sector;
 
@@ -40,6 +62,13 @@ sector_remove_linedef(sector*, linedef*);
 void
 sector_update_floor_ceiling_limits(sector*);
 
+/*
+ * Rebuild the SoA geometry arrays. Adding and removing linedefs does this already,
+ * call it after moving vertices or relinking linedefs to other sectors.
+ */
+void
+sector_update_geometry(sector*);
+
 M_INLINED bool
 sector_point_inside(const sector *this, vec2f point)
 {
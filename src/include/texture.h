@@ -1,7 +1,9 @@
 #ifndef RAYCASTER_TEXTURE_INCLUDED
 #define RAYCASTER_TEXTURE_INCLUDED
 
+#include "types.h"
 #include "macros.h"
+#include <string.h>
 
 /* You may define your own type or reference */
 typedef int32_t texture_ref;
@@ -21,6 +23,21 @@ extern void (*texture_sampler_scaled)(texture_ref, float, float, uint8_t, uint8_
  */
 extern void (*texture_sampler_normalized)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
 
+/*
+ * Optional sampler for walls, with the same arguments as texture_sampler_scaled.
+ * Walls keep 'fx' fixed and step 'fy', so this can read a column-major copy of
+ * the texture. Walls use texture_sampler_scaled when this is NULL.
+ */
+extern void (*texture_sampler_column)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
+
+/*
+ * Optional sampler for floors and ceilings, with the same arguments as
+ * texture_sampler_scaled. Their spans cross the texture diagonally, so this can
+ * read a tiled copy of the texture. Planes use texture_sampler_scaled when this
+ * is NULL.
+ */
+extern void (*texture_sampler_plane)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
+
 M_INLINED void
 debug_texture_sampler_scaled(
   texture_ref texture,
@@ -71,6 +88,119 @@ debug_texture_sampler_normalized(
     *mask = 255;
 }
 
+#define PALETTIZED_TEXTURE_TILE_SIZE 8
+
+/*
+ * Texture stored as palette indices: 4 bits per texel for textures with up to 16
+ * colors, 8 bits otherwise. Each texture has its own palette of RGBA colors, the
+ * alpha channel being the sampler mask. Meant to be sampled from the application's
+ * sampler callbacks, so repeating floor and wall textures take 1/8 to 1/4 of the
+ * cache an RGBA texture would.
+ */
+typedef struct {
+  uint32_t width, height;
+  uint8_t bits;
+  uint16_t palette_size;
+  uint8_t palette[256][4];
+  uint8_t *indices;
+  /* Same indices stored column by column, see palettized_texture_create_columns */
+  uint8_t *columns;
+  /* Same indices stored in square tiles, see palettized_texture_create_tiles */
+  uint8_t *tiles;
+} palettized_texture;
+
+/*
+ * Build a palettized texture from RGBA pixels with rows 'pitch' bytes apart.
+ * Textures with more than 256 colors are reduced with median cut. Returns false
+ * if memory couldn't be allocated.
+ */
+bool
+palettized_texture_create(palettized_texture *this, const uint8_t *rgba, uint32_t width, uint32_t height, size_t pitch);
+
+/*
+ * Add a transposed copy of the indices for textures drawn on walls, so sampling
+ * down a wall column reads sequential memory. The row-major copy stays for floors.
+ */
+bool
+palettized_texture_create_columns(palettized_texture *this);
+
+/*
+ * Add a copy of the indices split into PALETTIZED_TEXTURE_TILE_SIZE² tiles for
+ * textures drawn on floors and ceilings, so texels near each other in any
+ * direction share cache lines. Fails if either dimension isn't a multiple of
+ * the tile size.
+ */
+bool
+palettized_texture_create_tiles(palettized_texture *this);
+
+void
+palettized_texture_destroy(palettized_texture *this);
+
+M_INLINED uint8_t
+palettized_texture_unpack(const uint8_t *indices, uint8_t bits, uint32_t i)
+{
+  if (bits == 4) {
+    return (indices[i >> 1] >> ((i & 1) << 2)) & 0xF;
+  }
+
+  return indices[i];
+}
+
+M_INLINED uint8_t
+palettized_texture_index(const palettized_texture *this, uint32_t x, uint32_t y)
+{
+  return palettized_texture_unpack(this->indices, this->bits, y * this->width + x);
+}
+
+/* Position of a texel in the tiled copy: tiles are row-major, texels within a tile too */
+M_INLINED uint32_t
+palettized_texture_tile_offset(const palettized_texture *this, uint32_t x, uint32_t y)
+{
+  const uint32_t tile = (y / PALETTIZED_TEXTURE_TILE_SIZE) * (this->width / PALETTIZED_TEXTURE_TILE_SIZE) + (x / PALETTIZED_TEXTURE_TILE_SIZE);
+  return tile * (PALETTIZED_TEXTURE_TILE_SIZE * PALETTIZED_TEXTURE_TILE_SIZE)
+    + (y % PALETTIZED_TEXTURE_TILE_SIZE) * PALETTIZED_TEXTURE_TILE_SIZE
+    + (x % PALETTIZED_TEXTURE_TILE_SIZE);
+}
+
+/* Texel at integer coordinates within the texture, same outputs as the samplers */
+M_INLINED void
+palettized_texture_sample(const palettized_texture *this, uint32_t x, uint32_t y, uint8_t *pixel, uint8_t *mask)
+{
+  const uint8_t *color = this->palette[palettized_texture_index(this, x, y)];
+
+  if (pixel)
+    memcpy(pixel, color, 3);
+
+  if (mask)
+    *mask = color[3];
+}
+
+/* Same as palettized_texture_sample, reading the column-major copy */
+M_INLINED void
+palettized_texture_sample_column(const palettized_texture *this, uint32_t x, uint32_t y, uint8_t *pixel, uint8_t *mask)
+{
+  const uint8_t *color = this->palette[palettized_texture_unpack(this->columns, this->bits, x * this->height + y)];
+
+  if (pixel)
+    memcpy(pixel, color, 3);
+
+  if (mask)
+    *mask = color[3];
+}
+
+/* Same as palettized_texture_sample, reading the tiled copy */
+M_INLINED void
+palettized_texture_sample_tiled(const palettized_texture *this, uint32_t x, uint32_t y, uint8_t *pixel, uint8_t *mask)
+{
+  const uint8_t *color = this->palette[palettized_texture_unpack(this->tiles, this->bits, palettized_texture_tile_offset(this, x, y))];
+
+  if (pixel)
+    memcpy(pixel, color, 3);
+
+  if (mask)
+    *mask = color[3];
+}
+
 /* For passing wall texture list to map builder as part of a polygon */
 #define WALLTEX(...) __WALLTEX_N(__VA_ARGS__, __WALLTEX_3, __WALLTEX_2, __WALLTEX_1, __WALLTEX_0)(__VA_ARGS__)
 
@@ -6,9 +6,6 @@
 typedef struct {
   vec2f point;
   uint32_t last_visibility_check_tick;
-#ifdef RAYCASTER_PRERENDER_VISCHECK
-  bool visible;
-#endif
 } vertex;
 
 #endif
@@ -1,12 +1,30 @@
 #include "level_data.h"
 #include "polygon.h"
 #include <assert.h>
+#include <time.h>
+
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #include <omp.h>
+#endif
 
 #define XY(V) (int)V.x, (int)V.y
 
 static bool
 linedef_segment_contains_light(const linedef_segment*, const light*);
 
+#ifdef SHADOW_CACHES
+static void
+update_segment_shadow_caches(level_data*);
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+static void
+bake_wall_lightmap(level_data*, linedef*, uint8_t, float);
+
+static void
+bake_plane_lightmap(level_data*, sector*, bool, float);
+#endif
+
 /* FIND a vertex at given point OR CREATE a new one */
 vertex*
 level_data_get_vertex(level_data *this, vec2f point)
@@ -126,10 +144,10 @@ level_data_create_sector_from_polygon(level_data *this, polygon *poly)
   sect->brightness = poly->brightness;
   sect->linedefs = NULL;
   sect->linedefs_count = 0;
-
-#ifdef RAYCASTER_PRERENDER_VISCHECK
-  sect->visible_linedefs = NULL;
-  sect->visible_linedefs_count = 0;
+  sect->geometry.count = 0;
+  sect->geometry.capacity = 0;
+#ifdef RAYCASTER_LIGHTMAPS
+  sect->lightmaps[0] = sect->lightmaps[1] = NULL;
 #endif
 
   for (i = 0; i < poly->vertices_count; ++i) {
@@ -171,13 +189,56 @@ level_data_add_light(level_data *this, vec3f pos, float r, float s) {
   new_light->radius_sq = r*r;
   new_light->radius_sq_inverse = 1.f / new_light->radius_sq;
   new_light->strength = s;
+#ifdef RAYCASTER_SHADOW_CACHE
+  new_light->shadow_version = 0;
+#endif
 
   level_data_update_lights(this);
   map_cache_process_light(&this->cache, new_light, pos);
+#ifdef RAYCASTER_SHADOW_MAPS
+  new_light->shadow_map = NULL;
+  light_update_shadow_map(new_light);
+#endif
 
   return new_light;
 }
 
+light*
+level_data_add_static_light(level_data *this, vec3f pos, float r, float s) {
+#ifdef RAYCASTER_LIGHTMAPS
+  light **lights = realloc(this->static_lights, (this->static_lights_count + 1) * sizeof(light*));
+  light *new_light;
+
+  if (!lights) {
+    return NULL;
+  }
+
+  this->static_lights = lights;
+
+  if (!(new_light = calloc(1, sizeof(light)))) {
+    return NULL;
+  }
+
+  new_light->entity = (entity) {
+    .level = this,
+    .sector = NULL,
+    .position = VEC2F(pos.x, pos.y),
+    .z = pos.z,
+    .data = (void*)new_light,
+    .type = ENTITY_LIGHT
+  };
+
+  new_light->radius = r;
+  new_light->radius_sq = r*r;
+  new_light->radius_sq_inverse = 1.f / new_light->radius_sq;
+  new_light->strength = s;
+
+  return this->static_lights[this->static_lights_count++] = new_light;
+#else
+  return level_data_add_light(this, pos, r, s);
+#endif
+}
+
 void
 level_data_update_lights(level_data *this)
 {
@@ -258,6 +319,107 @@ level_data_update_lights(level_data *this)
       }
     }
   }
+
+#ifdef SHADOW_CACHES
+  update_segment_shadow_caches(this);
+#endif
+}
+
+void
+level_data_update_sector_heights(level_data *this, sector *sect)
+{
+  size_t li;
+#if defined(RAYCASTER_SHADOW_CACHE) || defined(RAYCASTER_SHADOW_MAPS)
+  size_t i;
+  linedef *line;
+  light *lite;
+  vec2f min = VEC2F(FLT_MAX, FLT_MAX), max = VEC2F(-FLT_MAX, -FLT_MAX), d;
+#endif
+#ifdef RAYCASTER_SHADOW_CACHE
+  size_t side;
+#endif
+
+  sector_update_floor_ceiling_limits(sect);
+
+  for (li = 0; li < sect->linedefs_count; ++li) {
+    map_cache_update_linedef(&this->cache, sect->linedefs[li] - this->linedefs, sect->linedefs[li]);
+  }
+
+#if defined(RAYCASTER_SHADOW_CACHE) || defined(RAYCASTER_SHADOW_MAPS)
+  for (li = 0; li < sect->linedefs_count; ++li) {
+    line = sect->linedefs[li];
+    min = VEC2F(math_min(min.x, line->xmin), math_min(min.y, line->ymin));
+    max = VEC2F(math_max(max.x, line->xmax), math_max(max.y, line->ymax));
+
+#ifdef RAYCASTER_SHADOW_CACHE
+    /* Wall caches cover the old heights, they're created again below */
+    for (side = 0; side < 2; ++side) {
+      for (i = 0; line->side[side].segments && i < line->segments; ++i) {
+        shadow_cache_destroy(line->side[side].segments[i].shadows);
+        line->side[side].segments[i].shadows = NULL;
+      }
+    }
+#endif
+  }
+
+  /* Shadows of every light reaching the sector may have changed */
+  for (i = 0; i < this->lights_count; ++i) {
+    lite = &this->lights[i];
+    d = VEC2F(
+      lite->entity.position.x - math_clamp(lite->entity.position.x, min.x, max.x),
+      lite->entity.position.y - math_clamp(lite->entity.position.y, min.y, max.y)
+    );
+
+    if (math_dot2(d, d) <= lite->radius_sq) {
+#ifdef RAYCASTER_SHADOW_CACHE
+      lite->shadow_version++;
+#endif
+#ifdef RAYCASTER_SHADOW_MAPS
+      light_update_shadow_map(lite);
+#endif
+    }
+  }
+
+#ifdef SHADOW_CACHES
+  update_segment_shadow_caches(this);
+  map_cache_update_shadow_caches(&this->cache);
+#endif
+#endif
+}
+
+void
+level_data_bake_lightmaps(level_data *this, float texel_size)
+{
+#ifdef RAYCASTER_LIGHTMAPS
+  int32_t i;
+  uint8_t side;
+
+  IF_DEBUG(printf("Baking %zu static lights ...\n", this->static_lights_count); double begin = M_SECONDS());
+
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp parallel for schedule(dynamic)
+#endif
+  for (i = 0; i < (int32_t)this->sectors_count; ++i) {
+    bake_plane_lightmap(this, &this->sectors[i], true, texel_size);
+    bake_plane_lightmap(this, &this->sectors[i], false, texel_size);
+  }
+
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp parallel for schedule(dynamic) private(side)
+#endif
+  for (i = 0; i < (int32_t)this->linedefs_count; ++i) {
+    for (side = 0; side < 2; ++side) {
+      if (this->linedefs[i].side[side].sector) {
+        bake_wall_lightmap(this, &this->linedefs[i], side, texel_size);
+      }
+    }
+  }
+
+  IF_DEBUG(printf("Time taken: %.3fs\n", M_SECONDS() - begin))
+#else
+  M_UNUSED(this);
+  M_UNUSED(texel_size);
+#endif
 }
 
 static bool
@@ -271,3 +433,217 @@ linedef_segment_contains_light(const linedef_segment *this, const light *lt)
   }
   return false;
 }
+
+#ifdef SHADOW_CACHES
+/* Create the shadow caches of lit wall segments and give their lights slots */
+static void
+update_segment_shadow_caches(level_data *this)
+{
+  register size_t i, j;
+  uint8_t side;
+  linedef *line;
+  linedef_segment *seg;
+  const sector *front, *back;
+
+  for (i = 0; i < this->linedefs_count; ++i) {
+    line = &this->linedefs[i];
+
+    for (side = 0; side < 2; ++side) {
+      if (!(front = line->side[side].sector) || !line->side[side].segments) {
+        continue;
+      }
+
+      back = line->side[!side].sector;
+
+      for (j = 0; j < line->segments; ++j) {
+        seg = &line->side[side].segments[j];
+
+        if (!seg->shadows && seg->lights_count) {
+          seg->shadows = shadow_cache_create_vertical(
+            seg->p0,
+            seg->p1,
+            back ? M_MIN(front->floor.height, back->floor.height) : front->floor.height,
+            back ? M_MAX(front->ceiling.height, back->ceiling.height) : front->ceiling.height
+          );
+        }
+
+        if (seg->shadows) {
+          shadow_cache_assign_lights(seg->shadows, seg->lights, seg->lights_count);
+        }
+      }
+    }
+  }
+}
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+/* Brightest of 'v' and the static lights at 'pos' that nothing blocks */
+M_INLINED float
+bake_texel(const level_data *this, const light **lights, size_t count, vec3f pos, bool horizontal, float v)
+{
+  register size_t i;
+  vec3f light_pos;
+  float dsq, fade;
+
+  for (i = 0; i < count; ++i) {
+    light_pos = entity_world_position(&lights[i]->entity);
+
+    if ((dsq = math_vec3_distance_squared(pos, light_pos)) > lights[i]->radius_sq) {
+      continue;
+    }
+
+    /* Floors and ceilings fade in as the light gets level with them, like in the renderer */
+    fade = horizontal ? math_min(1.f, fabsf(light_pos.z - pos.z) / VERTICAL_FADE_DIST) : 1.f;
+
+    if (lights[i]->strength * fade * (1.f - (dsq * lights[i]->radius_sq_inverse)) > v &&
+        !map_cache_intersect_3d(&this->cache, pos, light_pos)) {
+      v = lights[i]->strength * fade * (1.f - (dsq * lights[i]->radius_sq_inverse));
+    }
+  }
+
+  return v;
+}
+
+static void
+bake_wall_lightmap(level_data *this, linedef *line, uint8_t side, float texel_size)
+{
+  register size_t i, x, y;
+  const sector *front = line->side[side].sector, *back = line->side[!side].sector;
+  const light **lights = malloc(M_MAX(1, this->static_lights_count) * sizeof(light*));
+  size_t count = 0;
+  lightmap *lm;
+  vec2f pos2d;
+  float sign;
+
+  lightmap_destroy(line->side[side].lightmap);
+  line->side[side].lightmap = NULL;
+
+  if (!lights) {
+    return;
+  }
+
+  /* Static lights in front of the side and within reach of it */
+  for (i = 0; i < this->static_lights_count; ++i) {
+    pos2d = this->static_lights[i]->entity.position;
+    sign = math_sign(line->v0->point, line->v1->point, pos2d);
+
+    if ((side == 0 ? (sign < 0) : (sign > 0)) &&
+        math_line_segment_point_distance(line->v0->point, line->v1->point, pos2d) <= this->static_lights[i]->radius) {
+      lights[count++] = this->static_lights[i];
+    }
+  }
+
+  if (count && (lm = lightmap_create_vertical(
+    line->v0->point,
+    line->v1->point,
+    back ? M_MIN(front->floor.height, back->floor.height) : front->floor.height,
+    back ? M_MAX(front->ceiling.height, back->ceiling.height) : front->ceiling.height,
+    texel_size,
+    front->brightness
+  ))) {
+    for (y = 0; y < lm->grid.h; ++y) {
+      for (x = 0; x < lm->grid.w; ++x) {
+        lm->texels[(y * lm->grid.w) + x] = bake_texel(this, lights, count, surface_grid_texel_position(&lm->grid, x, y, 0.f), false, front->brightness);
+      }
+    }
+
+    line->side[side].lightmap = lm;
+  }
+
+  free(lights);
+}
+
+static void
+bake_plane_lightmap(level_data *this, sector *sect, bool is_floor, float texel_size)
+{
+  register size_t i, x, y;
+  int32_t dx, dy, n;
+  const int32_t height = is_floor ? sect->floor.height : sect->ceiling.height;
+  const light **lights = malloc(M_MAX(1, this->static_lights_count) * sizeof(light*));
+  vec2f min = VEC2F(FLT_MAX, FLT_MAX), max = VEC2F(-FLT_MAX, -FLT_MAX), d;
+  size_t count = 0;
+  uint8_t *inside;
+  lightmap *lm;
+  vec3f pos;
+  float sum, dz;
+
+  lightmap_destroy(sect->lightmaps[is_floor ? 0 : 1]);
+  sect->lightmaps[is_floor ? 0 : 1] = NULL;
+
+  /* Sky has no light */
+  if (!lights || (is_floor ? sect->floor.texture : sect->ceiling.texture) == TEXTURE_NONE) {
+    free(lights);
+    return;
+  }
+
+  for (i = 0; i < sect->linedefs_count; ++i) {
+    min = VEC2F(math_min(min.x, sect->linedefs[i]->xmin), math_min(min.y, sect->linedefs[i]->ymin));
+    max = VEC2F(math_max(max.x, sect->linedefs[i]->xmax), math_max(max.y, sect->linedefs[i]->ymax));
+  }
+
+  /* Static lights on the lit side of the plane whose radius reaches the sector bounds */
+  for (i = 0; i < this->static_lights_count; ++i) {
+    dz = is_floor ? (this->static_lights[i]->entity.z - height) : (height - this->static_lights[i]->entity.z);
+    d = VEC2F(
+      this->static_lights[i]->entity.position.x - math_clamp(this->static_lights[i]->entity.position.x, min.x, max.x),
+      this->static_lights[i]->entity.position.y - math_clamp(this->static_lights[i]->entity.position.y, min.y, max.y)
+    );
+
+    if (dz > 0.f && math_dot2(d, d) <= this->static_lights[i]->radius_sq) {
+      lights[count++] = this->static_lights[i];
+    }
+  }
+
+  if (!count || !(lm = lightmap_create_horizontal(min, max, texel_size, sect->brightness))) {
+    free(lights);
+    return;
+  }
+
+  if (!(inside = calloc(lm->grid.w * lm->grid.h, 1))) {
+    lightmap_destroy(lm);
+    free(lights);
+    return;
+  }
+
+  for (y = 0; y < lm->grid.h; ++y) {
+    for (x = 0; x < lm->grid.w; ++x) {
+      pos = surface_grid_texel_position(&lm->grid, x, y, height);
+
+      if ((inside[(y * lm->grid.w) + x] = sector_point_inside(sect, VEC2F(pos.x, pos.y)))) {
+        lm->texels[(y * lm->grid.w) + x] = bake_texel(this, lights, count, pos, true, sect->brightness);
+      }
+    }
+  }
+
+  /*
+   * Texels along the walls are partly in the sector even when their center is not,
+   * they take the average of their neighbours that are in
+   */
+  for (y = 0; y < lm->grid.h; ++y) {
+    for (x = 0; x < lm->grid.w; ++x) {
+      if (inside[(y * lm->grid.w) + x] == 1) {
+        continue;
+      }
+
+      for (sum = 0.f, n = 0, dy = -1; dy <= 1; ++dy) {
+        for (dx = -1; dx <= 1; ++dx) {
+          if ((int32_t)x + dx >= 0 && (int32_t)x + dx < lm->grid.w && (int32_t)y + dy >= 0 && (int32_t)y + dy < lm->grid.h &&
+              inside[((y + dy) * lm->grid.w) + x + dx] == 1) {
+            sum += lm->texels[((y + dy) * lm->grid.w) + x + dx];
+            n++;
+          }
+        }
+      }
+
+      if (n) {
+        lm->texels[(y * lm->grid.w) + x] = sum / n;
+      }
+    }
+  }
+
+  sect->lightmaps[is_floor ? 0 : 1] = lm;
+
+  free(inside);
+  free(lights);
+}
+#endif
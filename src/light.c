@@ -6,6 +6,406 @@ void light_set_position(light *this, vec3f position) {
   this->entity.position.x = position.x;
   this->entity.position.y = position.y;
   this->entity.z = position.z;
+#ifdef RAYCASTER_SHADOW_CACHE
+  this->shadow_version++;
+#endif
   level_data_update_lights(this->entity.level);
   map_cache_process_light(&this->entity.level->cache, this, previous_position);
+#ifdef RAYCASTER_SHADOW_MAPS
+  light_update_shadow_map(this);
+#endif
 }
+
+#if defined(RAYCASTER_SHADOW_CACHE) || defined(RAYCASTER_LIGHTMAPS)
+static surface_grid
+surface_grid_create(vec2f origin, vec2f axis, float z_min, float u_size, float v_size, float texel_size, bool vertical)
+{
+  return (surface_grid) {
+    .origin = origin,
+    .axis = axis,
+    .size = VEC2F(u_size, v_size),
+    .z_min = z_min,
+    .texel_size_inverse = 1.f / texel_size,
+    .w = (uint16_t)M_MAX(1, ceilf(u_size / texel_size)),
+    .h = (uint16_t)M_MAX(1, ceilf(v_size / texel_size)),
+    .vertical = vertical
+  };
+}
+
+surface_grid
+surface_grid_vertical(vec2f p0, vec2f p1, float z_min, float z_max, float texel_size)
+{
+  const vec2f direction = vec2f_sub(p1, p0);
+  const float length = sqrtf(math_dot2(direction, direction));
+
+  return surface_grid_create(
+    p0,
+    length > 0.f ? VEC2F(direction.x / length, direction.y / length) : VEC2F(1.f, 0.f),
+    z_min,
+    length,
+    z_max - z_min,
+    texel_size,
+    true
+  );
+}
+
+surface_grid
+surface_grid_horizontal(vec2f min, vec2f max, float texel_size)
+{
+  return surface_grid_create(min, VEC2F(1.f, 0.f), 0.f, max.x - min.x, max.y - min.y, texel_size, false);
+}
+
+void*
+surface_grid_alloc_texels(const surface_grid *this, size_t texel_size)
+{
+  return calloc((size_t)this->w * this->h, texel_size);
+}
+
+vec3f
+surface_grid_texel_position(const surface_grid *this, uint16_t x, uint16_t y, float z)
+{
+  /* The last texels may reach past the surface, their centers are kept on it */
+  const float u = math_min((x + 0.5f) / this->texel_size_inverse, this->size.x);
+  const float v = math_min((y + 0.5f) / this->texel_size_inverse, this->size.y);
+
+  if (this->vertical) {
+    return VEC3F(this->origin.x + (this->axis.x * u), this->origin.y + (this->axis.y * u), this->z_min + v);
+  }
+
+  return VEC3F(this->origin.x + u, this->origin.y + v, z);
+}
+#endif
+
+#ifdef RAYCASTER_SHADOW_CACHE
+static shadow_cache*
+shadow_cache_create(surface_grid grid)
+{
+  shadow_cache *this = calloc(1, sizeof(shadow_cache));
+
+  if (!this) {
+    return NULL;
+  }
+
+  this->grid = grid;
+
+  if (!(this->texels = surface_grid_alloc_texels(&grid, MAX_LIGHTS_PER_SURFACE))) {
+    free(this);
+    return NULL;
+  }
+
+  return this;
+}
+
+shadow_cache*
+shadow_cache_create_vertical(vec2f p0, vec2f p1, float z_min, float z_max)
+{
+  return shadow_cache_create(surface_grid_vertical(p0, p1, z_min, z_max, SHADOW_CACHE_TEXEL_SIZE));
+}
+
+shadow_cache*
+shadow_cache_create_horizontal(vec2f min, vec2f max)
+{
+  return shadow_cache_create(surface_grid_horizontal(min, max, SHADOW_CACHE_TEXEL_SIZE));
+}
+
+void
+shadow_cache_destroy(shadow_cache *this)
+{
+  if (this) {
+    free(this->texels);
+    free(this);
+  }
+}
+
+void
+shadow_cache_assign_lights(shadow_cache *this, light *const *lights, uint8_t count)
+{
+  register uint32_t t;
+  register uint8_t i, slot;
+
+  /* Free the slots of lights that left the surface or whose shadows changed */
+  for (slot = 0; slot < MAX_LIGHTS_PER_SURFACE; ++slot) {
+    if (!this->lights[slot]) {
+      continue;
+    }
+
+    for (i = 0; i < count && lights[i] != this->lights[slot]; ++i);
+
+    if (i == count || this->versions[slot] != this->lights[slot]->shadow_version) {
+      this->lights[slot] = NULL;
+    }
+  }
+
+  for (i = 0; i < count; ++i) {
+    for (slot = 0; slot < MAX_LIGHTS_PER_SURFACE && this->lights[slot] != lights[i]; ++slot);
+
+    if (slot < MAX_LIGHTS_PER_SURFACE) {
+      continue;
+    }
+
+    /* Surfaces have at most as many lights as slots, so there is always a free one */
+    for (slot = 0; slot < MAX_LIGHTS_PER_SURFACE && this->lights[slot]; ++slot);
+
+    if (slot == MAX_LIGHTS_PER_SURFACE) {
+      return;
+    }
+
+    for (t = slot; t < (uint32_t)this->grid.w * this->grid.h * MAX_LIGHTS_PER_SURFACE; t += MAX_LIGHTS_PER_SURFACE) {
+      this->texels[t] = SHADOW_CACHE_UNKNOWN;
+    }
+
+    this->versions[slot] = lights[i]->shadow_version;
+    this->lights[slot] = lights[i];
+  }
+}
+#endif
+
+#ifdef RAYCASTER_SHADOW_MAPS
+/* Nearest occluders along one ray out of the light */
+typedef struct {
+  float solid, dropped;
+  uint8_t count;
+  struct {
+    const linedef *line;
+    float distance;
+  } portals[SHADOW_MAP_OPENINGS + 1];
+} shadow_map_ray;
+
+/* Unit direction of a pseudo angle from light_shadow_map_direction_angle */
+static vec2f
+shadow_map_direction(float angle)
+{
+  const float f = angle - floorf(angle);
+  vec2f d;
+
+  switch ((uint8_t)angle & 3) {
+  case 0: d = VEC2F(1.f - f, f); break;
+  case 1: d = VEC2F(-f, 1.f - f); break;
+  case 2: d = VEC2F(f - 1.f, -f); break;
+  default: d = VEC2F(f, f - 1.f); break;
+  }
+
+  return math_normalize(d);
+}
+
+static void
+cast_shadow_map_ray(shadow_map_ray *ray, vec2f origin, vec2f direction, float length, linedef **lines, size_t lines_count)
+{
+  register size_t i, j;
+  const vec2f end = VEC2F(origin.x + (direction.x * length), origin.y + (direction.y * length));
+  const linedef *line;
+  float t, distance;
+
+  ray->solid = ray->dropped = FLT_MAX;
+  ray->count = 0;
+
+  for (i = 0; i < lines_count; ++i) {
+    line = lines[i];
+
+    if (!math_find_line_intersection(origin, end, line->v0->point, line->v1->point, NULL, &t)) {
+      continue;
+    }
+
+    distance = t * length;
+
+    /* One sided lines and closed doors stop the ray */
+    if (!line->side[1].sector || line->max_floor_height >= line->min_ceiling_height) {
+      ray->solid = math_min(ray->solid, distance);
+      continue;
+    }
+
+    /* Keep the nearest openings sorted, remembering the nearest one that didn't fit */
+    if (ray->count == SHADOW_MAP_OPENINGS + 1) {
+      if (distance >= ray->portals[SHADOW_MAP_OPENINGS].distance) {
+        ray->dropped = math_min(ray->dropped, distance);
+        continue;
+      }
+      ray->dropped = math_min(ray->dropped, ray->portals[SHADOW_MAP_OPENINGS].distance);
+      j = SHADOW_MAP_OPENINGS;
+    } else {
+      j = ray->count++;
+    }
+
+    for (; j > 0 && ray->portals[j - 1].distance > distance; --j) {
+      ray->portals[j] = ray->portals[j - 1];
+    }
+
+    ray->portals[j].line = line;
+    ray->portals[j].distance = distance;
+  }
+}
+
+/*
+ * Occluders of the angle between two neighbouring rays. Lines either ray hits count
+ * at the furthest distance they're hit at, so that a point on a wall is never behind
+ * that same wall when it's in between the rays.
+ */
+static void
+merge_shadow_map_rays(shadow_map_angle *angle, const shadow_map_ray *a, const shadow_map_ray *b)
+{
+  register uint8_t i, j, count = 0;
+  const shadow_map_ray *rays[2] = { a, b };
+  const float dropped = math_min(a->dropped, b->dropped);
+  const float far = math_max(a->solid, b->solid);
+  const linedef *lines[2 * (SHADOW_MAP_OPENINGS + 1)];
+  float distances[2 * (SHADOW_MAP_OPENINGS + 1)], distance;
+  const linedef *line;
+  uint8_t r;
+
+  angle->far = math_min(far, dropped);
+  angle->complete = dropped >= far;
+
+  for (r = 0; r < 2; ++r) {
+    for (i = 0; i < rays[r]->count; ++i) {
+      line = rays[r]->portals[i].line;
+      distance = rays[r]->portals[i].distance;
+
+      for (j = 0; j < count && lines[j] != line; ++j);
+
+      if (j < count) {
+        distance = math_max(distance, distances[j]);
+        for (; j + 1 < count; ++j) {
+          lines[j] = lines[j + 1];
+          distances[j] = distances[j + 1];
+        }
+        count--;
+      }
+
+      for (j = count++; j > 0 && distances[j - 1] > distance; --j) {
+        lines[j] = lines[j - 1];
+        distances[j] = distances[j - 1];
+      }
+
+      lines[j] = line;
+      distances[j] = distance;
+    }
+  }
+
+  for (i = 0, angle->openings_count = 0; i < count && distances[i] < angle->far; ++i) {
+    if (angle->openings_count == SHADOW_MAP_OPENINGS) {
+      angle->far = distances[i];
+      angle->complete = false;
+      break;
+    }
+
+    angle->openings[angle->openings_count++] = (shadow_map_opening) {
+      .distance = distances[i],
+      .floor = lines[i]->max_floor_height,
+      .ceiling = lines[i]->min_ceiling_height
+    };
+  }
+}
+
+void
+light_update_shadow_map(light *this)
+{
+  register size_t i;
+  register int32_t x, y;
+  level_data *level = this->entity.level;
+  const map_cache *cache = &level->cache;
+  const vec2f origin = this->entity.position;
+  const int32_t x0 = M_MAX(0, (int32_t)floorf((origin.x - this->radius - cache->origin.x) * cache->cell_size_inverse));
+  const int32_t y0 = M_MAX(0, (int32_t)floorf((origin.y - this->radius - cache->origin.y) * cache->cell_size_inverse));
+  const int32_t x1 = M_MIN(cache->w - 1, (int32_t)floorf((origin.x + this->radius - cache->origin.x) * cache->cell_size_inverse));
+  const int32_t y1 = M_MIN(cache->h - 1, (int32_t)floorf((origin.y + this->radius - cache->origin.y) * cache->cell_size_inverse));
+  const map_cache_cell *cell;
+  linedef **lines;
+  size_t lines_count = 0;
+  bool *seen;
+  shadow_map_ray rays[2];
+
+  if (!this->shadow_map && !(this->shadow_map = malloc(SHADOW_MAP_ANGLES * sizeof(shadow_map_angle)))) {
+    return;
+  }
+
+  seen = calloc(level->linedefs_count, sizeof(bool));
+  lines = malloc(level->linedefs_count * sizeof(linedef*));
+
+  if (!seen || !lines) {
+    free(seen);
+    free(lines);
+    free(this->shadow_map);
+    this->shadow_map = NULL;
+    return;
+  }
+
+  /* Lines in the map cache cells the light reaches, each once */
+  for (y = y0; y <= y1; ++y) {
+    for (x = x0; x <= x1; ++x) {
+      cell = &cache->cells[(y * cache->w) + x];
+
+      for (i = cell->offset; i < cell->offset + cell->count; ++i) {
+        if (!seen[cache->references[i]]) {
+          seen[cache->references[i]] = true;
+          lines[lines_count++] = &level->linedefs[cache->references[i]];
+        }
+      }
+    }
+  }
+
+  /* Angle i lies between rays i and i + 1 */
+  cast_shadow_map_ray(&rays[0], origin, shadow_map_direction(0.f), this->radius, lines, lines_count);
+
+  for (i = 0; i < SHADOW_MAP_ANGLES; ++i) {
+    cast_shadow_map_ray(
+      &rays[(i + 1) & 1],
+      origin,
+      shadow_map_direction((float)((i + 1) % SHADOW_MAP_ANGLES) * (4.f / SHADOW_MAP_ANGLES)),
+      this->radius,
+      lines,
+      lines_count
+    );
+    merge_shadow_map_rays(&this->shadow_map[i], &rays[i & 1], &rays[(i + 1) & 1]);
+  }
+
+  free(seen);
+  free(lines);
+}
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+static lightmap*
+lightmap_create(surface_grid grid, float brightness)
+{
+  register size_t i;
+  lightmap *this = calloc(1, sizeof(lightmap));
+
+  if (!this) {
+    return NULL;
+  }
+
+  this->grid = grid;
+
+  if (!(this->texels = surface_grid_alloc_texels(&grid, sizeof(float)))) {
+    free(this);
+    return NULL;
+  }
+
+  for (i = 0; i < (size_t)grid.w * grid.h; ++i) {
+    this->texels[i] = brightness;
+  }
+
+  return this;
+}
+
+lightmap*
+lightmap_create_vertical(vec2f p0, vec2f p1, float z_min, float z_max, float texel_size, float brightness)
+{
+  return lightmap_create(surface_grid_vertical(p0, p1, z_min, z_max, texel_size), brightness);
+}
+
+lightmap*
+lightmap_create_horizontal(vec2f min, vec2f max, float texel_size, float brightness)
+{
+  return lightmap_create(surface_grid_horizontal(min, max, texel_size), brightness);
+}
+
+void
+lightmap_destroy(lightmap *this)
+{
+  if (this) {
+    free(this->texels);
+    free(this);
+  }
+}
+#endif
@@ -26,6 +26,9 @@ linedef_create_segments_for_side(linedef *this, int side)
   
   for (i = 0, d = 0.f; i < this->segments; ++i, d += seg_len) {
     this->side[side].segments[i].lights_count = 0;
+#ifdef RAYCASTER_SHADOW_CACHE
+    this->side[side].segments[i].shadows = NULL;
+#endif
     this->side[side].segments[i].p0 = vec2f_add(this->v0->point, vec2f_mul(dir, d));
     this->side[side].segments[i].p1 = vec2f_add(this->v0->point, vec2f_mul(dir, math_min(1.f, d + seg_len)));
     // printf("\tSegment %d: (%d, %d) <-> (%d, %d)\n", i, XY(this->side[side].segments[i].p0), XY(this->side[side].segments[i].p1));
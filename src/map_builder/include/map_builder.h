@@ -8,6 +8,8 @@ struct level_data;
 typedef struct {
   size_t polygons_count;
   polygon *polygons;
+  /* Map cache cell size of the built level, 0 to choose one from its linedefs */
+  float cell_size;
 } map_builder;
 
 void
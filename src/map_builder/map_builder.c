@@ -50,6 +50,10 @@ map_builder_build(map_builder *this)
   level->linedefs_count = 0;
   level->vertices_count = 0;
   level->lights_count = 0;
+#ifdef RAYCASTER_LIGHTMAPS
+  level->static_lights = NULL;
+  level->static_lights_count = 0;
+#endif
   level->sky_texture = TEXTURE_NONE;
 
   IF_DEBUG(printf("Building level (0x%p) ...\n", (void*)level))
@@ -78,7 +82,7 @@ map_builder_build(map_builder *this)
 
   IF_DEBUG(printf("4. Prepare map cache ...\n"))
 
-  map_cache_process_level_data(&level->cache, level);
+  map_cache_process_level_data(&level->cache, level, this->cell_size);
 
   /* ------------ */
 
@@ -278,7 +282,10 @@ map_builder_step_configure_back_sectors(map_builder *this, level_data *level)
         }
       }
 
-      back->linedefs_count = new_count;
+      if (back->linedefs_count != new_count) {
+        back->linedefs_count = new_count;
+        sector_update_geometry(back);
+      }
     }
   }
 }
@@ -2,84 +2,253 @@
 #include "level_data.h"
 #include <time.h>
 
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #include <omp.h>
+#endif
+
+#if defined(RAYCASTER_SIMD_RAY_TESTS)
+  #if __ARM_NEON
+    #include <arm_neon.h>
+  #else
+    #include <xmmintrin.h>
+  #endif
+#endif
+
+/* Most cells with linedefs a ray packet may cross before falling back to single rays */
+#define MAP_CACHE_PACKET_CELLS 64
+
+/* Linedefs closer than this to a cell's edge are put in the cell too */
+#define MAP_CACHE_RASTER_EPSILON 0.001f
+
 
 /* FORWARD DECLARATIONS */
 
+typedef struct {
+  int ix, iy, ix_end, iy_end, step_x, step_y;
+  float t, t_max_x, t_max_y, t_delta_x, t_delta_y;
+} cell_walk;
+
+typedef struct {
+  float start_x[MAP_CACHE_PACKET_SIZE], start_y[MAP_CACHE_PACKET_SIZE], start_z[MAP_CACHE_PACKET_SIZE];
+  float direction_x[MAP_CACHE_PACKET_SIZE], direction_y[MAP_CACHE_PACKET_SIZE], direction_z[MAP_CACHE_PACKET_SIZE];
+} ray_packet;
+
+static uint32_t
+linedef_cells_bound(const map_cache*, const linedef*);
+
+static uint32_t
+rasterize_linedef(const map_cache*, const linedef*, uint32_t*);
+
+static bool
+cell_walk_begin(const map_cache*, vec3f, vec3f, cell_walk*);
+
+static bool
+cell_walk_step(const map_cache*, cell_walk*);
+
+static bool
+cell_walk_skip_empty(const map_cache*, cell_walk*);
+
 static bool
 collide(const map_cache*, int, int, float, float, float, vec3f, vec3f, vec2f, vec2f);
 
+static uint8_t
+collide_packet(const map_cache*, const map_cache_cell*, const ray_packet*);
+
 static void
 map_cache_add_or_remove_light_at_position(map_cache*, light*, vec3f, bool);
 
+#ifdef SHADOW_CACHES
+static void
+update_cell_shadow_caches(map_cache*, uint16_t, uint16_t);
+#endif
+
 
 /* PUBLIC API */
 
 void
-map_cache_process_level_data(map_cache *this, level_data *data)
+map_cache_process_level_data(map_cache *this, level_data *data, float cell_size)
 {
   register size_t i;
+  register uint32_t c;
+  int32_t l;
   int16_t x, y;
-  const int16_t cells_w = (int16_t)math_max(1, ceilf((data->max.x - data->min.x) / CELL_SIZE));
-  const int16_t cells_h = (int16_t)math_max(1, ceilf((data->max.y - data->min.y) / CELL_SIZE));
-  vec2f v0, v1, p0, p1, p2, p3;
-  linedef *line;
+  float *lines;
+  uint32_t *line_cells, *line_cells_offset, *line_cells_count;
+  const vec2f bounds = vec2f_sub(data->max, data->min);
+  const float size = cell_size > 0.f ? cell_size : map_cache_auto_cell_size(data);
+  const int16_t cells_w = (int16_t)math_clamp(ceilf(bounds.x / size), 1, INT16_MAX);
+  const int16_t cells_h = (int16_t)math_clamp(ceilf(bounds.y / size), 1, INT16_MAX);
   map_cache_cell *cell;
 
   IF_DEBUG(printf(
     "\tLevel bounds:\n"
     "\t\tMin: %f, %f\n"
     "\t\tMax: %f, %f\n"
+    "\tCell size: %f\n"
     "\tHorizontal cells: %d\n"
     "\tVertical cells: %d\n",
     data->min.x, data->min.y,
     data->max.x, data->max.y,
+    size,
     cells_w,
     cells_h
-  ); clock_t begin = clock());
+  ); double begin = M_SECONDS());
 
   this->w = cells_w;
   this->h = cells_h;
   this->origin = data->min;
+  this->cell_size = size;
+  this->cell_size_inverse = 1.f / size;
   this->cells = malloc(sizeof(map_cache_cell)*cells_w*cells_h);
 
+  for (i = 0; i < (size_t)cells_w * cells_h; ++i) {
+    cell = &this->cells[i];
+    cell->offset = cell->count = 0;
+    cell->lights_count = 0;
+#ifdef RAYCASTER_SHADOW_CACHE
+    cell->shadows[0] = cell->shadows[1] = NULL;
+#endif
+  }
+
+  /* One block for all linedef arrays */
+  lines = malloc(6 * M_MAX(1, data->linedefs_count) * sizeof(float));
+  this->linedefs = (map_cache_linedefs) {
+    .count = data->linedefs_count,
+    .v0_x = lines,
+    .v0_y = lines + data->linedefs_count,
+    .direction_x = lines + data->linedefs_count * 2,
+    .direction_y = lines + data->linedefs_count * 3,
+    .max_floor_height = lines + data->linedefs_count * 4,
+    .min_ceiling_height = lines + data->linedefs_count * 5
+  };
+
+  /* Every linedef gets room for the most cells it can cover, so they can be rasterized independently */
+  line_cells_offset = malloc((data->linedefs_count + 1) * sizeof(uint32_t));
+  line_cells_count = malloc(M_MAX(1, data->linedefs_count) * sizeof(uint32_t));
+  line_cells_offset[0] = 0;
+
+  for (i = 0; i < data->linedefs_count; ++i) {
+    line_cells_offset[i + 1] = line_cells_offset[i] + linedef_cells_bound(this, &data->linedefs[i]);
+  }
+
+  line_cells = malloc(M_MAX(1, line_cells_offset[data->linedefs_count]) * sizeof(uint32_t));
+
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp parallel for schedule(dynamic, 64)
+#endif
+  for (l = 0; l < (int32_t)data->linedefs_count; ++l) {
+    map_cache_update_linedef(this, l, &data->linedefs[l]);
+    line_cells_count[l] = rasterize_linedef(this, &data->linedefs[l], &line_cells[line_cells_offset[l]]);
+  }
+
+  /* Compact the cells of all linedefs into the references, each cell's in linedef order */
+  for (i = 0; i < data->linedefs_count; ++i) {
+    for (c = 0; c < line_cells_count[i]; ++c) {
+      this->cells[line_cells[line_cells_offset[i] + c]].count++;
+    }
+  }
+
+  for (i = 0, this->references_count = 0; i < (size_t)cells_w * cells_h; ++i) {
+    this->cells[i].offset = this->references_count;
+    this->references_count += this->cells[i].count;
+    this->cells[i].count = 0;
+  }
+
+  this->references = malloc(M_MAX(1, this->references_count) * sizeof(uint32_t));
+
+  for (i = 0; i < data->linedefs_count; ++i) {
+    for (c = 0; c < line_cells_count[i]; ++c) {
+      cell = &this->cells[line_cells[line_cells_offset[i] + c]];
+      this->references[cell->offset + cell->count++] = (uint32_t)i;
+    }
+  }
+
+  free(line_cells);
+  free(line_cells_offset);
+  free(line_cells_count);
+
+  this->blocks_w = (cells_w + MAP_CACHE_BLOCK_SIZE - 1) / MAP_CACHE_BLOCK_SIZE;
+  this->blocks_h = (cells_h + MAP_CACHE_BLOCK_SIZE - 1) / MAP_CACHE_BLOCK_SIZE;
+  this->blocks = calloc(this->blocks_w * this->blocks_h, sizeof(bool));
+
   for (y = 0; y < cells_h; ++y) {
     for (x = 0; x < cells_w; ++x) {
-      cell = &this->cells[y*cells_w + x];
-      cell->count = 0;
-      cell->lights_count = 0;
-
-      p0 = VEC2F(x*CELL_SIZE, y*CELL_SIZE);
-      p1 = VEC2F(x*CELL_SIZE+CELL_SIZE, y*CELL_SIZE);
-      p2 = VEC2F(x*CELL_SIZE+CELL_SIZE, y*CELL_SIZE+CELL_SIZE);
-      p3 = VEC2F(x*CELL_SIZE, y*CELL_SIZE+CELL_SIZE);
-
-      for (i = 0; i < data->linedefs_count; ++i) {
-        line = &data->linedefs[i];
-
-        v0 = vec2f_sub(line->v0->point, this->origin);
-        v1 = vec2f_sub(line->v1->point, this->origin);
-
-        if (math_find_line_intersection(v0, v1, p0, p1, NULL, NULL) ||
-            math_find_line_intersection(v0, v1, p1, p2, NULL, NULL) ||
-            math_find_line_intersection(v0, v1, p2, p3, NULL, NULL) ||
-            math_find_line_intersection(v0, v1, p3, p0, NULL, NULL) ||
-            ((v0.x >= p0.x && v0.y >= p0.y && v0.x < p2.x && v0.y < p2.y) &&
-             (v1.x >= p0.x && v1.y >= p0.y && v1.x < p2.x && v1.y < p2.y))
-        ) {
-          if (cell->count == 0) {
-            cell->linedefs = (linedef**)malloc(sizeof(linedef*));
-          } else {
-            cell->linedefs = (linedef**)realloc(cell->linedefs, (cell->count+1)*sizeof(linedef*));
-          }
-          cell->linedefs[cell->count++] = line;
-        }
+      if (this->cells[y*cells_w + x].count) {
+        this->blocks[(y / MAP_CACHE_BLOCK_SIZE)*this->blocks_w + (x / MAP_CACHE_BLOCK_SIZE)] = true;
       }
-
-      // printf("Cell %d, %d references %d lines\n", x, y, cell->count);
     }
   }
 
-  IF_DEBUG(printf("Time taken: %.3fs\n", (double)(clock() - begin) / CLOCKS_PER_SEC))
+  IF_DEBUG(printf("Time taken: %.3fs\n", M_SECONDS() - begin))
+}
+
+float
+map_cache_auto_cell_size(const level_data *data)
+{
+  register size_t i;
+  const vec2f bounds = vec2f_sub(data->max, data->min);
+  float length = 0.f, cell_size;
+
+  if (!data->linedefs_count) {
+    return MAP_CACHE_DEFAULT_CELL_SIZE;
+  }
+
+  for (i = 0; i < data->linedefs_count; ++i) {
+    length += math_length(data->linedefs[i].direction);
+  }
+
+  cell_size = math_max(
+    length / data->linedefs_count,
+    sqrtf((bounds.x * bounds.y) / (data->linedefs_count * MAP_CACHE_MAX_CELLS_PER_LINEDEF))
+  );
+
+  cell_size = math_min(MAP_CACHE_MAX_CELL_SIZE, math_max(MAP_CACHE_MIN_CELL_SIZE, cell_size));
+
+  /* Cell counts along each side have to fit map_cache's 16-bit sizes, even past the maximum */
+  return math_max(cell_size, math_max(bounds.x, bounds.y) / INT16_MAX);
+}
+
+void
+map_cache_destroy(map_cache *this)
+{
+#ifdef RAYCASTER_SHADOW_CACHE
+  register size_t i;
+
+  for (i = 0; i < (size_t)this->w * this->h; ++i) {
+    shadow_cache_destroy(this->cells[i].shadows[0]);
+    shadow_cache_destroy(this->cells[i].shadows[1]);
+  }
+#endif
+
+  free(this->cells);
+  free(this->references);
+  free(this->linedefs.v0_x);
+  free(this->blocks);
+  this->cells = NULL;
+  this->references = NULL;
+  this->linedefs = (map_cache_linedefs) { 0 };
+  this->blocks = NULL;
+  this->references_count = 0;
+  this->w = this->h = 0;
+}
+
+void
+map_cache_update_linedef(map_cache *this, size_t index, const linedef *line)
+{
+  map_cache_linedefs *lines = &this->linedefs;
+
+  lines->v0_x[index] = line->v0->point.x;
+  lines->v0_y[index] = line->v0->point.y;
+  lines->direction_x[index] = line->direction.x;
+  lines->direction_y[index] = line->direction.y;
+
+  if (line->side[1].sector) {
+    lines->max_floor_height[index] = line->max_floor_height;
+    lines->min_ceiling_height[index] = line->min_ceiling_height;
+  } else {
+    lines->max_floor_height[index] = FLT_MAX;
+    lines->min_ceiling_height[index] = -FLT_MAX;
+  }
 }
 
 void
@@ -89,123 +258,347 @@ map_cache_process_light(map_cache *this, light *light, vec3f previous_position)
   map_cache_add_or_remove_light_at_position(this, light, entity_world_position(&light->entity), true);
 }
 
+#ifdef SHADOW_CACHES
+void
+map_cache_update_shadow_caches(map_cache *this)
+{
+  register uint16_t x, y;
+
+  for (y = 0; y < this->h; ++y) {
+    for (x = 0; x < this->w; ++x) {
+      update_cell_shadow_caches(this, x, y);
+    }
+  }
+}
+#endif
+
 bool
 map_cache_intersect_3d(const map_cache *this, vec3f _start, vec3f _end)
+{
+  const float dz = _end.z - _start.z;
+  const vec2f ray_start_xy = VEC2F(_start.x, _start.y);
+  const vec2f ray_end_xy = VEC2F(_end.x, _end.y);
+  const vec2f ray_direction_xy = vec2f_sub(ray_end_xy, ray_start_xy);
+  cell_walk walk;
+
+  if (!cell_walk_begin(this, _start, _end, &walk)) {
+    return true;
+  }
+
+  do {
+    if (collide(this, walk.ix, walk.iy, _start.z + walk.t * dz, _start.z + ((walk.t_max_x < walk.t_max_y) ? walk.t_max_x : walk.t_max_y) * dz, dz, _start, _end, ray_start_xy, ray_direction_xy)) {
+      return true;
+    }
+  } while (cell_walk_step(this, &walk));
+
+  return false;
+}
+
+uint8_t
+map_cache_intersect_3d_n(const map_cache *this, const vec3f *starts, const vec3f *ends, uint8_t count)
+{
+  register uint8_t i;
+  register size_t c;
+  const map_cache_cell *cells[MAP_CACHE_PACKET_CELLS], *cell;
+  size_t cells_count = 0;
+  uint8_t active = 0, blocked = 0, lane;
+  ray_packet packet;
+  cell_walk walk;
+
+  for (i = 0; i < MAP_CACHE_PACKET_SIZE; ++i) {
+    /* Unused lanes repeat the first ray and are masked out of the result */
+    lane = i < count ? i : 0;
+    packet.start_x[i] = starts[lane].x;
+    packet.start_y[i] = starts[lane].y;
+    packet.start_z[i] = starts[lane].z;
+    packet.direction_x[i] = ends[lane].x - starts[lane].x;
+    packet.direction_y[i] = ends[lane].y - starts[lane].y;
+    packet.direction_z[i] = ends[lane].z - starts[lane].z;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if (!cell_walk_begin(this, starts[i], ends[i], &walk)) {
+      blocked |= 1 << i;
+      continue;
+    }
+
+    active |= 1 << i;
+
+    do {
+      cell = &this->cells[walk.iy*this->w+walk.ix];
+
+      if (cell->count == 0) {
+        continue;
+      }
+
+      /* Neighbouring rays cross mostly the same cells, so they are gathered only once */
+      for (c = cells_count; c > 0 && cells[c - 1] != cell; --c);
+
+      if (c > 0) {
+        continue;
+      }
+
+      if (cells_count == MAP_CACHE_PACKET_CELLS) {
+        /* Lanes not walked yet are traced too, those off the map already are blocked */
+        for (lane = 0; lane < count; ++lane) {
+          if (!((blocked >> lane) & 1) && map_cache_intersect_3d(this, starts[lane], ends[lane])) {
+            blocked |= 1 << lane;
+          }
+        }
+        return blocked;
+      }
+
+      cells[cells_count++] = cell;
+    } while (cell_walk_step(this, &walk));
+  }
+
+  for (c = 0; c < cells_count && (blocked & active) != active; ++c) {
+    blocked |= collide_packet(this, cells[c], &packet) & active;
+  }
+
+  return blocked;
+}
+
+
+/* PRIVATE FUNCTIONS */
+
+/* Cells from 'first' to 'last' along one axis that the closed range from 'min' to 'max' touches */
+M_INLINED void
+cell_range(const map_cache *this, float min, float max, uint16_t cells, int *first, int *last)
+{
+  *first = M_MAX(0, (int)floorf((min - MAP_CACHE_RASTER_EPSILON) * this->cell_size_inverse));
+  *last = M_MIN(cells - 1, (int)floorf((max + MAP_CACHE_RASTER_EPSILON) * this->cell_size_inverse));
+}
+
+/*
+ * Most cells rasterize_linedef can put the linedef in. Neighbouring columns share at
+ * most the two rows around the point where the linedef crosses between them, and a
+ * vertical linedef on a column edge goes into both columns whole, so twice the
+ * columns and rows the linedef spans are always enough.
+ */
+static uint32_t
+linedef_cells_bound(const map_cache *this, const linedef *line)
+{
+  const vec2f v0 = vec2f_sub(line->v0->point, this->origin), v1 = vec2f_sub(line->v1->point, this->origin);
+  int x0, x1, y0, y1;
+
+  cell_range(this, math_min(v0.x, v1.x), math_max(v0.x, v1.x), this->w, &x0, &x1);
+  cell_range(this, math_min(v0.y, v1.y), math_max(v0.y, v1.y), this->h, &y0, &y1);
+
+  return (uint32_t)M_MAX(0, 2 * ((x1 - x0 + 1) + (y1 - y0 + 1)));
+}
+
+/*
+ * Supercover rasterization of a linedef, writes the index of every cell it touches
+ * (edges and corners included) to 'cells' and returns how many there are. Goes
+ * column by column, the rows of each are the ones the linedef's part over it spans.
+ */
+static uint32_t
+rasterize_linedef(const map_cache *this, const linedef *line, uint32_t *cells)
+{
+  register int cx, cy;
+  vec2f v0 = vec2f_sub(line->v0->point, this->origin), v1 = vec2f_sub(line->v1->point, this->origin), t;
+  int cx_first, cx_last, cy_first, cy_last;
+  float x0, x1, y0, y1, slope;
+  uint32_t count = 0;
+
+  if (v1.x < v0.x) {
+    t = v0;
+    v0 = v1;
+    v1 = t;
+  }
+
+  const float y_min = math_min(v0.y, v1.y), y_max = math_max(v0.y, v1.y);
+  const bool vertical = v1.x - v0.x < MATHS_EPSILON;
+
+  slope = vertical ? 0.f : (v1.y - v0.y) / (v1.x - v0.x);
+
+  cell_range(this, v0.x, v1.x, this->w, &cx_first, &cx_last);
+
+  for (cx = cx_first; cx <= cx_last; ++cx) {
+    if (vertical) {
+      y0 = y_min;
+      y1 = y_max;
+    } else {
+      x0 = math_max(v0.x, cx * this->cell_size);
+      x1 = math_min(v1.x, (cx + 1) * this->cell_size);
+      y0 = math_clamp(v0.y + (x0 - v0.x) * slope, y_min, y_max);
+      y1 = math_clamp(v0.y + (x1 - v0.x) * slope, y_min, y_max);
+    }
+
+    cell_range(this, math_min(y0, y1), math_max(y0, y1), this->h, &cy_first, &cy_last);
+
+    for (cy = cy_first; cy <= cy_last; ++cy) {
+      cells[count++] = (uint32_t)(cy * this->w + cx);
+    }
+  }
+
+  return count;
+}
+
+/* Start walking the cells from '_start' to '_end', false when either is off the map */
+M_INLINED bool
+cell_walk_begin(const map_cache *this, vec3f _start, vec3f _end, cell_walk *walk)
 {
   float dx = _end.x - _start.x;
   float dy = _end.y - _start.y;
-  float dz = _end.z - _start.z;
   float fdx = 1.f / fabsf(dx);
   float fdy = 1.f / fabsf(dy);
 
-  const vec2f ray_start_xy = VEC2F(_start.x, _start.y);
-  const vec2f ray_end_xy = VEC2F(_end.x, _end.y);
-  const vec2f ray_direction_xy = vec2f_sub(ray_end_xy, ray_start_xy);
-
-  vec2f start = vec2f_sub(ray_start_xy, this->origin);
-  vec2f end = vec2f_sub(ray_end_xy, this->origin);
+  vec2f start = vec2f_sub(VEC2F(_start.x, _start.y), this->origin);
+  vec2f end = vec2f_sub(VEC2F(_end.x, _end.y), this->origin);
 
   start.x += (dx < 0) ? -0.001f : (dx > 0) ? 0.001f : 0.f;
   start.y += (dy < 0) ? -0.001f : (dy > 0) ? 0.001f : 0.f;
   end.x += (dx < 0) ? -0.001f : (dx > 0) ? 0.001f : 0.f;
   end.y += (dy < 0) ? -0.001f : (dy > 0) ? 0.001f : 0.f;
 
-  int ix = (int)floorf(start.x / CELL_SIZE);
-  int iy = (int)floorf(start.y / CELL_SIZE);
+  walk->ix = (int)floorf(start.x * this->cell_size_inverse);
+  walk->iy = (int)floorf(start.y * this->cell_size_inverse);
 
-  if (ix < 0 || iy < 0 || ix >= this->w || iy >= this->h) {
-    return true;
+  if (walk->ix < 0 || walk->iy < 0 || walk->ix >= this->w || walk->iy >= this->h) {
+    return false;
   }
 
-  const int ix_end = (int)floorf(end.x / CELL_SIZE);
-  const int iy_end = (int)floorf(end.y / CELL_SIZE);
+  walk->ix_end = (int)floorf(end.x * this->cell_size_inverse);
+  walk->iy_end = (int)floorf(end.y * this->cell_size_inverse);
 
-  if (ix_end < 0 || iy_end < 0 || ix_end >= this->w || iy_end >= this->h) {
-    return true;
+  if (walk->ix_end < 0 || walk->iy_end < 0 || walk->ix_end >= this->w || walk->iy_end >= this->h) {
+    return false;
   }
 
-  const int step_x = (dx > 0) ? 1 : (dx < 0) ? -1 : 0;
-  const int step_y = (dy > 0) ? 1 : (dy < 0) ? -1 : 0;
-  const float tDeltaX = (step_x != 0) ? CELL_SIZE * fdx : FLT_MAX;
-  const float tDeltaY = (step_y != 0) ? CELL_SIZE * fdy : FLT_MAX;
-  const float x_offset = (step_x > 0) ? (CELL_SIZE * (ix + 1) - start.x) : (start.x - CELL_SIZE * ix);
-  const float y_offset = (step_y > 0) ? (CELL_SIZE * (iy + 1) - start.y) : (start.y - CELL_SIZE * iy);
-  register float tMaxX = (step_x != 0) ? x_offset * fdx : FLT_MAX;
-  register float tMaxY = (step_y != 0) ? y_offset * fdy : FLT_MAX;
-  register float t = 0.f;
+  walk->step_x = (dx > 0) ? 1 : (dx < 0) ? -1 : 0;
+  walk->step_y = (dy > 0) ? 1 : (dy < 0) ? -1 : 0;
+  walk->t_delta_x = (walk->step_x != 0) ? this->cell_size * fdx : FLT_MAX;
+  walk->t_delta_y = (walk->step_y != 0) ? this->cell_size * fdy : FLT_MAX;
 
-  // printf("Go from (%f, %f) %d, %d to (%f, %f) %d, %d:\n", start.x, start.y, ix, iy, end.x, end.y, ix_end, iy_end);
+  const float x_offset = (walk->step_x > 0) ? (this->cell_size * (walk->ix + 1) - start.x) : (start.x - this->cell_size * walk->ix);
+  const float y_offset = (walk->step_y > 0) ? (this->cell_size * (walk->iy + 1) - start.y) : (start.y - this->cell_size * walk->iy);
 
-  while (1) {
-    if (collide(this, ix, iy, _start.z + t * dz, _start.z + ((tMaxX < tMaxY) ? tMaxX : tMaxY) * dz, dz, _start, _end, ray_start_xy, ray_direction_xy)) {
-      return true;
-    }
+  walk->t_max_x = (walk->step_x != 0) ? x_offset * fdx : FLT_MAX;
+  walk->t_max_y = (walk->step_y != 0) ? y_offset * fdy : FLT_MAX;
+  walk->t = 0.f;
+
+  return true;
+}
+
+/* Move on to the next cell, false when the walk already is in the cell of the end point */
+M_INLINED bool
+cell_walk_step(const map_cache *this, cell_walk *walk)
+{
+  if (walk->ix == walk->ix_end && walk->iy == walk->iy_end) {
+    return false;
+  }
+
+  if (!this->blocks[(walk->iy / MAP_CACHE_BLOCK_SIZE)*this->blocks_w + (walk->ix / MAP_CACHE_BLOCK_SIZE)]) {
+    return cell_walk_skip_empty(this, walk);
+  }
 
-    if (ix == ix_end && iy == iy_end) {
+  if (walk->t_max_x < walk->t_max_y) {
+    walk->t = walk->t_max_x;
+    walk->t_max_x += walk->t_delta_x;
+    walk->ix += walk->step_x;
+  } else {
+    walk->t = walk->t_max_y;
+    walk->t_max_y += walk->t_delta_y;
+    walk->iy += walk->step_y;
+  }
+
+  return true;
+}
+
+/*
+ * Walk the coarse blocks from the current one until reaching one with linedefs, then
+ * continue in its cell where the walk enters it. The time the walk leaves a block is
+ * the time it crosses the last cell boundary inside, so the cell by cell walk is just
+ * sped up by MAP_CACHE_BLOCK_SIZE. False when the end point is in an empty block.
+ */
+static bool
+cell_walk_skip_empty(const map_cache *this, cell_walk *walk)
+{
+  const int block_end_x = walk->ix_end / MAP_CACHE_BLOCK_SIZE, block_end_y = walk->iy_end / MAP_CACHE_BLOCK_SIZE;
+  const float block_delta_x = walk->step_x != 0 ? walk->t_delta_x * MAP_CACHE_BLOCK_SIZE : FLT_MAX;
+  const float block_delta_y = walk->step_y != 0 ? walk->t_delta_y * MAP_CACHE_BLOCK_SIZE : FLT_MAX;
+  int bx = walk->ix / MAP_CACHE_BLOCK_SIZE, by = walk->iy / MAP_CACHE_BLOCK_SIZE, k;
+  float block_max_x = walk->t_max_x, block_max_y = walk->t_max_y;
+  bool entered_x;
+
+  if (walk->step_x != 0) {
+    block_max_x += (walk->step_x > 0 ? (bx + 1)*MAP_CACHE_BLOCK_SIZE - 1 - walk->ix : walk->ix - bx*MAP_CACHE_BLOCK_SIZE) * walk->t_delta_x;
+  }
+
+  if (walk->step_y != 0) {
+    block_max_y += (walk->step_y > 0 ? (by + 1)*MAP_CACHE_BLOCK_SIZE - 1 - walk->iy : walk->iy - by*MAP_CACHE_BLOCK_SIZE) * walk->t_delta_y;
+  }
+
+  do {
+    if (bx == block_end_x && by == block_end_y) {
       return false;
     }
 
-    if (tMaxX < tMaxY) {
-      t = tMaxX;
-      tMaxX += tDeltaX;
-      ix += step_x;
+    if ((entered_x = block_max_x < block_max_y)) {
+      walk->t = block_max_x;
+      block_max_x += block_delta_x;
+      bx += walk->step_x;
     } else {
-      t = tMaxY;
-      tMaxY += tDeltaY;
-      iy += step_y;
+      walk->t = block_max_y;
+      block_max_y += block_delta_y;
+      by += walk->step_y;
     }
-  }
 
-  return false;
-}
+    if (bx < 0 || by < 0 || bx >= this->blocks_w || by >= this->blocks_h) {
+      return false;
+    }
+  } while (!this->blocks[by*this->blocks_w + bx]);
 
+  /* The entered axis starts at the block edge, the other one counts back from where it leaves the block */
+  if (entered_x) {
+    walk->ix = walk->step_x > 0 ? bx*MAP_CACHE_BLOCK_SIZE : bx*MAP_CACHE_BLOCK_SIZE + MAP_CACHE_BLOCK_SIZE - 1;
+    walk->t_max_x = walk->t + walk->t_delta_x;
 
-/* PRIVATE FUNCTIONS */
+    if (walk->step_y != 0) {
+      k = M_MAX(0, M_MIN(MAP_CACHE_BLOCK_SIZE - 1, (int)ceilf((block_max_y - walk->t) / walk->t_delta_y) - 1));
+      walk->t_max_y = block_max_y - k*walk->t_delta_y;
+      walk->iy = walk->step_y > 0 ? by*MAP_CACHE_BLOCK_SIZE + MAP_CACHE_BLOCK_SIZE - 1 - k : by*MAP_CACHE_BLOCK_SIZE + k;
+    }
+  } else {
+    walk->iy = walk->step_y > 0 ? by*MAP_CACHE_BLOCK_SIZE : by*MAP_CACHE_BLOCK_SIZE + MAP_CACHE_BLOCK_SIZE - 1;
+    walk->t_max_y = walk->t + walk->t_delta_y;
+
+    if (walk->step_x != 0) {
+      k = M_MAX(0, M_MIN(MAP_CACHE_BLOCK_SIZE - 1, (int)ceilf((block_max_x - walk->t) / walk->t_delta_x) - 1));
+      walk->t_max_x = block_max_x - k*walk->t_delta_x;
+      walk->ix = walk->step_x > 0 ? bx*MAP_CACHE_BLOCK_SIZE + MAP_CACHE_BLOCK_SIZE - 1 - k : bx*MAP_CACHE_BLOCK_SIZE + k;
+    }
+  }
+
+  /* Blocks along the right and bottom edges may reach past the map */
+  walk->ix = M_MIN(walk->ix, this->w - 1);
+  walk->iy = M_MIN(walk->iy, this->h - 1);
+
+  return true;
+}
 
 M_INLINED bool
 collide(const map_cache *this, int x, int y, float current_z, float next_z, float dz, vec3f start, vec3f end, vec2f start_xy, vec2f ray_dir)
 {
   const map_cache_cell *cell = &this->cells[y*this->w+x];
+  const map_cache_linedefs *lines = &this->linedefs;
+  register uint32_t li, l;
+  float det, z;
 
-  if (cell->count == 0) {
-    return false;
-  }
+  for (li = cell->offset; li < cell->offset + cell->count; ++li) {
+    l = this->references[li];
 
-  register size_t li;
-  float det, z;
-  linedef *line;
-
-  for (li = 0; li < cell->count; ++li) {
-    line = cell->linedefs[li];
-
-    /* This switch mess is equivalent of the piece of code below, just void of any branching */
-    // switch (dz < 0 && line->max_floor_height < next_z && line->min_ceiling_height > current_z) {
-    // case 0: {
-    //   switch (dz > 0 && line->max_floor_height < current_z && line->min_ceiling_height > next_z) {
-    //   case 1: continue;
-    //   }
-    // } break;
-    // case 1: continue;
-    // }
-
-    // switch (math_find_line_intersection_cached(start_xy, line->v0->point, ray_dir, line->direction, NULL, &det, NULL) && det > MATHS_EPSILON) {
-    // case 1: {
-    //   z = start.z + dz*det;
-    //   switch (!line->side[1].sector || z < line->max_floor_height || z > line->min_ceiling_height) {
-    //   case 1: return true;
-    //   }
-    // } break;
-    // }
-
-    if (dz < 0 && line->max_floor_height < next_z && line->min_ceiling_height > current_z) {
+    if (dz < 0 && lines->max_floor_height[l] < next_z && lines->min_ceiling_height[l] > current_z) {
       continue;
-    } else if (dz > 0 && line->max_floor_height < current_z && line->min_ceiling_height > next_z) {
+    } else if (dz > 0 && lines->max_floor_height[l] < current_z && lines->min_ceiling_height[l] > next_z) {
       continue;
     }
 
-    if (math_find_line_intersection_cached(start_xy, line->v0->point, ray_dir, line->direction, NULL, &det, NULL) && det > MATHS_EPSILON) {
+    if (math_find_line_intersection_cached(start_xy, VEC2F(lines->v0_x[l], lines->v0_y[l]), ray_dir, VEC2F(lines->direction_x[l], lines->direction_y[l]), NULL, &det, NULL) && det > MATHS_EPSILON) {
       z = start.z + dz*det;
-      if (!line->side[1].sector || z < line->max_floor_height || z > line->min_ceiling_height) {
+      if (z < lines->max_floor_height[l] || z > lines->min_ceiling_height[l]) {
         return true;
       }
     }
@@ -214,6 +607,114 @@ collide(const map_cache *this, int x, int y, float current_z, float next_z, floa
   return false;
 }
 
+/*
+ * Test every linedef of the cell against all rays of the packet. Same as the
+ * intersection test in collide, returns a bitmask of the rays that were blocked.
+ */
+M_INLINED uint8_t
+collide_packet(const map_cache *this, const map_cache_cell *cell, const ray_packet *packet)
+{
+  const map_cache_linedefs *lines = &this->linedefs;
+  register uint32_t li, l;
+  uint8_t blocked = 0;
+
+#if defined(RAYCASTER_SIMD_RAY_TESTS) && defined(__ARM_NEON)
+  uint32_t lanes[MAP_CACHE_PACKET_SIZE];
+  const float32x4_t start_x = vld1q_f32(packet->start_x);
+  const float32x4_t start_y = vld1q_f32(packet->start_y);
+  const float32x4_t start_z = vld1q_f32(packet->start_z);
+  const float32x4_t ba_x = vld1q_f32(packet->direction_x);
+  const float32x4_t ba_y = vld1q_f32(packet->direction_y);
+  const float32x4_t dz = vld1q_f32(packet->direction_z);
+
+  for (li = cell->offset; li < cell->offset + cell->count; ++li) {
+    l = this->references[li];
+
+    const float32x4_t ac_x = vsubq_f32(start_x, vdupq_n_f32(lines->v0_x[l]));
+    const float32x4_t ac_y = vsubq_f32(start_y, vdupq_n_f32(lines->v0_y[l]));
+    const float32x4_t cross = vsubq_f32(vmulq_n_f32(ba_x, lines->direction_y[l]), vmulq_n_f32(ba_y, lines->direction_x[l]));
+#if defined(__aarch64__)
+    const float32x4_t denom = vdivq_f32(vdupq_n_f32(1.f), cross);
+#else
+    float32x4_t denom = vrecpeq_f32(cross);
+    denom = vmulq_f32(vrecpsq_f32(cross, denom), denom);
+    denom = vmulq_f32(vrecpsq_f32(cross, denom), denom);
+#endif
+    const float32x4_t u_b = vmulq_f32(vsubq_f32(vmulq_f32(ba_x, ac_y), vmulq_f32(ba_y, ac_x)), denom);
+    const float32x4_t u_a = vmulq_f32(vsubq_f32(vmulq_n_f32(ac_y, lines->direction_x[l]), vmulq_n_f32(ac_x, lines->direction_y[l])), denom);
+    uint32x4_t hit = vcgeq_f32(vabsq_f32(cross), vdupq_n_f32(MATHS_EPSILON));
+    hit = vandq_u32(hit, vcgeq_f32(u_b, vdupq_n_f32(0.f)));
+    hit = vandq_u32(hit, vcleq_f32(u_b, vdupq_n_f32(1.f)));
+    hit = vandq_u32(hit, vcgtq_f32(u_a, vdupq_n_f32(MATHS_EPSILON)));
+    hit = vandq_u32(hit, vcleq_f32(u_a, vdupq_n_f32(1.f)));
+
+    const float32x4_t z = vmlaq_f32(start_z, dz, u_a);
+    hit = vandq_u32(hit, vorrq_u32(
+      vcltq_f32(z, vdupq_n_f32(lines->max_floor_height[l])),
+      vcgtq_f32(z, vdupq_n_f32(lines->min_ceiling_height[l]))
+    ));
+
+    vst1q_u32(lanes, hit);
+    blocked |= (lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8);
+  }
+#elif defined(RAYCASTER_SIMD_RAY_TESTS)
+  const __m128 start_x = _mm_loadu_ps(packet->start_x);
+  const __m128 start_y = _mm_loadu_ps(packet->start_y);
+  const __m128 start_z = _mm_loadu_ps(packet->start_z);
+  const __m128 ba_x = _mm_loadu_ps(packet->direction_x);
+  const __m128 ba_y = _mm_loadu_ps(packet->direction_y);
+  const __m128 dz = _mm_loadu_ps(packet->direction_z);
+
+  for (li = cell->offset; li < cell->offset + cell->count; ++li) {
+    l = this->references[li];
+
+    const __m128 dc_x = _mm_set1_ps(lines->direction_x[l]);
+    const __m128 dc_y = _mm_set1_ps(lines->direction_y[l]);
+    const __m128 ac_x = _mm_sub_ps(start_x, _mm_set1_ps(lines->v0_x[l]));
+    const __m128 ac_y = _mm_sub_ps(start_y, _mm_set1_ps(lines->v0_y[l]));
+    const __m128 cross = _mm_sub_ps(_mm_mul_ps(ba_x, dc_y), _mm_mul_ps(ba_y, dc_x));
+    const __m128 denom = _mm_div_ps(_mm_set1_ps(1.f), cross);
+    const __m128 u_b = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(ba_x, ac_y), _mm_mul_ps(ba_y, ac_x)), denom);
+    const __m128 u_a = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dc_x, ac_y), _mm_mul_ps(dc_y, ac_x)), denom);
+    __m128 hit = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), cross), _mm_set1_ps(MATHS_EPSILON));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(u_b, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(u_b, _mm_set1_ps(1.f)));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(u_a, _mm_set1_ps(MATHS_EPSILON)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(u_a, _mm_set1_ps(1.f)));
+
+    const __m128 z = _mm_add_ps(start_z, _mm_mul_ps(dz, u_a));
+    hit = _mm_and_ps(hit, _mm_or_ps(
+      _mm_cmplt_ps(z, _mm_set1_ps(lines->max_floor_height[l])),
+      _mm_cmpgt_ps(z, _mm_set1_ps(lines->min_ceiling_height[l]))
+    ));
+
+    blocked |= (uint8_t)_mm_movemask_ps(hit);
+  }
+#else
+  register uint8_t i;
+  float det, z;
+
+  for (li = cell->offset; li < cell->offset + cell->count; ++li) {
+    l = this->references[li];
+
+    for (i = 0; i < MAP_CACHE_PACKET_SIZE; ++i) {
+      if ((blocked >> i) & 1) {
+        continue;
+      }
+
+      if (math_find_line_intersection_cached(VEC2F(packet->start_x[i], packet->start_y[i]), VEC2F(lines->v0_x[l], lines->v0_y[l]), VEC2F(packet->direction_x[i], packet->direction_y[i]), VEC2F(lines->direction_x[l], lines->direction_y[l]), NULL, &det, NULL) && det > MATHS_EPSILON) {
+        z = packet->start_z[i] + packet->direction_z[i]*det;
+        if (z < lines->max_floor_height[l] || z > lines->min_ceiling_height[l]) {
+          blocked |= 1 << i;
+        }
+      }
+    }
+  }
+#endif
+
+  return blocked;
+}
+
 static void
 map_cache_add_or_remove_light_at_position(map_cache *this, light *l, vec3f position, bool add)
 {
@@ -228,12 +729,12 @@ map_cache_add_or_remove_light_at_position(map_cache *this, light *l, vec3f posit
 
   /* Find all cells this light touches */
   const vec2u cell_min = VEC2U(
-    M_MAX(0, (light_pos_local.x - l->radius) / CELL_SIZE),
-    M_MAX(0, (light_pos_local.y - l->radius) / CELL_SIZE)
+    M_MAX(0, (light_pos_local.x - l->radius) * this->cell_size_inverse),
+    M_MAX(0, (light_pos_local.y - l->radius) * this->cell_size_inverse)
   );
   const vec2u cell_max = VEC2U(
-    M_MIN(this->w - 1, (light_pos_local.x + l->radius) / CELL_SIZE),
-    M_MIN(this->h - 1, (light_pos_local.y + l->radius) / CELL_SIZE)
+    M_MIN(this->w - 1, (light_pos_local.x + l->radius) * this->cell_size_inverse),
+    M_MIN(this->h - 1, (light_pos_local.y + l->radius) * this->cell_size_inverse)
   );
 
   for (y = cell_min.y; y <= cell_max.y; ++y) {
@@ -255,6 +756,31 @@ map_cache_add_or_remove_light_at_position(map_cache *this, light *l, vec3f posit
           }
         }
       }
+
+#ifdef SHADOW_CACHES
+      update_cell_shadow_caches(this, x, y);
+#endif
+    }
+  }
+}
+
+#ifdef SHADOW_CACHES
+static void
+update_cell_shadow_caches(map_cache *this, uint16_t x, uint16_t y)
+{
+  register uint8_t i;
+  map_cache_cell *cell = &this->cells[(y * this->w) + x];
+  const vec2f min = VEC2F(this->origin.x + (x * this->cell_size), this->origin.y + (y * this->cell_size));
+
+  /* Floor and ceiling */
+  for (i = 0; i < 2; ++i) {
+    if (!cell->shadows[i] && cell->lights_count) {
+      cell->shadows[i] = shadow_cache_create_horizontal(min, VEC2F(min.x + this->cell_size, min.y + this->cell_size));
+    }
+
+    if (cell->shadows[i]) {
+      shadow_cache_assign_lights(cell->shadows[i], cell->lights, cell->lights_count);
     }
   }
 }
+#endif
@@ -11,7 +11,11 @@
   #include <omp.h>
 #endif
 
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
+#ifdef RAYCASTER_ASYNC_RENDERING
+  #include <pthread.h>
+#endif
+
+#if defined(RAYCASTER_SIMD_PIXEL_LIGHTING) || defined(RAYCASTER_SIMD_RAY_TESTS) || defined(RAYCASTER_RAY_PACKETS)
   #if __ARM_NEON
     #include <arm_neon.h>
   #else
@@ -22,9 +26,14 @@
 
 #define MAX_SECTOR_HISTORY 64
 #define MAX_LINE_HITS_PER_COLUMN 48
+#define RAY_PACKET_SIZE 4
+#define RENDERER_MAX_PLANE_TABLES 256
+#define RENDERER_SKY_PANORAMA_WIDTH 2048
 
 void (*texture_sampler_scaled)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
 void (*texture_sampler_normalized)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*);
+void (*texture_sampler_column)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*) = NULL;
+void (*texture_sampler_plane)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*) = NULL;
 
 #if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
   #define INSERT_RENDER_BREAKPOINT if (renderer_step) { renderer_step(this); }
@@ -33,6 +42,132 @@ void (*texture_sampler_normalized)(texture_ref, float, float, uint8_t, uint8_t*,
   #define INSERT_RENDER_BREAKPOINT
 #endif
 
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  #define GBUFFER_AT(COLUMN, Y) (&(COLUMN)->gbuffer_start[(Y) * (COLUMN)->gbuffer_stride])
+  /* Pixels written straight to the output are left alone by the lighting pass */
+  #define CLEAR_GBUFFER(COLUMN, Y) GBUFFER_AT(COLUMN, Y)->surface = RENDERER_SURFACE_NONE;
+#else
+  #define CLEAR_GBUFFER(COLUMN, Y)
+#endif
+
+/* Black in the output pixel format, the palette entry closest to it for indexed pixels */
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+  #define PIXEL_BLACK(RENDERER) ((RENDERER)->palette.black)
+#else
+  #if defined(RAYCASTER_PIXEL_FORMAT_RGB565) || defined(RAYCASTER_PIXEL_FORMAT_XRGB8888)
+    #define PIXEL_ALPHA 0
+  #else
+    #define PIXEL_ALPHA 0xFF000000
+  #endif
+  #define PIXEL_BLACK(RENDERER) ((pixel_type)PIXEL_ALPHA)
+#endif
+
+/*
+ * Light as shade_pixel takes it. Indexed pixels are shaded with a colormap row, so
+ * spans pick the row once whenever their light changes and pixels only look it up.
+ */
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+typedef uint8_t pixel_light;
+#else
+typedef float pixel_light;
+#endif
+
+/* Pack 8-bit channels (or a palette index in 'r') into the output pixel format */
+M_INLINED pixel_type
+pack_pixel(uint32_t r, uint32_t g, uint32_t b)
+{
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+  M_UNUSED(g);
+  M_UNUSED(b);
+  return (pixel_type)r;
+#elif defined(RAYCASTER_PIXEL_FORMAT_RGB565)
+  return (pixel_type)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+#elif defined(RAYCASTER_PIXEL_FORMAT_ABGR8888)
+  return PIXEL_ALPHA | (b << 16) | (g << 8) | r;
+#else
+  return PIXEL_ALPHA | (r << 16) | (g << 8) | b;
+#endif
+}
+
+/* Indexed builds pick the colormap row closest to the light value */
+M_INLINED pixel_light
+light_to_pixel_light(float light)
+{
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+  return (pixel_light)math_min(math_max(light, 0.f) * (RENDERER_COLORMAP_ROWS / RENDERER_COLORMAP_MAX_LIGHT) + 0.5f, RENDERER_COLORMAP_ROWS - 1);
+#else
+  return light;
+#endif
+}
+
+/*
+ * Multiply a texel with light and store it in the output pixel format. The 32-bit
+ * formats set up the lanes in memory order and narrow them straight to bytes.
+ * Indexed texels are looked up from the colormap row without any light math.
+ */
+M_INLINED pixel_type
+shade_pixel(const renderer *this, const uint8_t rgb[3], pixel_light light)
+{
+  M_UNUSED(this);
+
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+  return this->palette.colormap[light][rgb[0]];
+#elif defined(RAYCASTER_SIMD_PIXEL_LIGHTING) && defined(RAYCASTER_PIXEL_FORMAT_RGB565)
+  int32_t temp[4];
+#ifdef __ARM_NEON
+  vst1q_s32(temp, vcvtq_s32_f32(vminq_f32(vmulq_f32((float32x4_t){ rgb[0], rgb[1], rgb[2] }, vdupq_n_f32(light)), vdupq_n_f32(255.0f))));
+#else
+  _mm_storeu_si128((__m128i*)temp, _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_set_ps(0, rgb[2], rgb[1], rgb[0]), _mm_set1_ps(light)), _mm_set1_ps(255.0f))));
+#endif
+  return pack_pixel(temp[0], temp[1], temp[2]);
+#elif defined(RAYCASTER_SIMD_PIXEL_LIGHTING)
+#ifdef __ARM_NEON
+#ifdef RAYCASTER_PIXEL_FORMAT_ABGR8888
+  const float32x4_t color = { rgb[0], rgb[1], rgb[2], 0 };
+#else
+  const float32x4_t color = { rgb[2], rgb[1], rgb[0], 0 };
+#endif
+  const int32x4_t v = vcvtq_s32_f32(vminq_f32(vmulq_f32(color, vdupq_n_f32(light)), vdupq_n_f32(255.0f)));
+  return PIXEL_ALPHA | vget_lane_u32(vreinterpret_u32_u8(vqmovn_u16(vcombine_u16(vqmovun_s32(v), vdup_n_u16(0)))), 0);
+#else
+#ifdef RAYCASTER_PIXEL_FORMAT_ABGR8888
+  __m128i v = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_set_ps(0, rgb[2], rgb[1], rgb[0]), _mm_set1_ps(light)), _mm_set1_ps(255.0f)));
+#else
+  __m128i v = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_set_ps(0, rgb[0], rgb[1], rgb[2]), _mm_set1_ps(light)), _mm_set1_ps(255.0f)));
+#endif
+  v = _mm_packs_epi32(v, v);
+  return PIXEL_ALPHA | (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+#endif
+#else
+  return pack_pixel((uint8_t)math_min((rgb[0]*light),255), (uint8_t)math_min((rgb[1]*light),255), (uint8_t)math_min((rgb[2]*light),255));
+#endif
+}
+
+#ifdef RAYCASTER_FIXED_POINT
+#define LIGHT_FIXED_SHIFT 8
+
+/* Light value in 8.8 fixed point for shade_pixel_fixed */
+M_INLINED int32_t
+light_to_fixed(float light)
+{
+  return (int32_t)(math_clamp(light, 0.f, 255.f) * (1 << LIGHT_FIXED_SHIFT));
+}
+
+/* Same as shade_pixel with an 8.8 fixed point light value, using only integer math */
+M_INLINED pixel_type
+shade_pixel_fixed(const renderer *this, const uint8_t rgb[3], int32_t light)
+{
+  M_UNUSED(this);
+
+#if defined(RAYCASTER_PIXEL_FORMAT_INDEXED8)
+  const int32_t row = M_MIN((light * (int32_t)(RENDERER_COLORMAP_ROWS / RENDERER_COLORMAP_MAX_LIGHT) + (1 << (LIGHT_FIXED_SHIFT - 1))) >> LIGHT_FIXED_SHIFT, RENDERER_COLORMAP_ROWS - 1);
+  return this->palette.colormap[row][rgb[0]];
+#else
+  return pack_pixel(M_MIN((rgb[0] * light) >> LIGHT_FIXED_SHIFT, 255), M_MIN((rgb[1] * light) >> LIGHT_FIXED_SHIFT, 255), M_MIN((rgb[2] * light) >> LIGHT_FIXED_SHIFT, 255));
+#endif
+}
+#endif
+
 typedef struct ray_info {
   vec2f perspective_origin,
         start,
@@ -41,12 +176,19 @@ typedef struct ray_info {
         direction_normalized,
         view_direction;
   float theta_inverse;
+  /* Starts from the camera, so it may use per-frame visibility data */
+  bool primary;
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  /* Position on the camera plane, from -1 (left) to 1 (right) */
+  float camera_x;
+#endif
 } ray_info;
 
 typedef struct ray_intersection {
   struct {
     vec2f origin,
           direction_normalized;
+    bool primary;
   } ray;
   vec2f point;
   float planar_distance,
@@ -59,6 +201,10 @@ typedef struct ray_intersection {
         fz_local,
         determinant,
         ray_determinant;
+  /* Shared by all wall pieces (top, bottom, middle) drawn for this intersection */
+  float texture_x,
+        texture_step;
+  linedef_segment *segment;
   linedef *line;
   sector *front_sector, *back_sector;
   uint8_t side;
@@ -85,9 +231,30 @@ typedef struct {
   float top_limit, bottom_limit;
   uint32_t index, buffer_stride;
   pixel_type *buffer_start;
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  renderer_gbuffer_texel *gbuffer_start;
+  uint32_t gbuffer_stride;
+#endif
   bool finished;
 } column_info;
 
+#ifdef RAYCASTER_RAY_PACKETS
+/*
+ * Primary rays of adjacent columns that are traced through the sector graph
+ * together. They share the same starting point, so only the directions are
+ * kept as separate lanes.
+ */
+typedef struct ray_packet {
+  ray_info rays[RAY_PACKET_SIZE];
+  float direction_x[RAY_PACKET_SIZE],
+        direction_y[RAY_PACKET_SIZE];
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  float camera_x[RAY_PACKET_SIZE];
+#endif
+  vec2f start;
+} ray_packet;
+#endif
+
 #define DIMMING_DISTANCE 4096.f
 
 #if RAYCASTER_LIGHT_STEPS > 0
@@ -100,23 +267,95 @@ static const float LIGHT_STEP_DISTANCE_INVERSE = 1.f / (DIMMING_DISTANCE / 4);
 static const float DIMMING_DISTANCE_INVERSE = 1.f / DIMMING_DISTANCE;
 #endif
 
-#if defined(RAYCASTER_PRERENDER_VISCHECK) && 0
+/* Values that only depend on the screen row for a floor or ceiling at a given height */
+typedef struct {
+  float distance, light;
+  uint8_t mip_level;
+#ifdef RAYCASTER_FIXED_POINT
+  /* 16.16 distance (clamped to the draw distance) and 8.8 dimming */
+  int32_t distance_fixed, dimming_fixed;
+#endif
+} renderer_plane_row;
+
+/* Row tables for the floor and ceiling heights seen in the current frame */
+typedef struct renderer_plane_cache {
+  size_t count;
+  int32_t height[RENDERER_MAX_PLANE_TABLES];
+  renderer_plane_row *rows[RENDERER_MAX_PLANE_TABLES];
+} renderer_plane_cache;
+
+/*
+ * Sky texture pre-sampled into a column-major panorama (rebuilt when the level's
+ * sky texture or the buffer height changes) and the per-frame lookup tables from
+ * screen columns and rows into it.
+ */
+typedef struct renderer_sky {
+  texture_ref texture;
+  uint32_t panorama_height;
+  pixel_type *panorama;
+  uint16_t *column, *row;
+} renderer_sky;
+
+#ifdef RAYCASTER_ASYNC_RENDERING
+  /* Background thread drawing the frames handed over by renderer_submit */
+  struct renderer_worker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    camera camera;
+    pixel_type *target;
+    size_t pitch;
+    bool pending, busy, quit;
+  };
+#endif
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  static const float DRAW_DISTANCE_INVERSE = 1.f / RENDERER_DRAW_DISTANCE;
+
   typedef struct {
-    vec2f position, far_left, far_right;
+    vec2f position, direction, plane;
+    float basis_determinant_inverse, half_w;
   } visibility_viewpoint;
 
+  /* Per-frame visibility state, indexed like the sectors and vertices of the level */
+  struct renderer_visibility {
+    size_t sectors_count, vertices_count;
+    uint32_t *sector_ticks, *vertex_ticks;
+    /* Linedefs of each sector facing the camera and within the view */
+    sector_geometry *sectors;
+    /* Camera space position of each vertex (lateral, depth) */
+    vec2f *vertices;
+  };
+
+  static void
+  prepare_visibility(renderer*);
+
+  static void
+  free_visibility(renderer*);
+
   static void
-  refresh_sector_visibility(const renderer*, const visibility_viewpoint*, sector*);
+  refresh_sector_visibility(const renderer*, const visibility_viewpoint*, const sector*);
 #endif
 
 static int
 find_sector_intersections(const renderer*, const sector*, const ray_info*, ray_context*, column_info*, float);
 
+#ifdef RAYCASTER_RAY_PACKETS
+static void
+find_sector_intersections_packet(const renderer*, const sector*, const ray_packet*, ray_context*, column_info*, uint8_t);
+#endif
+
 static void
 find_mirror_intersections(const renderer*, const ray_info*, ray_intersection*, column_info*);
 
 static void
-draw_wall_segment(const renderer*, const ray_intersection*, column_info*, uint32_t from, uint32_t to, float, texture_ref);
+submit_frame(renderer*, camera*, pixel_type*, size_t);
+
+static void
+draw_frame(renderer*, camera*, pixel_type*, size_t);
+
+static void
+draw_wall_segment(const renderer*, const ray_intersection*, column_info*, uint32_t from, uint32_t to, float, float, texture_ref, bool overlay);
 
 static void
 draw_floor_segment(const renderer*, const ray_intersection*, column_info*, uint32_t from, uint32_t to);
@@ -124,6 +363,9 @@ draw_floor_segment(const renderer*, const ray_intersection*, column_info*, uint3
 static void
 draw_ceiling_segment(const renderer*, const ray_intersection*, column_info*, uint32_t from, uint32_t to);
 
+static void
+draw_column(const renderer*, const ray_info*, ray_context*, column_info*);
+
 static void
 draw_column_intersection(const renderer*, const ray_intersection*, column_info*);
 
@@ -139,6 +381,16 @@ draw_segmented_wall(const renderer*, const ray_intersection*, column_info*);
 static void
 draw_sky_segment(const renderer *this, const ray_intersection*, const column_info*, uint32_t, uint32_t);
 
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+static void
+init_palette(renderer*);
+#endif
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+static void
+shade_deferred(const renderer*);
+#endif
+
 M_INLINED void
 init_depth_values(renderer *this)
 {
@@ -149,6 +401,104 @@ init_depth_values(renderer *this)
   }
 }
 
+/* Sky lookup tables follow the buffer size, the panorama is rebuilt on first use */
+M_INLINED void
+init_sky(renderer *this)
+{
+  free(this->sky->panorama);
+  this->sky->panorama = NULL;
+  this->sky->texture = TEXTURE_NONE;
+  this->sky->column = realloc(this->sky->column, this->buffer_size.x * sizeof(uint16_t));
+  this->sky->row = realloc(this->sky->row, this->buffer_size.y * sizeof(uint16_t));
+}
+
+/* Panorama column for a ray direction: horizontal angle mapped from [0, 360) to [0, 1) */
+M_INLINED uint16_t
+sky_panorama_column(vec2f direction)
+{
+  float angle = atan2f(direction.x, direction.y) * (180.0f / M_PI);
+  if (angle < 0.0f) {
+    angle += 360.0f;
+  }
+  return (uint16_t)M_MIN((angle / 360) * RENDERER_SKY_PANORAMA_WIDTH, RENDERER_SKY_PANORAMA_WIDTH - 1);
+}
+
+/*
+ * Sky rows are sampled at v = 0.5 + (y - pitch_offset) / h, clamped at the texture edges.
+ * Panorama row r holds v for y - pitch_offset = r - (h/2 + 1), which covers every value
+ * of v between the clamped ends, so the sampler only ever runs when the panorama is built.
+ */
+static void
+update_sky(renderer *this, vec2f view_direction, vec2f view_plane)
+{
+  register int32_t x, y;
+  const int32_t h = this->buffer_size.y, offset = (h >> 1) + 1;
+  const float hf = (float)h;
+  pixel_type *p;
+  uint8_t rgb[3];
+  float cam_x;
+
+  if (this->sky->texture != this->frame_info.sky_texture || !this->sky->panorama) {
+    this->sky->texture = this->frame_info.sky_texture;
+    this->sky->panorama_height = h + 3;
+    this->sky->panorama = realloc(this->sky->panorama, RENDERER_SKY_PANORAMA_WIDTH * this->sky->panorama_height * sizeof(pixel_type));
+
+#ifdef RAYCASTER_PARALLEL_RENDERING
+    #pragma omp parallel for private(y, p, rgb)
+#endif
+    for (x = 0; x < RENDERER_SKY_PANORAMA_WIDTH; ++x) {
+      p = this->sky->panorama + (x * this->sky->panorama_height);
+      for (y = 0; y < (int32_t)this->sky->panorama_height; ++y) {
+        texture_sampler_normalized(this->sky->texture, x / (float)RENDERER_SKY_PANORAMA_WIDTH, math_min(1.f, 0.5f+(y-offset)/hf), 1, &rgb[0], NULL);
+        p[y] = pack_pixel(rgb[0], rgb[1], rgb[2]);
+      }
+    }
+  }
+
+  /* Same directions as the primary rays in setup_column */
+  for (x = 0; x < this->buffer_size.x; ++x) {
+    cam_x = ((x << 1) / (float)this->buffer_size.x) - 1;
+    this->sky->column[x] = sky_panorama_column(VEC2F(
+      view_direction.x + (view_plane.x * cam_x),
+      view_direction.y + (view_plane.y * cam_x)
+    ));
+  }
+
+  for (y = 0; y < h; ++y) {
+    this->sky->row[y] = (uint16_t)M_CLAMP(y - this->frame_info.pitch_offset + offset, 0, (int32_t)this->sky->panorama_height - 1);
+  }
+}
+
+/* Frame buffers are sized by the buffer, so they get reallocated on next submit */
+M_INLINED void
+free_frames(renderer *this)
+{
+  register size_t i;
+
+  renderer_wait(this);
+
+  for (i = 0; i < RENDERER_FRAME_BUFFERS; ++i) {
+    free(this->frames[i]);
+    this->frames[i] = NULL;
+  }
+
+  this->submitted_frame = NULL;
+}
+
+/* Row tables are sized by the buffer height, so they get reallocated on first use */
+M_INLINED void
+free_plane_cache_rows(renderer *this)
+{
+  register size_t i;
+
+  for (i = 0; i < RENDERER_MAX_PLANE_TABLES; ++i) {
+    free(this->plane_cache->rows[i]);
+    this->plane_cache->rows[i] = NULL;
+  }
+
+  this->plane_cache->count = 0;
+}
+
 /* Insert intersection into a sorted linked starting from 'head' */
 M_INLINED void
 insert_sorted(ray_intersection *value, ray_intersection **head)
@@ -166,6 +516,56 @@ insert_sorted(ray_intersection *value, ray_intersection **head)
   cur->next = value;
 }
 
+/* Initialise column info and the primary ray for screen column 'x' */
+M_INLINED void
+setup_column(
+  const renderer *this,
+  int32_t x,
+  const vec2f view_position,
+  const vec2f view_direction,
+  const vec2f view_plane,
+  column_info *column,
+  ray_info *ray
+) {
+  const float cam_x = ((x << 1) / (float)this->buffer_size.x) - 1;
+  const vec2f ray_dir_norm = VEC2F(
+    view_direction.x + (view_plane.x * cam_x),
+    view_direction.y + (view_plane.y * cam_x)
+  );
+  const vec2f ray_end = VEC2F(
+    view_position.x + (ray_dir_norm.x * RENDERER_DRAW_DISTANCE),
+    view_position.y + (ray_dir_norm.y * RENDERER_DRAW_DISTANCE)
+  );
+
+  *column = (column_info) {
+    .index = x,
+    .intersections = { .count = 0 },
+    .buffer_stride = this->frame_info.buffer_stride,
+    .top_limit = 0.f,
+    .bottom_limit = this->buffer_size.y,
+    .buffer_start = &this->frame_info.buffer[x],
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+    .gbuffer_start = &this->gbuffer[x],
+    .gbuffer_stride = this->buffer_size.x,
+#endif
+    .finished = false
+  };
+
+  *ray = (ray_info) {
+    .perspective_origin = view_position,
+    .start = view_position,
+    .end = ray_end,
+    .direction = vec2f_sub(ray_end, view_position),
+    .direction_normalized = ray_dir_norm,
+    .view_direction = view_direction,
+    .theta_inverse = 1.f / math_dot2(view_direction, ray_dir_norm),
+    .primary = true,
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+    .camera_x = cam_x
+#endif
+  };
+}
+
 void
 renderer_init(
   renderer *this,
@@ -173,7 +573,24 @@ renderer_init(
 ) {
   this->buffer_size = size;
   this->buffer = malloc(size.x * size.y * sizeof(pixel_type));
+  this->tick = 0;
+  this->plane_cache = calloc(1, sizeof(renderer_plane_cache));
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  this->visibility = calloc(1, sizeof(struct renderer_visibility));
+#endif
+  this->sky = calloc(1, sizeof(renderer_sky));
+  memset(this->frames, 0, sizeof(this->frames));
+  this->frame_index = 0;
+  this->submitted_frame = NULL;
+  this->worker = NULL;
   init_depth_values(this);
+  init_sky(this);
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+  init_palette(this);
+#endif
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  this->gbuffer = malloc(size.x * size.y * sizeof(renderer_gbuffer_texel));
+#endif
 }
 
 void
@@ -181,276 +598,1026 @@ renderer_resize(
   renderer *this,
   vec2i new_size
 ) {
+  free_frames(this);
   this->buffer_size = new_size;
   this->buffer = realloc(this->buffer, new_size.x * new_size.y * sizeof(pixel_type));
   free((float*)this->depth_values);
   init_depth_values(this);
+  init_sky(this);
+  free_plane_cache_rows(this);
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  this->gbuffer = realloc(this->gbuffer, new_size.x * new_size.y * sizeof(renderer_gbuffer_texel));
+#endif
 }
 
 void
 renderer_destroy(renderer *this)
 {
+  free_frames(this);
+
+#ifdef RAYCASTER_ASYNC_RENDERING
+  if (this->worker) {
+    pthread_mutex_lock(&this->worker->mutex);
+    this->worker->quit = true;
+    pthread_cond_broadcast(&this->worker->condition);
+    pthread_mutex_unlock(&this->worker->mutex);
+    pthread_join(this->worker->thread, NULL);
+    pthread_mutex_destroy(&this->worker->mutex);
+    pthread_cond_destroy(&this->worker->condition);
+    free(this->worker);
+    this->worker = NULL;
+  }
+#endif
+
   if (this->buffer) {
     free(this->buffer);
     this->buffer = NULL;
   }
-}
 
-void
-renderer_draw(
-  renderer *this,
-  camera *camera
-) {
-  int32_t x;
+  if (this->plane_cache) {
+    free_plane_cache_rows(this);
+    free(this->plane_cache);
+    this->plane_cache = NULL;
+  }
 
-  assert(this->buffer);
-  memset(this->buffer, 0, this->buffer_size.x * this->buffer_size.y * sizeof(pixel_type));
-  
-  const int32_t half_h = this->buffer_size.y >> 1;
-  sector *root_sector = camera->entity.sector;
-  const vec2f view_position = camera->entity.position;
-  const vec2f view_direction = camera->entity.direction;
-  const vec2f view_plane = camera->plane;
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  if (this->visibility) {
+    free_visibility(this);
+    free(this->visibility);
+    this->visibility = NULL;
+  }
+#endif
 
-  this->frame_info.level = camera->entity.level;
-  this->frame_info.view_position = view_position;
-  this->frame_info.half_w = this->buffer_size.x >> 1;
-  this->frame_info.pitch_offset = (int32_t)floorf(camera->pitch * half_h);
-  this->frame_info.half_h = half_h + this->frame_info.pitch_offset;
-  this->frame_info.unit_size = (this->buffer_size.x >> 1) / camera->fov;
-  this->frame_info.view_z = camera->entity.z;
-  this->frame_info.sky_texture = this->frame_info.level->sky_texture;
-  this->tick++;
+  if (this->sky) {
+    free(this->sky->panorama);
+    free(this->sky->column);
+    free(this->sky->row);
+    free(this->sky);
+    this->sky = NULL;
+  }
 
-#if defined(RAYCASTER_PRERENDER_VISCHECK) && 0
-  const visibility_viewpoint viewpoint = (visibility_viewpoint) {
-    .position = view_position,
-    .far_left = vec2f_add(view_position, vec2f_mul(vec2f_sub(view_direction, camera->plane), RENDERER_DRAW_DISTANCE)),
-    .far_right = vec2f_add(view_position, vec2f_mul(vec2f_add(view_direction, camera->plane), RENDERER_DRAW_DISTANCE))
-  };
-  refresh_sector_visibility(this, &viewpoint, root_sector);
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  free(this->gbuffer);
+  this->gbuffer = NULL;
 #endif
+}
 
-#ifdef RAYCASTER_PARALLEL_RENDERING
-  #pragma omp parallel for
-#endif
-  for (x = 0; x < this->buffer_size.x; ++x) {
-    int32_t y, y0, y1;
-    uint32_t *p;
-    const float cam_x = ((x << 1) / (float)this->buffer_size.x) - 1;
-    const vec2f ray_dir_norm = VEC2F(
-      view_direction.x + (view_plane.x * cam_x),
-      view_direction.y + (view_plane.y * cam_x)
-    );
-    const vec2f ray_end = VEC2F(
-      view_position.x + (ray_dir_norm.x * RENDERER_DRAW_DISTANCE),
-      view_position.y + (ray_dir_norm.y * RENDERER_DRAW_DISTANCE)
-    );
+#ifdef RAYCASTER_PIXEL_FORMAT_INDEXED8
+M_INLINED uint8_t
+closest_palette_index(const uint32_t *colors, int32_t r, int32_t g, int32_t b)
+{
+  register int32_t i, dr, dg, db, d, best = 0, best_d = INT32_MAX;
 
-    column_info column = (column_info) {
-      .index = x,
-      .intersections = { .count = 0 },
-      .buffer_stride = this->buffer_size.x,
-      .top_limit = 0.f,
-      .bottom_limit = this->buffer_size.y,
-      .buffer_start = &this->buffer[x],
-      .finished = false
-    };
+  for (i = 0; i < RENDERER_PALETTE_SIZE && best_d; ++i) {
+    dr = (int32_t)((colors[i] >> 16) & 0xFF) - r;
+    dg = (int32_t)((colors[i] >> 8) & 0xFF) - g;
+    db = (int32_t)(colors[i] & 0xFF) - b;
+    d = dr*dr + dg*dg + db*db;
 
-    ray_context context = { 0 };
+    if (d < best_d) {
+      best_d = d;
+      best = i;
+    }
+  }
 
-    ray_info ray = (ray_info) {
-      .perspective_origin = view_position,
-      .start = view_position,
-      .end = ray_end,
-      .direction = vec2f_sub(ray_end, view_position),
-      .direction_normalized = ray_dir_norm,
-      .view_direction = view_direction,
-      .theta_inverse = 1.f / math_dot2(view_direction, ray_dir_norm)
-    };
+  return (uint8_t)best;
+}
 
-    find_sector_intersections(this, root_sector, &ray, &context, &column, 0);
-    
-    /* Insert the closest full wall we found */
-    if (context.full_wall) {
-      insert_sorted(context.full_wall, &context.head);
-
-      if (context.full_wall->line->side[0].flags & LINEDEF_MIRROR) {
-        /*
-         * If it's a mirror, convert the ray into mirror-space and start finding additional
-         * intersections that will follow the mirror wall.
-         */
-        find_mirror_intersections(this, &ray, context.full_wall, &column);
-      } else {
-        /* Otherwise just terminate the ray here */
-        context.full_wall->next = NULL;
-      }
-    }
-    
-    draw_column_intersection(this, context.head, &column);
-    
-    /* Fill the remainder of the column */
-    if (!column.finished) {
-      y0 = (int32_t)floorf(column.top_limit);
-      y1 = (int32_t)floorf(column.bottom_limit);
-      p = column.buffer_start + (y0 * column.buffer_stride);
-      for (y = y0; y < y1; ++y, p += column.buffer_stride) {
-        *p = 0xFF000000;
-        INSERT_RENDER_BREAKPOINT
-      }
-    }
+void
+renderer_set_palette(renderer *this, const uint8_t *colors)
+{
+  register int32_t row, i;
+  float light;
+
+  for (i = 0; i < RENDERER_PALETTE_SIZE; ++i) {
+    this->palette.colors[i] = 0xFF000000 | (colors[i*3] << 16) | (colors[i*3+1] << 8) | colors[i*3+2];
   }
 
-#if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
-  renderer_step = NULL;
+  /* Same rounding and clamping as the RGB formats apply to lit texels */
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp parallel for private(i, light)
 #endif
+  for (row = 0; row < RENDERER_COLORMAP_ROWS; ++row) {
+    light = row * (RENDERER_COLORMAP_MAX_LIGHT / RENDERER_COLORMAP_ROWS);
+
+    for (i = 0; i < RENDERER_PALETTE_SIZE; ++i) {
+      this->palette.colormap[row][i] = closest_palette_index(this->palette.colors,
+        (uint8_t)math_min(colors[i*3] * light, 255),
+        (uint8_t)math_min(colors[i*3+1] * light, 255),
+        (uint8_t)math_min(colors[i*3+2] * light, 255)
+      );
+    }
+  }
+
+  this->palette.black = closest_palette_index(this->palette.colors, 0, 0, 0);
+
+  /* The panorama holds indices sampled with the previous palette */
+  this->sky->texture = TEXTURE_NONE;
 }
 
-/* ----- */
+uint8_t
+renderer_palette_index(const renderer *this, uint8_t r, uint8_t g, uint8_t b)
+{
+  return closest_palette_index(this->palette.colors, r, g, b);
+}
 
-#if defined(RAYCASTER_PRERENDER_VISCHECK) && 0
+void
+renderer_expand_frame(const renderer *this, const pixel_type *src, uint32_t *dst, size_t pitch_bytes)
+{
+  register int32_t x, y;
+  const uint32_t *colors = this->palette.colors;
 
-static void
-refresh_sector_visibility(
-  const renderer *this,
-  const visibility_viewpoint *view,
-  sector *sect
-) {
-  register size_t i;
-  linedef *line;
-  sector *back_sector;
+  assert(src && dst && !(pitch_bytes % sizeof(uint32_t)));
 
-  sect->last_visibility_check_tick = this->tick;
-
-  if (!sect->visible_linedefs) {
-    sect->visible_linedefs = malloc(sect->linedefs_count * sizeof(linedef*));
-  }
-  sect->visible_linedefs_count = 0;
-
-  for (i = 0; i < sect->linedefs_count; ++i) {
-    line = sect->linedefs[i];
-
-    /*if (math_point_in_triangle(line->v0->point, view->position, view->far_left, view->far_right) ||
-        math_point_in_triangle(line->v1->point, view->position, view->far_left, view->far_right) ||
-        math_find_line_intersection(line->v0->point, line->v1->point, view->position, view->far_left, NULL, NULL) ||
-        math_find_line_intersection(line->v0->point, line->v1->point, view->position, view->far_right, NULL, NULL)
-    ) {
-      back_sector = line->side[0].sector == sect ? line->side[1].sector : line->side[0].sector;
-
-      if (back_sector && back_sector->last_visibility_check_tick != this->tick) {
-        line->last_mirror_check_tick = this->tick;
-        sect->visible_linedefs[sect->visible_linedefs_count++] = line;
-        refresh_sector_visibility(this, view, back_sector);
-      } else if (line->side[0].flags & LINEDEF_MIRROR && line->last_mirror_check_tick != this->tick) {
-        sect->visible_linedefs[sect->visible_linedefs_count++] = line;
-        line->last_mirror_check_tick = this->tick;
-        const vec2f half_dir = vec2f_mul(line->direction, 0.5f);
-        const vec2f line_midpoint = vec2f_add(line->v0->point, half_dir);
-        const visibility_viewpoint mirror_viewpoint = (visibility_viewpoint) {
-          .position = line_midpoint,
-          .far_left = vec2f_add(line_midpoint, vec2f_mul(vec2f_sub(line->side[0].normal, half_dir), RENDERER_DRAW_DISTANCE)),
-          .far_right = vec2f_add(line_midpoint, vec2f_mul(vec2f_add(line->side[0].normal, half_dir), RENDERER_DRAW_DISTANCE))
-        };
-        // refresh_sector_visibility(this, &mirror_viewpoint, sect);
-      }
-    }*/
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp parallel for private(x)
+#endif
+  for (y = 0; y < this->buffer_size.y; ++y) {
+    const pixel_type *in = src + (y * this->buffer_size.x);
+    uint32_t *out = (uint32_t*)((uint8_t*)dst + (y * pitch_bytes));
+
+    for (x = 0; x < this->buffer_size.x; ++x) {
+      out[x] = colors[in[x]];
+    }
   }
 }
 
+/* RGB 3-3-2 until the application sets its own palette */
+static void
+init_palette(renderer *this)
+{
+  uint8_t colors[RENDERER_PALETTE_SIZE * 3];
+  register int32_t i;
+
+  for (i = 0; i < RENDERER_PALETTE_SIZE; ++i) {
+    colors[i*3]   = ((i >> 5) & 7) * 255 / 7;
+    colors[i*3+1] = ((i >> 2) & 7) * 255 / 7;
+    colors[i*3+2] = (i & 3) * 255 / 3;
+  }
+
+  renderer_set_palette(this, colors);
+}
 #endif
 
-static int
-find_sector_intersections(
+void
+renderer_draw(
+  renderer *this,
+  camera *camera
+) {
+  assert(this->buffer);
+  renderer_draw_into(this, camera, this->buffer, this->buffer_size.x * sizeof(pixel_type));
+}
+
+void
+renderer_draw_into(
+  renderer *this,
+  camera *camera,
+  pixel_type *dst,
+  size_t pitch_bytes
+) {
+  assert(dst && !(pitch_bytes % sizeof(pixel_type)));
+
+  /* Frame state is shared with submitted frames */
+  renderer_wait(this);
+  draw_frame(this, camera, dst, pitch_bytes);
+}
+
+#ifdef RAYCASTER_ASYNC_RENDERING
+static void*
+renderer_worker_main(void *data)
+{
+  renderer *this = data;
+  struct renderer_worker *worker = this->worker;
+
+  pthread_mutex_lock(&worker->mutex);
+
+  for (;;) {
+    while (!worker->pending && !worker->quit) {
+      pthread_cond_wait(&worker->condition, &worker->mutex);
+    }
+
+    if (worker->quit) {
+      break;
+    }
+
+    worker->pending = false;
+    pthread_mutex_unlock(&worker->mutex);
+
+    draw_frame(this, &worker->camera, worker->target, worker->pitch);
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->busy = false;
+    pthread_cond_broadcast(&worker->condition);
+  }
+
+  pthread_mutex_unlock(&worker->mutex);
+
+  return NULL;
+}
+#endif
+
+void
+renderer_submit(
+  renderer *this,
+  camera *camera
+) {
+  register size_t i;
+
+  renderer_wait(this);
+
+  if (!this->frames[0]) {
+    for (i = 0; i < RENDERER_FRAME_BUFFERS; ++i) {
+      this->frames[i] = malloc(this->buffer_size.x * this->buffer_size.y * sizeof(pixel_type));
+    }
+  }
+
+  this->frame_index = (this->frame_index + 1) % RENDERER_FRAME_BUFFERS;
+  submit_frame(this, camera, this->frames[this->frame_index], this->buffer_size.x * sizeof(pixel_type));
+}
+
+void
+renderer_submit_into(
+  renderer *this,
+  camera *camera,
+  pixel_type *dst,
+  size_t pitch_bytes
+) {
+  renderer_wait(this);
+  submit_frame(this, camera, dst, pitch_bytes);
+}
+
+const pixel_type*
+renderer_wait(renderer *this)
+{
+#ifdef RAYCASTER_ASYNC_RENDERING
+  if (this->worker) {
+    pthread_mutex_lock(&this->worker->mutex);
+    while (this->worker->busy) {
+      pthread_cond_wait(&this->worker->condition, &this->worker->mutex);
+    }
+    pthread_mutex_unlock(&this->worker->mutex);
+  }
+#endif
+
+  return this->submitted_frame;
+}
+
+/* Draw into 'target' on the worker thread, or right away without async rendering */
+static void
+submit_frame(
+  renderer *this,
+  camera *camera,
+  pixel_type *target,
+  size_t pitch_bytes
+) {
+  this->submitted_frame = target;
+
+#ifdef RAYCASTER_ASYNC_RENDERING
+  if (!this->worker) {
+    this->worker = calloc(1, sizeof(struct renderer_worker));
+    pthread_mutex_init(&this->worker->mutex, NULL);
+    pthread_cond_init(&this->worker->condition, NULL);
+    pthread_create(&this->worker->thread, NULL, renderer_worker_main, this);
+  }
+
+  pthread_mutex_lock(&this->worker->mutex);
+  this->worker->camera = *camera;
+  this->worker->target = target;
+  this->worker->pitch = pitch_bytes;
+  this->worker->pending = this->worker->busy = true;
+  pthread_cond_broadcast(&this->worker->condition);
+  pthread_mutex_unlock(&this->worker->mutex);
+#else
+  draw_frame(this, camera, target, pitch_bytes);
+#endif
+}
+
+static void
+draw_frame(
+  renderer *this,
+  camera *camera,
+  pixel_type *dst,
+  size_t pitch_bytes
+) {
+  int32_t x;
+
+  const int32_t half_h = this->buffer_size.y >> 1;
+  sector *root_sector = camera->entity.sector;
+  const vec2f view_position = camera->entity.position;
+  const vec2f view_direction = camera->entity.direction;
+  const vec2f view_plane = camera->plane;
+
+  this->frame_info.level = camera->entity.level;
+  this->frame_info.buffer = dst;
+  this->frame_info.buffer_stride = pitch_bytes / sizeof(pixel_type);
+  this->frame_info.view_position = view_position;
+  this->frame_info.half_w = this->buffer_size.x >> 1;
+  this->frame_info.pitch_offset = (int32_t)floorf(camera->pitch * half_h);
+  this->frame_info.half_h = half_h + this->frame_info.pitch_offset;
+  this->frame_info.unit_size = (this->buffer_size.x >> 1) / camera->fov;
+  this->frame_info.view_z = camera->entity.z;
+  this->frame_info.sky_texture = this->frame_info.level->sky_texture;
+  this->plane_cache->count = 0;
+  this->tick++;
+
+  if (this->frame_info.sky_texture != TEXTURE_NONE) {
+    update_sky(this, view_direction, view_plane);
+  }
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  const visibility_viewpoint viewpoint = (visibility_viewpoint) {
+    .position = view_position,
+    .direction = view_direction,
+    .plane = view_plane,
+    .basis_determinant_inverse = 1.f / math_cross(view_direction, view_plane),
+    .half_w = this->buffer_size.x * 0.5f
+  };
+  prepare_visibility(this);
+  refresh_sector_visibility(this, &viewpoint, root_sector);
+#endif
+
+#ifdef RAYCASTER_RAY_PACKETS
+  #ifdef RAYCASTER_PARALLEL_RENDERING
+    #pragma omp parallel for
+  #endif
+  for (x = 0; x < this->buffer_size.x; x += RAY_PACKET_SIZE) {
+    register int32_t r;
+    uint8_t mask = 0;
+    column_info columns[RAY_PACKET_SIZE];
+    ray_context contexts[RAY_PACKET_SIZE] = { 0 };
+    ray_packet packet = { .start = view_position };
+
+    for (r = 0; r < RAY_PACKET_SIZE && (x + r) < this->buffer_size.x; ++r) {
+      setup_column(this, x + r, view_position, view_direction, view_plane, &columns[r], &packet.rays[r]);
+      packet.direction_x[r] = packet.rays[r].direction.x;
+      packet.direction_y[r] = packet.rays[r].direction.y;
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+      packet.camera_x[r] = packet.rays[r].camera_x;
+#endif
+      mask |= M_BIT(r);
+    }
+
+    /* Unused lanes of the last packet still need a valid direction */
+    for (; r < RAY_PACKET_SIZE; ++r) {
+      packet.direction_x[r] = packet.direction_x[0];
+      packet.direction_y[r] = packet.direction_y[0];
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+      packet.camera_x[r] = packet.camera_x[0];
+#endif
+    }
+
+    find_sector_intersections_packet(this, root_sector, &packet, contexts, columns, mask);
+
+    for (r = 0; r < RAY_PACKET_SIZE; ++r) {
+      if (mask & M_BIT(r)) {
+        draw_column(this, &packet.rays[r], &contexts[r], &columns[r]);
+      }
+    }
+  }
+#else
+  #ifdef RAYCASTER_PARALLEL_RENDERING
+    #pragma omp parallel for
+  #endif
+  for (x = 0; x < this->buffer_size.x; ++x) {
+    column_info column;
+    ray_context context = { 0 };
+    ray_info ray;
+
+    setup_column(this, x, view_position, view_direction, view_plane, &column, &ray);
+    find_sector_intersections(this, root_sector, &ray, &context, &column, 0);
+    draw_column(this, &ray, &context, &column);
+  }
+#endif
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  shade_deferred(this);
+#endif
+
+#if defined(RAYCASTER_DEBUG) && !defined(RAYCASTER_PARALLEL_RENDERING)
+  renderer_step = NULL;
+#endif
+}
+
+/*
+ * Paint a part of the column black. Used wherever nothing else gets drawn, so that
+ * every pixel of the frame is written and the buffer never needs clearing.
+ */
+M_INLINED void
+fill_column_segment(const renderer *this, const column_info *column, int32_t from, int32_t to)
+{
+  register int32_t y;
+  pixel_type *p = column->buffer_start + (from * column->buffer_stride);
+
+  M_UNUSED(this);
+
+  for (y = from; y < to; ++y, p += column->buffer_stride) {
+    *p = PIXEL_BLACK(this);
+    CLEAR_GBUFFER(column, y)
+    INSERT_RENDER_BREAKPOINT
+  }
+}
+
+/* Resolve mirrors and the terminating wall of a traced column, then draw it */
+static void
+draw_column(
   const renderer *this,
-  const sector *sect,
   const ray_info *ray,
   ray_context *context,
+  column_info *column
+) {
+  /* Insert the closest full wall we found */
+  if (context->full_wall) {
+    insert_sorted(context->full_wall, &context->head);
+
+    if (context->full_wall->line->side[0].flags & LINEDEF_MIRROR) {
+      /*
+       * If it's a mirror, convert the ray into mirror-space and start finding additional
+       * intersections that will follow the mirror wall.
+       */
+      find_mirror_intersections(this, ray, context->full_wall, column);
+    } else {
+      /* Otherwise just terminate the ray here */
+      context->full_wall->next = NULL;
+    }
+  }
+
+  draw_column_intersection(this, context->head, column);
+
+  /* Fill the remainder of the column */
+  if (!column->finished) {
+    fill_column_segment(this, column, (int32_t)floorf(column->top_limit), (int32_t)floorf(column->bottom_limit));
+  }
+}
+
+/* ----- */
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+
+/* Make room for the per-frame state of every sector and vertex of the level */
+static void
+prepare_visibility(renderer *this)
+{
+  struct renderer_visibility *vis = this->visibility;
+  const level_data *level = this->frame_info.level;
+
+  if (level->sectors_count > vis->sectors_count) {
+    vis->sectors = realloc(vis->sectors, level->sectors_count * sizeof(sector_geometry));
+    vis->sector_ticks = realloc(vis->sector_ticks, level->sectors_count * sizeof(uint32_t));
+    memset(vis->sectors + vis->sectors_count, 0, (level->sectors_count - vis->sectors_count) * sizeof(sector_geometry));
+    memset(vis->sector_ticks + vis->sectors_count, 0, (level->sectors_count - vis->sectors_count) * sizeof(uint32_t));
+    vis->sectors_count = level->sectors_count;
+  }
+
+  if (level->vertices_count > vis->vertices_count) {
+    vis->vertices = realloc(vis->vertices, level->vertices_count * sizeof(vec2f));
+    vis->vertex_ticks = realloc(vis->vertex_ticks, level->vertices_count * sizeof(uint32_t));
+    memset(vis->vertex_ticks + vis->vertices_count, 0, (level->vertices_count - vis->vertices_count) * sizeof(uint32_t));
+    vis->vertices_count = level->vertices_count;
+  }
+}
+
+static void
+free_visibility(renderer *this)
+{
+  struct renderer_visibility *vis = this->visibility;
+  size_t i;
+
+  for (i = 0; i < vis->sectors_count; ++i) {
+    free(vis->sectors[i].v0_x);
+    free(vis->sectors[i].linedefs);
+  }
+
+  free(vis->sectors);
+  free(vis->sector_ticks);
+  free(vis->vertices);
+  free(vis->vertex_ticks);
+  *vis = (struct renderer_visibility) { 0 };
+}
+
+/* Visible subset of the sector's geometry, can never be larger than all of it */
+static void
+reserve_visible_geometry(sector_geometry *visible, size_t capacity)
+{
+  /* One block for all arrays; each array is a multiple of 16 bytes long */
+  float *data = realloc(visible->v0_x, 11 * capacity * sizeof(float));
+  visible->v0_x = data;
+  visible->v0_y = data + capacity;
+  visible->direction_x = data + capacity * 2;
+  visible->direction_y = data + capacity * 3;
+  visible->facing = data + capacity * 4;
+  visible->column_min = data + capacity * 5;
+  visible->column_max = data + capacity * 6;
+  visible->inverse_depth = data + capacity * 7;
+  visible->inverse_depth_step = data + capacity * 8;
+  visible->texture_u = data + capacity * 9;
+  visible->texture_u_step = data + capacity * 10;
+  visible->linedefs = realloc(visible->linedefs, capacity * sizeof(linedef*));
+  visible->capacity = capacity;
+}
+
+M_INLINED const sector_geometry*
+visible_geometry(const renderer *this, const sector *sect)
+{
+  return &this->visibility->sectors[sect - this->frame_info.level->sectors];
+}
+
+/* Camera space coordinates of a vertex (lateral offset along the view plane, depth), once per frame */
+M_INLINED vec2f
+project_vertex(const renderer *this, const visibility_viewpoint *view, const vertex *v)
+{
+  struct renderer_visibility *vis = this->visibility;
+  const size_t index = v - this->frame_info.level->vertices;
+  vec2f relative;
+
+  if (vis->vertex_ticks[index] != this->tick) {
+    relative = vec2f_sub(v->point, view->position);
+    vis->vertices[index] = VEC2F(
+      math_cross(view->direction, relative) * view->basis_determinant_inverse,
+      math_cross(relative, view->plane) * view->basis_determinant_inverse
+    );
+    vis->vertex_ticks[index] = this->tick;
+  }
+
+  return vis->vertices[index];
+}
+
+/*
+ * Find the (conservative) range of screen columns whose primary rays can hit a line
+ * between camera space points 'a' and 'b'. Returns false if the line is not in view.
+ */
+M_INLINED bool
+find_column_range(const visibility_viewpoint *view, vec2f a, vec2f b, float *column_min, float *column_max)
+{
+  float u0, u1, lateral;
+  vec2f tmp;
+
+  if (a.y <= 0.f && b.y <= 0.f) {
+    return false;
+  }
+
+  if (a.y <= 0.f) {
+    tmp = a; a = b; b = tmp;
+  }
+
+  /* Close enough to the camera plane that anything goes */
+  if (a.y < MATHS_EPSILON) {
+    *column_min = 0.f;
+    *column_max = 2.f * view->half_w;
+    return true;
+  }
+
+  u0 = math_clamp(a.x / a.y, -2.f, 2.f);
+
+  if (b.y < MATHS_EPSILON) {
+    /* Line crosses the camera plane and extends to the side it crosses it on */
+    lateral = a.x + (b.x - a.x) * (a.y / (a.y - b.y));
+    u1 = lateral > 0.f ? 2.f : -2.f;
+    if (fabsf(lateral) < MATHS_EPSILON) {
+      u0 = -u1;
+    }
+  } else {
+    u1 = math_clamp(b.x / b.y, -2.f, 2.f);
+  }
+
+  /* Column x looks along (direction + plane * (x / half_w - 1)); pad by a column for rounding */
+  *column_min = floorf((math_min(u0, u1) + 1.f) * view->half_w) - 1.f;
+  *column_max = ceilf((math_max(u0, u1) + 1.f) * view->half_w) + 1.f;
+
+  return *column_max >= 0.f && *column_min < 2.f * view->half_w;
+}
+
+/*
+ * Collect the linedefs of the sector that face the camera and cover at least one
+ * screen column, along with the column range. Primary rays then only need to test
+ * those, and only when the column is in range. Recurses into all back sectors that
+ * can be seen through the collected linedefs.
+ */
+static void
+refresh_sector_visibility(
+  const renderer *this,
+  const visibility_viewpoint *view,
+  const sector *sect
+) {
+  register size_t i, n = 0;
+  struct renderer_visibility *vis = this->visibility;
+  const size_t index = sect - this->frame_info.level->sectors;
+  const sector_geometry *geo = &sect->geometry;
+  sector_geometry *visible = &vis->sectors[index];
+  float column_min, column_max, determinant;
+  vec2f a, b;
+  linedef *line;
+  const sector *back_sector;
+
+  vis->sector_ticks[index] = this->tick;
+
+  if (visible->capacity < geo->capacity) {
+    reserve_visible_geometry(visible, geo->capacity);
+  }
+
+  for (i = 0; i < geo->count; ++i) {
+    if (math_cross(
+          VEC2F(geo->direction_x[i], geo->direction_y[i]),
+          VEC2F(view->position.x - geo->v0_x[i], view->position.y - geo->v0_y[i])
+        ) * geo->facing[i] > 0.f) {
+      continue;
+    }
+
+    line = geo->linedefs[i];
+    a = project_vertex(this, view, line->v0);
+    b = project_vertex(this, view, line->v1);
+
+    if (!find_column_range(view, a, b, &column_min, &column_max)) {
+      continue;
+    }
+
+    /*
+     * A point at line_det t is at (a.x + t*dx, a.y + t*dy) in camera space and seen from
+     * camera_x = lateral/depth. Solving for t gives both 1/depth and t/depth as linear
+     * functions of camera_x. Lines through the camera get zeros, which never hit.
+     */
+    determinant = math_cross(a, b);
+
+    if (fabsf(determinant) < MATHS_EPSILON) {
+      visible->inverse_depth[n] = visible->inverse_depth_step[n] = 0.f;
+      visible->texture_u[n] = visible->texture_u_step[n] = 0.f;
+    } else {
+      determinant = 1.f / determinant;
+      visible->inverse_depth[n] = (a.x - b.x) * determinant;
+      visible->inverse_depth_step[n] = (b.y - a.y) * determinant;
+      visible->texture_u[n] = a.x * determinant;
+      visible->texture_u_step[n] = -a.y * determinant;
+    }
+
+    visible->v0_x[n] = geo->v0_x[i];
+    visible->v0_y[n] = geo->v0_y[i];
+    visible->direction_x[n] = geo->direction_x[i];
+    visible->direction_y[n] = geo->direction_y[i];
+    visible->facing[n] = geo->facing[i];
+    visible->column_min[n] = column_min;
+    visible->column_max[n] = column_max;
+    visible->linedefs[n++] = line;
+
+    back_sector = line->side[geo->facing[i] > 0.f ? 1 : 0].sector;
+
+    if (back_sector && vis->sector_ticks[back_sector - this->frame_info.level->sectors] != this->tick) {
+      refresh_sector_visibility(this, view, back_sector);
+    }
+  }
+
+  visible->count = n;
+
+  /* Pad the last group of four */
+  for (; n & 3; ++n) {
+    visible->v0_x[n] = visible->v0_y[n] = 0.f;
+    visible->direction_x[n] = visible->direction_y[n] = 0.f;
+    visible->facing[n] = 1.f;
+    visible->column_min[n] = 1.f;
+    visible->column_max[n] = -1.f;
+    visible->inverse_depth[n] = visible->inverse_depth_step[n] = 0.f;
+    visible->texture_u[n] = visible->texture_u_step[n] = 0.f;
+  }
+}
+
+#endif
+
+/* Append a new intersection to column's list */
+M_INLINED ray_intersection*
+add_intersection(
+  const renderer *this,
+  const sector *sect,
+  const ray_info *ray,
   column_info *column,
-  float det_accum
+  linedef *line,
+  int side,
+  vec2f point,
+  float planar_distance,
+  float line_det,
+  float ray_det
 ) {
+  const float point_distance = planar_distance * ray->theta_inverse;
+  const float depth_scale_factor = this->frame_info.unit_size / planar_distance;
+  const float cz_scaled = sect->ceiling.height * depth_scale_factor;
+  const float fz_scaled = sect->floor.height * depth_scale_factor;
+  const float vz_scaled = this->frame_info.view_z * depth_scale_factor;
+  ray_intersection *intersection = &column->intersections.list[column->intersections.count++];
+
+  *intersection = (ray_intersection) {
+    .ray = {
+      .origin = ray->perspective_origin,
+      .direction_normalized = ray->direction_normalized,
+      .primary = ray->primary
+    },
+    .point = point,
+    .planar_distance = planar_distance,
+    .point_distance_inverse = 1.f / point_distance,
+    .depth_scale_factor = depth_scale_factor,
+    .cz_scaled = cz_scaled,
+    .fz_scaled = fz_scaled,
+    .vz_scaled = vz_scaled,
+    .cz_local = this->frame_info.half_h - cz_scaled + vz_scaled,
+    .fz_local = this->frame_info.half_h - fz_scaled + vz_scaled,
+    .determinant = line_det,
+    .ray_determinant = ray_det,
+    .texture_x = line_det * line->length,
+    .texture_step = planar_distance / this->frame_info.unit_size,
+    .segment = &line->side[side].segments[(uint16_t)floorf((line->segments - 1) * line_det)],
+    .line = line,
+    .front_sector = (sector*)sect,
+    .back_sector = line->side[!side].sector,
+    .side = side,
+    .distance_steps = (uint8_t)(point_distance * LIGHT_STEP_DISTANCE_INVERSE),
+#if !defined RAYCASTER_LIGHT_STEPS || (RAYCASTER_LIGHT_STEPS == 0)
+    .light_falloff = point_distance * DIMMING_DISTANCE_INVERSE,
+#endif
+    .next = NULL
+  };
+
+  return intersection;
+}
+
+/* Returns false if the sector was already visited by this ray (or history is full) */
+M_INLINED bool
+enter_sector(ray_context *context, const sector *sect)
+{
   register size_t i;
-  float planar_distance, point_distance,
-    line_det, ray_det,
-    depth_scale_factor, cz_scaled, fz_scaled, vz_scaled,
-    sign;
-  vec2f point;
-  int side, result_count = 0;
-  linedef *line;
-  
+
   if (context->count == MAX_SECTOR_HISTORY) {
-    return result_count;
+    return false;
   }
 
   for (i = 0; i < context->count; ++i) {
     if (context->sectors[i] == sect) {
-      return result_count;
+      return false;
     }
   }
 
   context->sectors[context->count++] = sect;
 
-  size_t insert_index;
+  return true;
+}
+
+/* Is the linedef facing away from the viewer, when looking at it from given sector */
+M_INLINED bool
+linedef_facing_away(const linedef *line, int side, vec2f origin)
+{
+  const float sign = math_sign(line->v0->point, line->v1->point, origin);
+  return (side == 0 && sign > 0) || (side == 1 && sign < 0);
+}
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+
+/*
+ * Hit test of a primary ray against the i-th linedef of the visible geometry, using
+ * the per-frame projection instead of a full line intersection. The results are the
+ * same as math_find_line_intersection_cached would give (requiring ray_det > 0).
+ */
+M_INLINED bool
+project_linedef_hit(const sector_geometry *geo, size_t i, float camera_x, vec2f *point, float *line_det, float *ray_det)
+{
+  const float inverse_depth = geo->inverse_depth[i] + (geo->inverse_depth_step[i] * camera_x);
+  const float texture_u = geo->texture_u[i] + (geo->texture_u_step[i] * camera_x);
+  float depth;
+
+  if (inverse_depth < DRAW_DISTANCE_INVERSE || texture_u < 0.f || texture_u > inverse_depth) {
+    return false;
+  }
+
+  depth = 1.f / inverse_depth;
+  *line_det = math_min(texture_u * depth, 1.f);
+  *ray_det = depth * DRAW_DISTANCE_INVERSE;
+  *point = VEC2F(
+    geo->v0_x[i] + (*line_det * geo->direction_x[i]),
+    geo->v0_y[i] + (*line_det * geo->direction_y[i])
+  );
+
+  return true;
+}
+
+#endif
+
+#ifdef RAYCASTER_SIMD_RAY_TESTS
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+
+/*
+ * project_linedef_hit for four linedefs of the visible geometry (starting from 'base')
+ * at once, also rejecting the linedefs outside of the ray's screen 'column'.
+ */
+M_INLINED uint8_t
+project_linedefs(
+  const sector_geometry *geo,
+  size_t base,
+  float camera_x,
+  float column,
+  float line_det[4],
+  float ray_det[4]
+) {
+#ifdef __ARM_NEON
+  uint32_t lanes[4];
+  const float32x4_t inverse_depth = vmlaq_n_f32(vld1q_f32(&geo->inverse_depth[base]), vld1q_f32(&geo->inverse_depth_step[base]), camera_x);
+  const float32x4_t texture_u = vmlaq_n_f32(vld1q_f32(&geo->texture_u[base]), vld1q_f32(&geo->texture_u_step[base]), camera_x);
+#if defined(__aarch64__)
+  const float32x4_t depth = vdivq_f32(vdupq_n_f32(1.f), inverse_depth);
+#else
+  float32x4_t depth = vrecpeq_f32(inverse_depth);
+  depth = vmulq_f32(vrecpsq_f32(inverse_depth, depth), depth);
+  depth = vmulq_f32(vrecpsq_f32(inverse_depth, depth), depth);
+#endif
+  uint32x4_t hit = vcgeq_f32(inverse_depth, vdupq_n_f32(DRAW_DISTANCE_INVERSE));
+  hit = vandq_u32(hit, vcgeq_f32(texture_u, vdupq_n_f32(0.f)));
+  hit = vandq_u32(hit, vcleq_f32(texture_u, inverse_depth));
+  hit = vandq_u32(hit, vcleq_f32(vld1q_f32(&geo->column_min[base]), vdupq_n_f32(column)));
+  hit = vandq_u32(hit, vcgeq_f32(vld1q_f32(&geo->column_max[base]), vdupq_n_f32(column)));
+  vst1q_f32(line_det, vminq_f32(vmulq_f32(texture_u, depth), vdupq_n_f32(1.f)));
+  vst1q_f32(ray_det, vmulq_n_f32(depth, DRAW_DISTANCE_INVERSE));
+  vst1q_u32(lanes, hit);
+  return (lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8);
+#else
+  const __m128 x = _mm_set1_ps(camera_x);
+  const __m128 inverse_depth = _mm_add_ps(_mm_loadu_ps(&geo->inverse_depth[base]), _mm_mul_ps(_mm_loadu_ps(&geo->inverse_depth_step[base]), x));
+  const __m128 texture_u = _mm_add_ps(_mm_loadu_ps(&geo->texture_u[base]), _mm_mul_ps(_mm_loadu_ps(&geo->texture_u_step[base]), x));
+  const __m128 depth = _mm_div_ps(_mm_set1_ps(1.f), inverse_depth);
+  __m128 hit = _mm_cmpge_ps(inverse_depth, _mm_set1_ps(DRAW_DISTANCE_INVERSE));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(texture_u, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(texture_u, inverse_depth));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_loadu_ps(&geo->column_min[base]), _mm_set1_ps(column)));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(_mm_loadu_ps(&geo->column_max[base]), _mm_set1_ps(column)));
+  _mm_storeu_ps(line_det, _mm_min_ps(_mm_mul_ps(texture_u, depth), _mm_set1_ps(1.f)));
+  _mm_storeu_ps(ray_det, _mm_mul_ps(depth, _mm_set1_ps(DRAW_DISTANCE_INVERSE)));
+  return (uint8_t)_mm_movemask_ps(hit);
+#endif
+}
+
+#endif
+
+/*
+ * Test one ray against four linedefs of the sector geometry (starting from 'base').
+ * Equivalent of the facing check followed by math_find_line_intersection_cached
+ * (with ray_det > 0) for each of them. Primary rays are handed over to
+ * project_linedefs. Returns a bitmask of the linedefs that were hit.
+ */
+M_INLINED uint8_t
+ray_intersect_linedefs(
+  const sector_geometry *geo,
+  size_t base,
+  const ray_info *ray,
+  float column,
+  float line_det[4],
+  float ray_det[4]
+) {
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  if (ray->primary) {
+    return project_linedefs(geo, base, ray->camera_x, column, line_det, ray_det);
+  }
+#endif
+
+#ifdef __ARM_NEON
+  uint32_t lanes[4];
+  const float32x4_t v0_x = vld1q_f32(&geo->v0_x[base]);
+  const float32x4_t v0_y = vld1q_f32(&geo->v0_y[base]);
+  const float32x4_t ba_x = vld1q_f32(&geo->direction_x[base]);
+  const float32x4_t ba_y = vld1q_f32(&geo->direction_y[base]);
+  const float32x4_t sign = vsubq_f32(
+    vmulq_f32(ba_x, vsubq_f32(vdupq_n_f32(ray->perspective_origin.y), v0_y)),
+    vmulq_f32(vsubq_f32(vdupq_n_f32(ray->perspective_origin.x), v0_x), ba_y)
+  );
+  const float32x4_t ac_x = vsubq_f32(v0_x, vdupq_n_f32(ray->start.x));
+  const float32x4_t ac_y = vsubq_f32(v0_y, vdupq_n_f32(ray->start.y));
+  const float32x4_t cross = vsubq_f32(vmulq_n_f32(ba_x, ray->direction.y), vmulq_n_f32(ba_y, ray->direction.x));
+#if defined(__aarch64__)
+  const float32x4_t denom = vdivq_f32(vdupq_n_f32(1.f), cross);
+#else
+  float32x4_t denom = vrecpeq_f32(cross);
+  denom = vmulq_f32(vrecpsq_f32(cross, denom), denom);
+  denom = vmulq_f32(vrecpsq_f32(cross, denom), denom);
+#endif
+  const float32x4_t u_b = vmulq_f32(vsubq_f32(vmulq_f32(ba_x, ac_y), vmulq_f32(ba_y, ac_x)), denom);
+  const float32x4_t u_a = vmulq_f32(vsubq_f32(vmulq_n_f32(ac_y, ray->direction.x), vmulq_n_f32(ac_x, ray->direction.y)), denom);
+  uint32x4_t hit = vcleq_f32(vmulq_f32(sign, vld1q_f32(&geo->facing[base])), vdupq_n_f32(0.f));
+  hit = vandq_u32(hit, vcgeq_f32(vabsq_f32(cross), vdupq_n_f32(MATHS_EPSILON)));
+  hit = vandq_u32(hit, vcgtq_f32(u_b, vdupq_n_f32(0.f)));
+  hit = vandq_u32(hit, vcleq_f32(u_b, vdupq_n_f32(1.f)));
+  hit = vandq_u32(hit, vcgeq_f32(u_a, vdupq_n_f32(0.f)));
+  hit = vandq_u32(hit, vcleq_f32(u_a, vdupq_n_f32(1.f)));
+  vst1q_f32(line_det, u_a);
+  vst1q_f32(ray_det, u_b);
+  vst1q_u32(lanes, hit);
+  return (lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8);
+#else
+  const __m128 v0_x = _mm_loadu_ps(&geo->v0_x[base]);
+  const __m128 v0_y = _mm_loadu_ps(&geo->v0_y[base]);
+  const __m128 ba_x = _mm_loadu_ps(&geo->direction_x[base]);
+  const __m128 ba_y = _mm_loadu_ps(&geo->direction_y[base]);
+  const __m128 sign = _mm_sub_ps(
+    _mm_mul_ps(ba_x, _mm_sub_ps(_mm_set1_ps(ray->perspective_origin.y), v0_y)),
+    _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(ray->perspective_origin.x), v0_x), ba_y)
+  );
+  const __m128 ac_x = _mm_sub_ps(v0_x, _mm_set1_ps(ray->start.x));
+  const __m128 ac_y = _mm_sub_ps(v0_y, _mm_set1_ps(ray->start.y));
+  const __m128 cross = _mm_sub_ps(_mm_mul_ps(ba_x, _mm_set1_ps(ray->direction.y)), _mm_mul_ps(ba_y, _mm_set1_ps(ray->direction.x)));
+  const __m128 denom = _mm_div_ps(_mm_set1_ps(1.f), cross);
+  const __m128 u_b = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(ba_x, ac_y), _mm_mul_ps(ba_y, ac_x)), denom);
+  const __m128 u_a = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(ray->direction.x), ac_y), _mm_mul_ps(_mm_set1_ps(ray->direction.y), ac_x)), denom);
+  __m128 hit = _mm_cmple_ps(_mm_mul_ps(sign, _mm_loadu_ps(&geo->facing[base])), _mm_setzero_ps());
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), cross), _mm_set1_ps(MATHS_EPSILON)));
+  hit = _mm_and_ps(hit, _mm_cmpgt_ps(u_b, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(u_b, _mm_set1_ps(1.f)));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(u_a, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(u_a, _mm_set1_ps(1.f)));
+  _mm_storeu_ps(line_det, u_a);
+  _mm_storeu_ps(ray_det, u_b);
+  return (uint8_t)_mm_movemask_ps(hit);
+#endif
+}
+
+#endif
+
+static int
+find_sector_intersections(
+  const renderer *this,
+  const sector *sect,
+  const ray_info *ray,
+  ray_context *context,
+  column_info *column,
+  float det_accum
+) {
+  register size_t i;
+  float planar_distance, line_det, ray_det;
+  vec2f point;
+  int side, result_count = 0;
+  linedef *line;
   sector *back_sector;
+  ray_intersection *intersection;
 
-#if defined(RAYCASTER_PRERENDER_VISCHECK) && 0
-  for (i = 0; i < sect->visible_linedefs_count && column->intersections.count < MAX_LINE_HITS_PER_COLUMN; ++i) {
-    line = sect->visible_linedefs[i];
+  if (!enter_sector(context, sect)) {
+    return result_count;
+  }
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  const sector_geometry *geo = ray->primary ? visible_geometry(this, sect) : &sect->geometry;
 #else
-  for (i = 0; i < sect->linedefs_count && column->intersections.count < MAX_LINE_HITS_PER_COLUMN; ++i) {
-    line = sect->linedefs[i];
+  const sector_geometry *geo = &sect->geometry;
 #endif
 
-    side = line->side[0].sector == sect ? 0 : 1;
-    sign = math_sign(line->v0->point, line->v1->point, ray->perspective_origin);
+#ifdef RAYCASTER_SIMD_RAY_TESTS
+  register size_t base;
+  register int lane;
+  float line_dets[4], ray_dets[4];
+  uint8_t hits;
 
-    if ((side == 0 && sign > 0) || (side == 1 && sign < 0)) {
+  for (base = 0; base < geo->count; base += 4) {
+    if (!(hits = ray_intersect_linedefs(geo, base, ray, column->index, line_dets, ray_dets))) {
       continue;
     }
 
-    if (math_find_line_intersection_cached(line->v0->point, ray->start, line->direction, ray->direction, &point, &line_det, &ray_det) && ray_det > 0) {
+    for (lane = 0; lane < 4; ++lane) {
+      if (!(hits & M_BIT(lane))) {
+        continue;
+      }
+
+      if (column->intersections.count >= MAX_LINE_HITS_PER_COLUMN) {
+        return result_count;
+      }
+
+      i = base + lane;
+      line = geo->linedefs[i];
+      side = geo->facing[i] > 0.f ? 0 : 1;
+      line_det = line_dets[lane];
+      ray_det = ray_dets[lane];
+      point = VEC2F(
+        geo->v0_x[i] + (line_det * geo->direction_x[i]),
+        geo->v0_y[i] + (line_det * geo->direction_y[i])
+      );
+#else
+  bool hit;
+
+  for (i = 0; i < geo->count && column->intersections.count < MAX_LINE_HITS_PER_COLUMN; ++i) {
+    line = geo->linedefs[i];
+    side = geo->facing[i] > 0.f ? 0 : 1;
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+    if (ray->primary) {
+      hit = column->index >= geo->column_min[i]
+        && column->index <= geo->column_max[i]
+        && project_linedef_hit(geo, i, ray->camera_x, &point, &line_det, &ray_det);
+    } else
+#endif
+    {
+      hit = !linedef_facing_away(line, side, ray->perspective_origin)
+        && math_find_line_intersection_cached(line->v0->point, ray->start, line->direction, ray->direction, &point, &line_det, &ray_det)
+        && ray_det > 0;
+    }
+
+    if (hit) {
+#endif
       planar_distance = (det_accum + ray_det) * RENDERER_DRAW_DISTANCE;
 
       if (planar_distance > RENDERER_DRAW_DISTANCE) {
-        break;
+        return result_count;
       }
 
-      result_count ++;
-      point_distance = planar_distance * ray->theta_inverse;
-
-      depth_scale_factor = this->frame_info.unit_size / planar_distance;
-      cz_scaled = sect->ceiling.height * depth_scale_factor;
-      fz_scaled = sect->floor.height * depth_scale_factor;
-      vz_scaled = this->frame_info.view_z * depth_scale_factor;
-
-      result_count ++;
-      insert_index = column->intersections.count++;
-
-      column->intersections.list[insert_index] = (ray_intersection) {
-        .ray = {
-          .origin = ray->perspective_origin,
-          .direction_normalized = ray->direction_normalized
-        },
-        .point = point,
-        .planar_distance = planar_distance,
-        .point_distance_inverse = 1.f / point_distance,
-        .depth_scale_factor = depth_scale_factor,
-        .cz_scaled = cz_scaled,
-        .fz_scaled = fz_scaled,
-        .vz_scaled = vz_scaled,
-        .cz_local = this->frame_info.half_h - cz_scaled + vz_scaled,
-        .fz_local = this->frame_info.half_h - fz_scaled + vz_scaled,
-        .determinant = line_det,
-        .ray_determinant = det_accum + ray_det,
-        .line = line,
-        .front_sector = (sector*)sect,
-        .back_sector = line->side[!side].sector,
-        .side = side,
-        .distance_steps = (uint8_t)(point_distance * LIGHT_STEP_DISTANCE_INVERSE),
-#if !defined RAYCASTER_LIGHT_STEPS || (RAYCASTER_LIGHT_STEPS == 0)
-        .light_falloff = point_distance * DIMMING_DISTANCE_INVERSE,
-#endif
-        .next = NULL
-      };
+      result_count += 2;
+      intersection = add_intersection(this, sect, ray, column, line, side, point, planar_distance, line_det, det_accum + ray_det);
 
       /*
        * Keep track of the closest full wall that we can find (in case of concave polygons
@@ -459,11 +1626,11 @@ find_sector_intersections(
       */
       if ((back_sector = line->side[!side].sector)) {
         if (!context->full_wall || planar_distance < context->full_wall->planar_distance) {
-          insert_sorted(&column->intersections.list[insert_index], &context->head);
+          insert_sorted(intersection, &context->head);
           result_count += find_sector_intersections(this, back_sector, ray, context, column, det_accum);
         }
       } else if (!context->full_wall || planar_distance < context->full_wall->planar_distance) {
-        context->full_wall = &column->intersections.list[insert_index];
+        context->full_wall = intersection;
       }
     }
   }
@@ -471,6 +1638,241 @@ find_sector_intersections(
   return result_count;
 }
 
+#ifdef RAYCASTER_RAY_PACKETS
+
+/*
+ * Intersect all rays of the packet with the i-th linedef of the geometry at once.
+ * Equivalent of calling math_find_line_intersection_cached (and requiring
+ * ray_det > 0) for every lane, but the linedef's origin and direction are only
+ * loaded once. Returns a bitmask of lanes (from the ones enabled in 'mask')
+ * that hit the linedef.
+ */
+M_INLINED uint8_t
+ray_packet_intersect_linedef(
+  const ray_packet *packet,
+  const sector_geometry *geo,
+  size_t i,
+  uint8_t mask,
+  float line_det[RAY_PACKET_SIZE],
+  float ray_det[RAY_PACKET_SIZE]
+) {
+  const vec2f BA = VEC2F(geo->direction_x[i], geo->direction_y[i]);
+  const vec2f AC = VEC2F(geo->v0_x[i] - packet->start.x, geo->v0_y[i] - packet->start.y);
+
+#ifdef __ARM_NEON
+  uint32_t lanes[RAY_PACKET_SIZE];
+  const float32x4_t dx = vld1q_f32(packet->direction_x);
+  const float32x4_t dy = vld1q_f32(packet->direction_y);
+  const float32x4_t cross = vsubq_f32(vmulq_n_f32(dy, BA.x), vmulq_n_f32(dx, BA.y));
+#if defined(__aarch64__)
+  const float32x4_t denom = vdivq_f32(vdupq_n_f32(1.f), cross);
+#else
+  float32x4_t denom = vrecpeq_f32(cross);
+  denom = vmulq_f32(vrecpsq_f32(cross, denom), denom);
+  denom = vmulq_f32(vrecpsq_f32(cross, denom), denom);
+#endif
+  const float32x4_t u_b = vmulq_n_f32(denom, math_cross(BA, AC));
+  const float32x4_t u_a = vmulq_f32(vsubq_f32(vmulq_n_f32(dx, AC.y), vmulq_n_f32(dy, AC.x)), denom);
+  uint32x4_t hit = vcgeq_f32(vabsq_f32(cross), vdupq_n_f32(MATHS_EPSILON));
+  hit = vandq_u32(hit, vcgtq_f32(u_b, vdupq_n_f32(0.f)));
+  hit = vandq_u32(hit, vcleq_f32(u_b, vdupq_n_f32(1.f)));
+  hit = vandq_u32(hit, vcgeq_f32(u_a, vdupq_n_f32(0.f)));
+  hit = vandq_u32(hit, vcleq_f32(u_a, vdupq_n_f32(1.f)));
+  vst1q_f32(line_det, u_a);
+  vst1q_f32(ray_det, u_b);
+  vst1q_u32(lanes, hit);
+  return mask & ((lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8));
+#else
+  const __m128 dx = _mm_loadu_ps(packet->direction_x);
+  const __m128 dy = _mm_loadu_ps(packet->direction_y);
+  const __m128 cross = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(BA.x), dy), _mm_mul_ps(_mm_set1_ps(BA.y), dx));
+  const __m128 denom = _mm_div_ps(_mm_set1_ps(1.f), cross);
+  const __m128 u_b = _mm_mul_ps(_mm_set1_ps(math_cross(BA, AC)), denom);
+  const __m128 u_a = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dx, _mm_set1_ps(AC.y)), _mm_mul_ps(dy, _mm_set1_ps(AC.x))), denom);
+  __m128 hit = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), cross), _mm_set1_ps(MATHS_EPSILON));
+  hit = _mm_and_ps(hit, _mm_cmpgt_ps(u_b, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(u_b, _mm_set1_ps(1.f)));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(u_a, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(u_a, _mm_set1_ps(1.f)));
+  _mm_storeu_ps(line_det, u_a);
+  _mm_storeu_ps(ray_det, u_b);
+  return mask & (uint8_t)_mm_movemask_ps(hit);
+#endif
+}
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+
+/*
+ * project_linedef_hit for all rays of the packet against the i-th linedef of the
+ * visible geometry. Returns a bitmask of lanes (from the ones enabled in 'mask')
+ * that hit the linedef.
+ */
+M_INLINED uint8_t
+ray_packet_project_linedef(
+  const ray_packet *packet,
+  const sector_geometry *geo,
+  size_t i,
+  uint8_t mask,
+  float line_det[RAY_PACKET_SIZE],
+  float ray_det[RAY_PACKET_SIZE]
+) {
+#ifdef __ARM_NEON
+  uint32_t lanes[RAY_PACKET_SIZE];
+  const float32x4_t x = vld1q_f32(packet->camera_x);
+  const float32x4_t inverse_depth = vmlaq_n_f32(vdupq_n_f32(geo->inverse_depth[i]), x, geo->inverse_depth_step[i]);
+  const float32x4_t texture_u = vmlaq_n_f32(vdupq_n_f32(geo->texture_u[i]), x, geo->texture_u_step[i]);
+#if defined(__aarch64__)
+  const float32x4_t depth = vdivq_f32(vdupq_n_f32(1.f), inverse_depth);
+#else
+  float32x4_t depth = vrecpeq_f32(inverse_depth);
+  depth = vmulq_f32(vrecpsq_f32(inverse_depth, depth), depth);
+  depth = vmulq_f32(vrecpsq_f32(inverse_depth, depth), depth);
+#endif
+  uint32x4_t hit = vcgeq_f32(inverse_depth, vdupq_n_f32(DRAW_DISTANCE_INVERSE));
+  hit = vandq_u32(hit, vcgeq_f32(texture_u, vdupq_n_f32(0.f)));
+  hit = vandq_u32(hit, vcleq_f32(texture_u, inverse_depth));
+  vst1q_f32(line_det, vminq_f32(vmulq_f32(texture_u, depth), vdupq_n_f32(1.f)));
+  vst1q_f32(ray_det, vmulq_n_f32(depth, DRAW_DISTANCE_INVERSE));
+  vst1q_u32(lanes, hit);
+  return mask & ((lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8));
+#else
+  const __m128 x = _mm_loadu_ps(packet->camera_x);
+  const __m128 inverse_depth = _mm_add_ps(_mm_set1_ps(geo->inverse_depth[i]), _mm_mul_ps(_mm_set1_ps(geo->inverse_depth_step[i]), x));
+  const __m128 texture_u = _mm_add_ps(_mm_set1_ps(geo->texture_u[i]), _mm_mul_ps(_mm_set1_ps(geo->texture_u_step[i]), x));
+  const __m128 depth = _mm_div_ps(_mm_set1_ps(1.f), inverse_depth);
+  __m128 hit = _mm_cmpge_ps(inverse_depth, _mm_set1_ps(DRAW_DISTANCE_INVERSE));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(texture_u, _mm_setzero_ps()));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(texture_u, inverse_depth));
+  _mm_storeu_ps(line_det, _mm_min_ps(_mm_mul_ps(texture_u, depth), _mm_set1_ps(1.f)));
+  _mm_storeu_ps(ray_det, _mm_mul_ps(depth, _mm_set1_ps(DRAW_DISTANCE_INVERSE)));
+  return mask & (uint8_t)_mm_movemask_ps(hit);
+#endif
+}
+
+#endif
+
+/*
+ * Packet version of find_sector_intersections for primary rays. Adjacent columns
+ * mostly visit the same sectors in the same order, so the rays enabled in 'mask'
+ * walk the sector graph together and the packet only splits where some of the
+ * rays continue into a back sector and others don't. Each lane still keeps its
+ * own context and column, so the result is identical to tracing them one by one.
+ */
+static void
+find_sector_intersections_packet(
+  const renderer *this,
+  const sector *sect,
+  const ray_packet *packet,
+  ray_context *contexts,
+  column_info *columns,
+  uint8_t mask
+) {
+  register size_t i;
+  register int r;
+  float planar_distance, line_det[RAY_PACKET_SIZE], ray_det[RAY_PACKET_SIZE];
+  int side;
+  uint8_t hits, next_mask;
+  linedef *line;
+  sector *back_sector;
+  ray_context *context;
+  ray_intersection *intersection;
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+  const sector_geometry *geo = visible_geometry(this, sect);
+  const float first_column = columns[0].index;
+  uint8_t in_range;
+#else
+  const sector_geometry *geo = &sect->geometry;
+#endif
+
+  for (r = 0; r < RAY_PACKET_SIZE; ++r) {
+    if ((mask & M_BIT(r)) && !enter_sector(&contexts[r], sect)) {
+      mask &= ~M_BIT(r);
+    }
+  }
+
+  for (i = 0; i < geo->count && mask; ++i) {
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+    /* Visible geometry only has linedefs facing the camera */
+    if (geo->column_max[i] < first_column || geo->column_min[i] > first_column + (RAY_PACKET_SIZE - 1)) {
+      continue;
+    }
+#else
+    /* All rays in the packet share the perspective origin */
+    if (math_cross(
+          VEC2F(geo->direction_x[i], geo->direction_y[i]),
+          VEC2F(packet->start.x - geo->v0_x[i], packet->start.y - geo->v0_y[i])
+        ) * geo->facing[i] > 0.f) {
+      continue;
+    }
+#endif
+
+    for (r = 0; r < RAY_PACKET_SIZE; ++r) {
+      if ((mask & M_BIT(r)) && columns[r].intersections.count >= MAX_LINE_HITS_PER_COLUMN) {
+        mask &= ~M_BIT(r);
+      }
+    }
+
+#ifdef RAYCASTER_PRERENDER_VISCHECK
+    for (r = 0, in_range = 0; r < RAY_PACKET_SIZE; ++r) {
+      if (first_column + r >= geo->column_min[i] && first_column + r <= geo->column_max[i]) {
+        in_range |= M_BIT(r);
+      }
+    }
+
+    if (!(hits = ray_packet_project_linedef(packet, geo, i, mask & in_range, line_det, ray_det))) {
+      continue;
+    }
+#else
+    if (!(hits = ray_packet_intersect_linedef(packet, geo, i, mask, line_det, ray_det))) {
+      continue;
+    }
+#endif
+
+    line = geo->linedefs[i];
+    side = geo->facing[i] > 0.f ? 0 : 1;
+    back_sector = line->side[!side].sector;
+    next_mask = 0;
+
+    for (r = 0; r < RAY_PACKET_SIZE; ++r) {
+      if (!(hits & M_BIT(r))) {
+        continue;
+      }
+
+      planar_distance = ray_det[r] * RENDERER_DRAW_DISTANCE;
+
+      if (planar_distance > RENDERER_DRAW_DISTANCE) {
+        mask &= ~M_BIT(r);
+        continue;
+      }
+
+      context = &contexts[r];
+      intersection = add_intersection(
+        this, sect, &packet->rays[r], &columns[r], line, side,
+        VEC2F(
+          geo->v0_x[i] + (line_det[r] * geo->direction_x[i]),
+          geo->v0_y[i] + (line_det[r] * geo->direction_y[i])
+        ),
+        planar_distance, line_det[r], ray_det[r]
+      );
+
+      if (back_sector) {
+        if (!context->full_wall || planar_distance < context->full_wall->planar_distance) {
+          insert_sorted(intersection, &context->head);
+          next_mask |= M_BIT(r);
+        }
+      } else if (!context->full_wall || planar_distance < context->full_wall->planar_distance) {
+        context->full_wall = intersection;
+      }
+    }
+
+    if (next_mask) {
+      find_sector_intersections_packet(this, back_sector, packet, contexts, columns, next_mask);
+    }
+  }
+}
+
+#endif
+
 /*
  * Convert given ray to mirror-space by reflecting the direction vectors as
  * well as the view position. Then we start tracing a new ray until we find
@@ -556,8 +1958,9 @@ draw_full_wall(const renderer *this, const ray_intersection *intersection, colum
   const struct linedef_side *fside = &intersection->line->side[intersection->side];
   const float sy = ceilf(M_MAX(intersection->cz_local, column->top_limit));
   const float ey = M_CLAMP(intersection->fz_local, column->top_limit, column->bottom_limit);
+  const float start_y = sy - this->frame_info.half_h - intersection->vz_scaled;
 
-  draw_wall_segment(this, intersection, column, sy, ey, sy - this->frame_info.half_h - intersection->vz_scaled, fside->texture[LINE_TEXTURE_MIDDLE]);
+  draw_wall_segment(this, intersection, column, sy, ey, start_y, start_y, fside->texture[LINE_TEXTURE_MIDDLE], false);
   
   if (intersection->front_sector->ceiling.texture != TEXTURE_NONE) {
     draw_ceiling_segment(this, intersection, column, column->top_limit, M_MIN(sy, column->bottom_limit));
@@ -576,6 +1979,7 @@ draw_mirror(const renderer *this, const ray_intersection *intersection, column_i
   const struct linedef_side *fside = &intersection->line->side[intersection->side];
   const float sy = ceilf(M_MAX(intersection->cz_local, column->top_limit));
   const float ey = M_CLAMP(intersection->fz_local, column->top_limit, column->bottom_limit);
+  const float start_y = sy - this->frame_info.half_h - intersection->vz_scaled;
 
   if (intersection->front_sector->ceiling.texture != TEXTURE_NONE) {
     draw_ceiling_segment(this, intersection, column, column->top_limit, M_MIN(sy, column->bottom_limit));
@@ -593,7 +1997,7 @@ draw_mirror(const renderer *this, const ray_intersection *intersection, column_i
 
   /* Draw transparent middle texture from back to front, with overdraw for now. */
   if (fside->texture[LINE_TEXTURE_MIDDLE] != TEXTURE_NONE) {
-    draw_wall_segment(this, intersection, column, sy, ey, sy - this->frame_info.half_h - intersection->vz_scaled, fside->texture[LINE_TEXTURE_MIDDLE]);
+    draw_wall_segment(this, intersection, column, sy, ey, start_y, start_y, fside->texture[LINE_TEXTURE_MIDDLE], true);
   }
 }
 
@@ -612,59 +2016,313 @@ draw_segmented_wall(const renderer *this, const ray_intersection *intersection,
   const float be_y = math_clamp(intersection->fz_local, column->top_limit, column->bottom_limit);
   const float bs_y = math_clamp(intersection->fz_local - bottom_h, column->top_limit, column->bottom_limit);
 
-  const bool back_sector_has_sky = intersection->back_sector->ceiling.texture == TEXTURE_NONE;
+  const bool back_sector_has_sky = intersection->back_sector->ceiling.texture == TEXTURE_NONE;
+
+  float n_top = column->top_limit;
+  float n_bottom = column->bottom_limit;
+
+  if (!back_sector_has_sky) {
+    if (top_h > 0) {
+      const float start_y = ts_y - this->frame_info.half_h - intersection->vz_scaled;
+      const float tex_sy = fside->flags & LINEDEF_PIN_BOTTOM_TEXTURE ? start_y - top_h : start_y;
+      draw_wall_segment(this, intersection, column, ts_y, te_y, tex_sy, start_y, fside->texture[LINE_TEXTURE_TOP], false);
+      n_top = te_y;
+    } else {
+      n_top = ts_y;
+    }
+  }
+
+  if (bottom_h > 0) {
+    const float start_y = bs_y - this->frame_info.half_h - intersection->vz_scaled;
+    const float tex_sy = fside->flags & LINEDEF_PIN_BOTTOM_TEXTURE ? start_y + bottom_h : start_y;
+    draw_wall_segment(this, intersection, column, bs_y, be_y, tex_sy, start_y, fside->texture[LINE_TEXTURE_BOTTOM], false);
+    n_bottom = bs_y;
+  } else {
+    n_bottom = be_y;
+  }
+
+  if (intersection->front_sector->ceiling.texture != TEXTURE_NONE) {
+    draw_ceiling_segment(this, intersection, column, column->top_limit, ts_y);
+    if (back_sector_has_sky) {
+      n_top = ts_y;
+    }
+  } else {
+    draw_sky_segment(this, intersection, column, column->top_limit, M_MAX(ts_y, column->top_limit));
+  }
+    
+  draw_floor_segment(this, intersection, column, be_y, column->bottom_limit);
+
+  column->top_limit = n_top;
+  column->bottom_limit = n_bottom;
+
+  if ((int)column->top_limit == (int)column->bottom_limit || intersection->back_sector->floor.height == intersection->back_sector->ceiling.height) {
+    /* Closed back sector (possibly under an open sky), nothing is visible in between */
+    fill_column_segment(this, column, (int32_t)column->top_limit, (int32_t)column->bottom_limit);
+    column->finished = true;
+    return;
+  }
+
+  /* Render next ray intersection */
+  draw_column_intersection(this, intersection->next, column);
+
+  /* Draw transparent middle texture from back to front, with overdraw for now. */
+  if (fside->texture[LINE_TEXTURE_MIDDLE] != TEXTURE_NONE) {
+    const float start_y = n_top - this->frame_info.half_h - intersection->vz_scaled;
+    draw_wall_segment(this, intersection, column, n_top, n_bottom, start_y, start_y, fside->texture[LINE_TEXTURE_MIDDLE], true);
+  }
+}
+
+#if defined(RAYCASTER_SHADOW_PACKETS) && RAYCASTER_SHADOW_STEP > 1
+  #error "RAYCASTER_SHADOW_PACKETS can't be combined with RAYCASTER_SHADOW_STEP > 1"
+#endif
+
+#if defined(RAYCASTER_DYNAMIC_SHADOWS) && RAYCASTER_SHADOW_STEP > 1
+  #define SHADOW_SPANS
+#endif
+
+#if defined(RAYCASTER_DYNAMIC_SHADOWS) && defined(RAYCASTER_SHADOW_PACKETS)
+  #define SHADOW_PACKETS
+#endif
+
+#define SHADOW_SPAN_LIGHTS 8
+
+/*
+ * Shadow ray results along a wall or plane span. Rays are cast at the ends of blocks
+ * of RAYCASTER_SHADOW_STEP pixels and only for the pixels in between when the light
+ * is visible from one end but not the other. The end of a block is reused as the
+ * start of the next one. 'pixel' and the block are maintained by the span loop.
+ *
+ * With shadow packets, blocks are MAP_CACHE_PACKET_SIZE pixels whose rays are all
+ * traced together and 'blocked' keeps which of them were blocked.
+ */
+typedef struct {
+  const light *light;
+  uint32_t end;
+  bool visible, end_visible;
+#ifdef SHADOW_PACKETS
+  uint8_t blocked;
+#endif
+} shadow_sample;
+
+typedef struct {
+  uint32_t pixel, block_end;
+  vec3f block_end_position;
+#ifdef SHADOW_PACKETS
+  uint32_t block_start;
+  uint8_t block_size;
+  vec3f positions[MAP_CACHE_PACKET_SIZE];
+#endif
+  uint8_t count;
+  shadow_sample samples[SHADOW_SPAN_LIGHTS];
+} shadow_span;
+
+#ifdef SHADOW_SPANS
+/* Move the span to 'pixel', true when a new block starts and block_end_position needs to be set */
+M_INLINED bool
+shadow_span_step(shadow_span *this, uint32_t pixel, uint32_t last)
+{
+  this->pixel = pixel;
+
+  if (pixel < this->block_end) {
+    return false;
+  }
+
+  this->block_end = M_MIN(pixel + RAYCASTER_SHADOW_STEP, last);
+  return true;
+}
+#elif defined(SHADOW_PACKETS)
+/* Move the span to 'pixel', true when a new block starts and its positions need to be set */
+M_INLINED bool
+shadow_span_step(shadow_span *this, uint32_t pixel, uint32_t last)
+{
+  this->pixel = pixel;
+
+  if (pixel - this->block_start < this->block_size) {
+    return false;
+  }
+
+  this->block_start = pixel;
+  this->block_end = M_MIN(pixel + MAP_CACHE_PACKET_SIZE - 1, last);
+  this->block_size = (uint8_t)(this->block_end - pixel + 1);
+  return true;
+}
+#endif
+
+/* Whether something blocks the light from 'pos', from the light's shadow map when it can tell */
+M_INLINED bool
+shadow_ray_blocked(const light *lt, vec3f pos, vec3f light_pos)
+{
+#ifdef RAYCASTER_SHADOW_MAPS
+  const uint8_t visibility = light_shadow_map_test(lt, pos, light_pos);
+
+  if (visibility != SHADOW_MAP_UNKNOWN) {
+    return visibility == SHADOW_MAP_HIDDEN;
+  }
+#endif
+
+  return map_cache_intersect_3d(&lt->entity.level->cache, pos, light_pos);
+}
+
+#ifdef SHADOW_PACKETS
+/* shadow_ray_blocked for 'count' positions at once, returns a bitmask of the blocked ones */
+M_INLINED uint8_t
+shadow_rays_blocked(const light *lt, const vec3f *positions, uint8_t count, vec3f light_pos)
+{
+  register uint8_t i;
+  vec3f ends[MAP_CACHE_PACKET_SIZE];
+#ifdef RAYCASTER_SHADOW_MAPS
+  vec3f starts[MAP_CACHE_PACKET_SIZE];
+  uint8_t lanes[MAP_CACHE_PACKET_SIZE], unknown = 0, blocked = 0, traced, visibility;
+#endif
+
+  for (i = 0; i < count; ++i) {
+    ends[i] = light_pos;
+  }
+
+#ifdef RAYCASTER_SHADOW_MAPS
+  for (i = 0; i < count; ++i) {
+    visibility = light_shadow_map_test(lt, positions[i], light_pos);
+
+    if (visibility == SHADOW_MAP_UNKNOWN) {
+      lanes[unknown] = i;
+      starts[unknown++] = positions[i];
+    } else if (visibility == SHADOW_MAP_HIDDEN) {
+      blocked |= 1 << i;
+    }
+  }
+
+  if (unknown) {
+    traced = map_cache_intersect_3d_n(&lt->entity.level->cache, starts, ends, unknown);
+
+    for (i = 0; i < unknown; ++i) {
+      blocked |= ((traced >> i) & 1) << lanes[i];
+    }
+  }
+
+  return blocked;
+#else
+  return map_cache_intersect_3d_n(&lt->entity.level->cache, positions, ends, count);
+#endif
+}
+#endif
+
+/* Whether something blocks the light from 'pos', from the surface's shadow cache when it has one */
+M_INLINED bool
+light_blocked(shadow_cache *cache, const light *lt, vec3f pos, vec3f light_pos)
+{
+#ifdef SHADOW_CACHES
+  uint8_t *texel, slot;
+  bool blocked;
+
+  /*
+   * Caches and their slots only change between frames. Columns sharing a texel may
+   * both cast its ray and store their result, either one is right for the texel.
+   */
+  if (cache && (texel = shadow_cache_texel(cache, pos)) && (slot = shadow_cache_find_slot(cache, lt)) < MAX_LIGHTS_PER_SURFACE) {
+    if (texel[slot] == SHADOW_CACHE_UNKNOWN) {
+      blocked = shadow_ray_blocked(lt, pos, light_pos);
+      texel[slot] = blocked ? SHADOW_CACHE_HIDDEN : SHADOW_CACHE_VISIBLE;
+      return blocked;
+    }
+
+    return texel[slot] == SHADOW_CACHE_HIDDEN;
+  }
+#else
+  M_UNUSED(cache);
+#endif
+
+  return shadow_ray_blocked(lt, pos, light_pos);
+}
 
-  float n_top = column->top_limit;
-  float n_bottom = column->bottom_limit;
+/* Samples of the light along the span, NULL when it hasn't been sampled yet */
+M_INLINED shadow_sample*
+shadow_span_sample(shadow_span *span, const light *lt)
+{
+  register uint8_t i;
 
-  if (!back_sector_has_sky) {
-    if (top_h > 0) {
-      const float tex_sy = fside->flags & LINEDEF_PIN_BOTTOM_TEXTURE
-        ? ts_y - top_h - this->frame_info.half_h - intersection->vz_scaled
-        : ts_y - this->frame_info.half_h - intersection->vz_scaled;
-      draw_wall_segment(this, intersection, column, ts_y, te_y, tex_sy, fside->texture[LINE_TEXTURE_TOP]);
-      n_top = te_y;
-    } else {
-      n_top = ts_y;
+  for (i = 0; i < span->count; ++i) {
+    if (span->samples[i].light == lt) {
+      return &span->samples[i];
     }
   }
 
-  if (bottom_h > 0) {
-    const float tex_sy = fside->flags & LINEDEF_PIN_BOTTOM_TEXTURE
-      ? bs_y + bottom_h - this->frame_info.half_h - intersection->vz_scaled
-      : bs_y - this->frame_info.half_h - intersection->vz_scaled;
-    draw_wall_segment(this, intersection, column, bs_y, be_y, tex_sy, fside->texture[LINE_TEXTURE_BOTTOM]);
-    n_bottom = bs_y;
-  } else {
-    n_bottom = be_y;
+  return NULL;
+}
+
+/* Sample slot for a light not sampled yet along the span */
+M_INLINED shadow_sample*
+shadow_span_claim_sample(shadow_span *span)
+{
+  register uint8_t i;
+  shadow_sample *sample;
+
+  if (span->count < SHADOW_SPAN_LIGHTS) {
+    return &span->samples[span->count++];
   }
 
-  if (intersection->front_sector->ceiling.texture != TEXTURE_NONE) {
-    draw_ceiling_segment(this, intersection, column, column->top_limit, ts_y);
-    if (back_sector_has_sky) {
-      n_top = ts_y;
-    }
-  } else {
-    draw_sky_segment(this, intersection, column, column->top_limit, M_MAX(ts_y, column->top_limit));
+  /* Replace the light sampled longest ago */
+  for (sample = &span->samples[0], i = 1; i < SHADOW_SPAN_LIGHTS; ++i) {
+    sample = span->samples[i].end < sample->end ? &span->samples[i] : sample;
   }
-    
-  draw_floor_segment(this, intersection, column, be_y, column->bottom_limit);
 
-  column->top_limit = n_top;
-  column->bottom_limit = n_bottom;
+  return sample;
+}
 
-  if ((int)column->top_limit == (int)column->bottom_limit || intersection->back_sector->floor.height == intersection->back_sector->ceiling.height) {
-    column->finished = true;
-    return;
+/* Whether the light is visible from 'pos', from the span samples when there are any */
+M_INLINED bool
+light_visible(shadow_span *span, shadow_cache *cache, const light *lt, vec3f pos, vec3f light_pos)
+{
+  shadow_sample *sample;
+#ifndef SHADOW_PACKETS
+  bool visible, end_visible;
+#endif
+
+  if (!span) {
+    return !light_blocked(cache, lt, pos, light_pos);
   }
 
-  /* Render next ray intersection */
-  draw_column_intersection(this, intersection->next, column);
+#ifdef SHADOW_PACKETS
+  /* Cached surfaces look their texels up per pixel instead */
+  if (cache) {
+    return !light_blocked(cache, lt, pos, light_pos);
+  }
+#endif
 
-  /* Draw transparent middle texture from back to front, with overdraw for now. */
-  if (fside->texture[LINE_TEXTURE_MIDDLE] != TEXTURE_NONE) {
-    draw_wall_segment(this, intersection, column, n_top, n_bottom, n_top - this->frame_info.half_h - intersection->vz_scaled, fside->texture[LINE_TEXTURE_MIDDLE]);
+  sample = shadow_span_sample(span, lt);
+
+#ifdef SHADOW_PACKETS
+  if (!sample || sample->end != span->block_end) {
+    sample = sample ? sample : shadow_span_claim_sample(span);
+    *sample = (shadow_sample) {
+      .light = lt,
+      .end = span->block_end,
+      .blocked = shadow_rays_blocked(lt, span->positions, span->block_size, light_pos)
+    };
+  }
+
+  return !((sample->blocked >> (span->pixel - span->block_start)) & 1);
+#else
+  if (sample && sample->end == span->block_end) {
+    if (span->pixel == sample->end) {
+      return sample->end_visible;
+    }
+    return sample->visible == sample->end_visible
+      ? sample->visible
+      : !light_blocked(cache, lt, pos, light_pos);
   }
+
+  visible = sample && sample->end == span->pixel
+    ? sample->end_visible
+    : !light_blocked(cache, lt, pos, light_pos);
+  end_visible = span->block_end == span->pixel
+    ? visible
+    : !light_blocked(cache, lt, span->block_end_position, light_pos);
+
+  sample = sample ? sample : shadow_span_claim_sample(span);
+  *sample = (shadow_sample) { .light = lt, .end = span->block_end, .visible = visible, .end_visible = end_visible };
+
+  return visible;
+#endif
 }
 
 /*
@@ -677,12 +2335,19 @@ draw_segmented_wall(const renderer *this, const ray_intersection *intersection,
  * 
  * When it's not:
  *   3. Basic brightness and dimming
+ *
+ * All of them start from the brightness of the surface, which is the sector
+ * brightness or what the lightmap of the surface baked there.
  */
 
-#define VERTICAL_FADE_DIST 2.5f
+#ifdef RAYCASTER_LIGHTMAPS
+#define SURFACE_BRIGHTNESS(LIGHTMAP, SECTOR, POS) ((LIGHTMAP) ? lightmap_sample((LIGHTMAP), (POS)) : (SECTOR)->brightness)
+#else
+#define SURFACE_BRIGHTNESS(LIGHTMAP, SECTOR, POS) ((SECTOR)->brightness)
+#endif
 
 M_INLINED float
-calculate_horizontal_surface_light(const sector *sect, vec3f pos, bool is_floor, size_t num_lights, light **lights,
+calculate_horizontal_surface_light(const sector *sect, float brightness, vec3f pos, bool is_floor, size_t num_lights, light **lights, shadow_span *shadows, shadow_cache *cache,
 #if RAYCASTER_LIGHT_STEPS > 0
   uint8_t steps
 #else
@@ -692,7 +2357,7 @@ calculate_horizontal_surface_light(const sector *sect, vec3f pos, bool is_floor,
   size_t i;
   vec3f world_pos;
   light *lt;
-  float dz, v = sect->brightness, dsq;
+  float dz, v = brightness, dsq;
 
   for (i = 0; i < num_lights; ++i) {
     lt = lights[i];
@@ -709,7 +2374,7 @@ calculate_horizontal_surface_light(const sector *sect, vec3f pos, bool is_floor,
     }
 
 #ifdef RAYCASTER_DYNAMIC_SHADOWS
-    v = !map_cache_intersect_3d(&lt->entity.level->cache, pos, world_pos)
+    v = light_visible(shadows, cache, lt, pos, world_pos)
       ? math_max(v, lt->strength * math_min(1.f, dz / VERTICAL_FADE_DIST) * (1.f - (dsq * lt->radius_sq_inverse)))
       : v;
 #else
@@ -717,144 +2382,575 @@ calculate_horizontal_surface_light(const sector *sect, vec3f pos, bool is_floor,
 #endif
   }
 
-  return math_max(
-    0.f,
+  return math_max(
+    0.f,
+#if RAYCASTER_LIGHT_STEPS > 0
+    ((uint8_t)(v * LIGHT_STEP_VALUE_CHANGE_INVERSE) * LIGHT_STEP_VALUE_CHANGE) - (steps * LIGHT_STEP_VALUE_CHANGE)
+#else
+    v - light_falloff
+#endif
+  );
+}
+
+
+M_INLINED float
+calculate_vertical_surface_light(float brightness, vec3f pos, size_t num_lights, light **lights, shadow_span *shadows, shadow_cache *cache,
+#if RAYCASTER_LIGHT_STEPS > 0
+  uint8_t steps
+#else
+  float light_falloff
+#endif
+) {
+  size_t i;
+  light *lt;
+  vec3f world_pos;
+  float v = brightness, dsq;
+
+  for (i = 0; i < num_lights; ++i) {
+    lt = lights[i];
+    world_pos = entity_world_position(&lt->entity);
+
+    if ((dsq = math_vec3_distance_squared(pos, world_pos)) > lt->radius_sq) {
+      continue;
+    }
+
+#ifdef RAYCASTER_DYNAMIC_SHADOWS
+    v = light_visible(shadows, cache, lt, pos, world_pos)
+      ? math_max(v, lt->strength * (1.f - (dsq * lt->radius_sq_inverse)))
+      : v;
+#else
+    v = math_max(v, lt->strength * (1.f - (dsq * lt->radius_sq_inverse)));
+#endif
+  }
+
+  return math_max(
+    0.f,
+#if RAYCASTER_LIGHT_STEPS > 0
+    ((uint8_t)(v * LIGHT_STEP_VALUE_CHANGE_INVERSE) * LIGHT_STEP_VALUE_CHANGE) - (steps * LIGHT_STEP_VALUE_CHANGE)
+#else
+    v - light_falloff
+#endif
+  );
+}
+
+M_INLINED float
+calculate_basic_brightness(const float base,
+#if RAYCASTER_LIGHT_STEPS > 0
+  uint8_t steps
+#else
+  float light_falloff
+#endif
+) {
+  return math_max(
+    0.f,
+#if RAYCASTER_LIGHT_STEPS > 0
+    ((uint8_t)(base * LIGHT_STEP_VALUE_CHANGE_INVERSE) * LIGHT_STEP_VALUE_CHANGE) - (steps * LIGHT_STEP_VALUE_CHANGE)
+#else
+    base - light_falloff
+#endif
+  );
+}
+
+#ifdef RAYCASTER_FIXED_POINT
+/*
+ * Sector brightness and distance dimming in 8.8 fixed point. The difference of the
+ * two is calculate_basic_brightness, so planes only subtract per pixel.
+ */
+M_INLINED int32_t
+brightness_to_fixed(float base)
+{
+#if RAYCASTER_LIGHT_STEPS > 0
+  return ((int32_t)(uint8_t)(base * LIGHT_STEP_VALUE_CHANGE_INVERSE) << LIGHT_FIXED_SHIFT) / RAYCASTER_LIGHT_STEPS;
+#else
+  return light_to_fixed(base);
+#endif
+}
+
+M_INLINED int32_t
+dimming_to_fixed(float light)
+{
+#if RAYCASTER_LIGHT_STEPS > 0
+  return ((int32_t)(uint8_t)math_min(light, 255.f) << LIGHT_FIXED_SHIFT) / RAYCASTER_LIGHT_STEPS;
+#else
+  return light_to_fixed(light);
+#endif
+}
+#endif
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+/* Smooth light falloff is stored in 1/64 steps */
+#define GBUFFER_DIMMING_SCALE 64.f
+
+M_INLINED uint8_t
+gbuffer_dimming(float light)
+{
+#if RAYCASTER_LIGHT_STEPS > 0
+  return (uint8_t)light;
+#else
+  return (uint8_t)math_min(light * GBUFFER_DIMMING_SCALE + 0.5f, 255.f);
+#endif
+}
+
+M_INLINED uint16_t
+gbuffer_surface(const renderer *this, uint8_t type, const sector *sect)
+{
+  return (uint16_t)((type << RENDERER_SURFACE_SHIFT) | (sect - this->frame_info.level->sectors));
+}
+
+/* Level lights of a surface light list as a bit mask */
+M_INLINED uint64_t
+gbuffer_light_mask(const renderer *this, size_t count, light **lights)
+{
+  register size_t i;
+  uint64_t mask = 0;
+
+  for (i = 0; i < count; ++i) {
+    mask |= UINT64_C(1) << (lights[i] - this->frame_info.level->lights);
+  }
+
+  return mask;
+}
+
+M_INLINED void
+write_gbuffer(renderer_gbuffer_texel *g, vec3f pos, uint16_t surface, const uint8_t rgb[3], uint64_t lights, uint8_t dimming, float brightness)
+{
+  g->x = pos.x;
+  g->y = pos.y;
+  g->z = (int16_t)math_clamp(roundf(pos.z), INT16_MIN, INT16_MAX);
+  g->surface = surface;
+  g->albedo[0] = rgb[0];
+  g->albedo[1] = rgb[1];
+  g->albedo[2] = rgb[2];
+  g->lights = lights;
+  g->dimming = dimming;
+#ifdef RAYCASTER_LIGHTMAPS
+  g->brightness = brightness;
+#else
+  M_UNUSED(brightness);
+#endif
+}
+#endif
+
+static void
+draw_wall_segment(
+  const renderer *this,
+  const ray_intersection *intersection,
+  column_info *column,
+  uint32_t from,
+  uint32_t to,
+  float texture_start_y,
+  float height_start_y,
+  texture_ref texture,
+  bool overlay
+) {
+  if (from >= to) {
+    return;
+  }
+
+  /* Overlays (middle textures over what's behind) keep it where they're transparent */
+  if (texture == TEXTURE_NONE) {
+    if (!overlay) {
+      fill_column_segment(this, column, from, to);
+    }
+    return;
+  }
+
+  register uint32_t y;
+  const float texture_step  = intersection->texture_step;
+  const float texture_x     = intersection->texture_x;
+  pixel_type *p             = column->buffer_start + (from*column->buffer_stride);
+  uint8_t rgb[3];
+  uint8_t mask;
+  uint8_t lights_count      = intersection->segment->lights_count;
+  struct light **lights     = intersection->segment->lights;
+  register float texture_y  = (texture_start_y * texture_step);
+  /* Pinned textures start off the wall's top or bottom, lighting needs the real height below the view */
+  register float height_y   = (height_start_y * texture_step);
+  void (*const sampler)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*) =
+    texture_sampler_column ? texture_sampler_column : texture_sampler_scaled;
+#ifdef RAYCASTER_LIGHTMAPS
+  const lightmap *baked     = intersection->line->side[intersection->side].lightmap;
+#endif
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  const uint16_t surface = gbuffer_surface(this, RENDERER_SURFACE_WALL, intersection->front_sector);
+  const uint64_t lights_mask = gbuffer_light_mask(this, lights_count, lights);
+#if RAYCASTER_LIGHT_STEPS > 0
+  const uint8_t dimming = intersection->distance_steps;
+#else
+  const uint8_t dimming = gbuffer_dimming(intersection->light_falloff);
+#endif
+#else
+  const float base_light = !lights_count ? calculate_basic_brightness(
+      intersection->front_sector->brightness,
+#if RAYCASTER_LIGHT_STEPS > 0
+      intersection->distance_steps
+#else
+      intersection->light_falloff
+#endif
+  ) : 0.f;
+#if defined(SHADOW_SPANS) || defined(SHADOW_PACKETS)
+  shadow_span span = { 0 }, *shadows = &span;
+#else
+  shadow_span *shadows = NULL;
+#endif
+#ifdef SHADOW_PACKETS
+  register uint8_t k;
+#endif
+#ifdef SHADOW_CACHES
+  shadow_cache *cache = lights_count ? intersection->segment->shadows : NULL;
+#else
+  shadow_cache *cache = NULL;
+#endif
+#endif
+
+#ifdef RAYCASTER_FIXED_POINT
+  /* Samplers only need whole texels, so the column is floored once and rows are stepped in 16.16 */
+  const float texture_column = floorf(texture_x);
+  const fixed32 texture_step_fixed = fixed_from_float(texture_step);
+  fixed32 texture_y_fixed = fixed_from_float(texture_y);
+  fixed32 height_y_fixed = fixed_from_float(height_y);
+#ifndef RAYCASTER_DEFERRED_LIGHTING
+  int32_t light_fixed = light_to_fixed(base_light);
+#endif
+
+  for (y = from; y < to; ++y, p += column->buffer_stride, texture_y_fixed += texture_step_fixed, height_y_fixed += texture_step_fixed) {
+    sampler(texture, texture_column, (float)fixed_floor(texture_y_fixed), 1 + intersection->distance_steps, &rgb[0], &mask);
+
+    if (!mask) { /* Transparent - skip */
+      if (!overlay) { *p = PIXEL_BLACK(this); CLEAR_GBUFFER(column, y) }
+      continue;
+    }
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+    write_gbuffer(GBUFFER_AT(column, y), VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed)), surface, rgb, lights_mask, dimming,
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed))));
+#else
+    if (lights_count) {
+#ifdef SHADOW_SPANS
+      if (shadow_span_step(&span, y, to - 1)) {
+        span.block_end_position = VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed + (fixed32)(span.block_end - y) * texture_step_fixed));
+      }
+#elif defined(SHADOW_PACKETS)
+      if (shadow_span_step(&span, y, to - 1)) {
+        for (k = 0; k < span.block_size; ++k) {
+          span.positions[k] = VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed + (fixed32)k * texture_step_fixed));
+        }
+      }
+#endif
+      light_fixed = light_to_fixed(calculate_vertical_surface_light(
+        SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed))),
+        VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed)),
+        lights_count,
+        lights,
+        shadows,
+        cache,
+#if RAYCASTER_LIGHT_STEPS > 0
+        intersection->distance_steps
+#else
+        intersection->light_falloff
+#endif
+      ));
+    }
+#ifdef RAYCASTER_LIGHTMAPS
+    else if (baked) {
+      light_fixed = light_to_fixed(calculate_basic_brightness(
+        lightmap_sample(baked, VEC3F(intersection->point.x, intersection->point.y, -fixed_to_float(height_y_fixed))),
+#if RAYCASTER_LIGHT_STEPS > 0
+        intersection->distance_steps
+#else
+        intersection->light_falloff
+#endif
+      ));
+    }
+#endif
+
+    *p = shade_pixel_fixed(this, rgb, light_fixed);
+#endif
+
+    INSERT_RENDER_BREAKPOINT
+  }
+#else
+#ifndef RAYCASTER_DEFERRED_LIGHTING
+  register pixel_light light = light_to_pixel_light(base_light);
+#endif
+
+  for (y = from; y < to; ++y, p += column->buffer_stride, texture_y += texture_step, height_y += texture_step) {
+    sampler(texture, texture_x, texture_y, 1 + intersection->distance_steps, &rgb[0], &mask);
+ 
+    if (!mask) { /* Transparent - skip */
+      if (!overlay) { *p = PIXEL_BLACK(this); CLEAR_GBUFFER(column, y) }
+      continue;
+    }
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+    write_gbuffer(GBUFFER_AT(column, y), VEC3F(intersection->point.x, intersection->point.y, -height_y), surface, rgb, lights_mask, dimming,
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(intersection->point.x, intersection->point.y, -height_y)));
+#else
+#ifdef SHADOW_SPANS
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      span.block_end_position = VEC3F(intersection->point.x, intersection->point.y, -(height_y + ((span.block_end - y) * texture_step)));
+    }
+#elif defined(SHADOW_PACKETS)
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      for (k = 0; k < span.block_size; ++k) {
+        span.positions[k] = VEC3F(intersection->point.x, intersection->point.y, -(height_y + (k * texture_step)));
+      }
+    }
+#endif
+    if (lights_count) {
+      light = light_to_pixel_light(calculate_vertical_surface_light(
+        SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(intersection->point.x, intersection->point.y, -height_y)),
+        VEC3F(intersection->point.x, intersection->point.y, -height_y),
+        lights_count,
+        lights,
+        shadows,
+        cache,
+#if RAYCASTER_LIGHT_STEPS > 0
+        intersection->distance_steps
+#else
+        intersection->light_falloff
+#endif
+      ));
+    }
+#ifdef RAYCASTER_LIGHTMAPS
+    else if (baked) {
+      light = light_to_pixel_light(calculate_basic_brightness(
+        lightmap_sample(baked, VEC3F(intersection->point.x, intersection->point.y, -height_y)),
+#if RAYCASTER_LIGHT_STEPS > 0
+        intersection->distance_steps
+#else
+        intersection->light_falloff
+#endif
+      ));
+    }
+#endif
+
+    *p = shade_pixel(this, rgb, light);
+#endif
+
+    INSERT_RENDER_BREAKPOINT
+  }
+#endif
+}
+
+/* Floor or ceiling values for the row 'yz' rows away from the horizon */
+M_INLINED renderer_plane_row
+plane_row(const renderer *this, float distance_from_view, uint32_t yz)
+{
+  const float distance = distance_from_view * this->depth_values[yz];
 #if RAYCASTER_LIGHT_STEPS > 0
-    ((uint8_t)(v * LIGHT_STEP_VALUE_CHANGE_INVERSE) * LIGHT_STEP_VALUE_CHANGE) - (steps * LIGHT_STEP_VALUE_CHANGE)
+  const float light = distance * LIGHT_STEP_DISTANCE_INVERSE;
 #else
-    v - light_falloff
+  const float light = distance * DIMMING_DISTANCE_INVERSE;
 #endif
-  );
+
+  return (renderer_plane_row) {
+    .distance = distance,
+    .light = light,
+    .mip_level = 1 + (uint8_t)(distance * LIGHT_STEP_DISTANCE_INVERSE),
+#ifdef RAYCASTER_FIXED_POINT
+    /* Anything past the draw distance is clamped to the wall hit point anyway */
+    .distance_fixed = fixed_from_float(math_min(distance, RENDERER_DRAW_DISTANCE)),
+    .dimming_fixed = dimming_to_fixed(light)
+#endif
+  };
 }
 
+/*
+ * Row table for floors and ceilings at 'height' in the current frame. The first
+ * column that needs it builds it, every other column only reads it. Returns NULL
+ * when the frame has more distinct plane heights than the cache can hold.
+ */
+static const renderer_plane_row*
+find_plane_rows(const renderer *this, int32_t height)
+{
+  renderer_plane_cache *cache = this->plane_cache;
+  renderer_plane_row *rows = NULL;
+  register size_t i, count;
+  float distance_from_view;
 
-M_INLINED float
-calculate_vertical_surface_light(const sector *sect, vec3f pos, size_t num_lights, light **lights,
-#if RAYCASTER_LIGHT_STEPS > 0
-  uint8_t steps
-#else
-  float light_falloff
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp flush
 #endif
-) {
-  size_t i;
-  light *lt;
-  vec3f world_pos;
-  float v = sect->brightness, dsq;
-
-  for (i = 0; i < num_lights; ++i) {
-    lt = lights[i];
-    world_pos = entity_world_position(&lt->entity);
+  count = cache->count;
 
-    if ((dsq = math_vec3_distance_squared(pos, world_pos)) > lt->radius_sq) {
-      continue;
+  for (i = 0; i < count; ++i) {
+    if (cache->height[i] == height) {
+      return cache->rows[i];
     }
+  }
 
-#ifdef RAYCASTER_DYNAMIC_SHADOWS
-    v = !map_cache_intersect_3d(&lt->entity.level->cache, pos, world_pos)
-      ? math_max(v, lt->strength * (1.f - (dsq * lt->radius_sq_inverse)))
-      : v;
-#else
-    v = math_max(v, lt->strength * (1.f - (dsq * lt->radius_sq_inverse)));
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp critical (renderer_plane_cache)
 #endif
-  }
+  {
+    for (i = 0; i < cache->count && cache->height[i] != height; ++i);
+
+    if (i < cache->count) {
+      rows = cache->rows[i];
+    } else if (i < RENDERER_MAX_PLANE_TABLES) {
+      if (!cache->rows[i]) {
+        cache->rows[i] = malloc(this->buffer_size.y * sizeof(renderer_plane_row));
+      }
 
-  return math_max(
-    0.f,
-#if RAYCASTER_LIGHT_STEPS > 0
-    ((uint8_t)(v * LIGHT_STEP_VALUE_CHANGE_INVERSE) * LIGHT_STEP_VALUE_CHANGE) - (steps * LIGHT_STEP_VALUE_CHANGE)
-#else
-    v - light_falloff
+      rows = cache->rows[i];
+      distance_from_view = fabsf(this->frame_info.view_z - height) * this->frame_info.unit_size;
+
+      for (count = 0; count < (size_t)this->buffer_size.y; ++count) {
+        rows[count] = plane_row(this, distance_from_view, count);
+      }
+
+      cache->height[i] = height;
+
+      /* Publish only after the table is complete */
+#ifdef RAYCASTER_PARALLEL_RENDERING
+      #pragma omp flush
 #endif
-  );
+      cache->count = i + 1;
+    }
+  }
+
+  return rows;
 }
 
-M_INLINED float
-calculate_basic_brightness(const float base,
-#if RAYCASTER_LIGHT_STEPS > 0
-  uint8_t steps
-#else
-  float light_falloff
-#endif
-) {
-  return math_max(
-    0.f,
-#if RAYCASTER_LIGHT_STEPS > 0
-    ((uint8_t)(base * LIGHT_STEP_VALUE_CHANGE_INVERSE) * LIGHT_STEP_VALUE_CHANGE) - (steps * LIGHT_STEP_VALUE_CHANGE)
-#else
-    base - light_falloff
-#endif
+#if defined(SHADOW_SPANS) || defined(SHADOW_PACKETS)
+/* World position of the floor or ceiling pixel 'yz' rows away from the horizon */
+M_INLINED vec3f
+plane_point(const renderer *this, const ray_intersection *intersection, const renderer_plane_row *rows, float distance_from_view, uint32_t yz, int32_t height)
+{
+  const float distance = rows ? rows[yz].distance : plane_row(this, distance_from_view, yz).distance;
+  const float weight = math_min(1.f, distance * intersection->point_distance_inverse);
+
+  return VEC3F(
+    intersection->ray.origin.x + (weight * (intersection->point.x - intersection->ray.origin.x)),
+    intersection->ray.origin.y + (weight * (intersection->point.y - intersection->ray.origin.y)),
+    height
   );
 }
+#endif
 
+#ifdef RAYCASTER_FIXED_POINT
+/*
+ * Fixed point floor or ceiling span. World positions are kept relative to the texel
+ * the ray starts from, so they stay within 16.16 range up to RENDERER_DRAW_DISTANCE.
+ * 'yz' is the row table index of the first pixel and moves by 'yz_step' per pixel.
+ */
 static void
-draw_wall_segment(
+draw_plane_segment_fixed(
   const renderer *this,
   const ray_intersection *intersection,
   column_info *column,
   uint32_t from,
   uint32_t to,
-  float texture_start_y,
-  texture_ref texture
+  float distance_from_view,
+  int32_t yz,
+  int32_t yz_step,
+  bool is_floor
 ) {
-  if (from >= to || texture == TEXTURE_NONE) {
-    return;
-  }
-
   register uint32_t y;
-  const float texture_step  = intersection->planar_distance / this->frame_info.unit_size;
-  const float texture_x     = intersection->determinant * intersection->line->length;
-  const uint16_t segment    = (uint16_t)floorf((intersection->line->segments - 1) * intersection->determinant);
-  const struct linedef_side *side = &intersection->line->side[intersection->side];
-  uint32_t *p               = column->buffer_start + (from*column->buffer_stride);
+  register fixed32 weight, dx, dy;
+  const int32_t height = is_floor ? intersection->front_sector->floor.height : intersection->front_sector->ceiling.height;
+  const texture_ref texture = is_floor ? intersection->front_sector->floor.texture : intersection->front_sector->ceiling.texture;
+  const renderer_plane_row *rows = find_plane_rows(this, height);
+  const vec2f ray_delta = vec2f_sub(intersection->point, intersection->ray.origin);
+  const int32_t origin_x = (int32_t)floorf(intersection->ray.origin.x), origin_y = (int32_t)floorf(intersection->ray.origin.y);
+  const fixed32 start_x = fixed_from_float(intersection->ray.origin.x - origin_x), start_y = fixed_from_float(intersection->ray.origin.y - origin_y);
+  const fixed32 delta_x = fixed_from_float(ray_delta.x), delta_y = fixed_from_float(ray_delta.y);
+  /* 1 / hit distance in 0.32, so the weight is a single multiply; walls closer than half a unit are clamped */
+  const uint64_t distance_scale = (uint64_t)(math_min(intersection->point_distance_inverse, 1.99f) * 4294967296.f);
+  renderer_plane_row row;
+  pixel_type *p = column->buffer_start + (from*column->buffer_stride);
   uint8_t rgb[3];
-  uint8_t mask;
-  uint8_t lights_count      = side->segments[segment].lights_count;
-  struct light **lights     = side->segments[segment].lights;
-  register float light      = !lights_count ? calculate_basic_brightness(
-      intersection->front_sector->brightness,
-#if RAYCASTER_LIGHT_STEPS > 0
-      intersection->distance_steps
+  map_cache_cell *cell = NULL;
+  vec2f cell_min, cell_max, position;
+  fixed32 cell_min_x = 0, cell_min_y = 0, cell_max_x = 0, cell_max_y = 0;
+  void (*const sampler)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*) =
+    texture_sampler_plane ? texture_sampler_plane : texture_sampler_scaled;
+#ifdef RAYCASTER_LIGHTMAPS
+  const lightmap *baked = intersection->front_sector->lightmaps[is_floor ? 0 : 1];
+#endif
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  const uint16_t surface = gbuffer_surface(this, is_floor ? RENDERER_SURFACE_FLOOR : RENDERER_SURFACE_CEILING, intersection->front_sector);
+  uint64_t lights_mask = 0;
 #else
-      intersection->light_falloff
+  const int32_t brightness = brightness_to_fixed(intersection->front_sector->brightness);
+  uint8_t lights_count = 0;
+  int32_t light;
+#if defined(SHADOW_SPANS) || defined(SHADOW_PACKETS)
+  shadow_span span = { 0 }, *shadows = &span;
+#else
+  shadow_span *shadows = NULL;
 #endif
-  ) : 0.f, texture_y        = (texture_start_y * texture_step);
-
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
-  int32_t temp[4];
+#ifdef SHADOW_PACKETS
+  register uint8_t k;
+#endif
+  shadow_cache *cache = NULL;
 #endif
 
-  for (y = from; y < to; ++y, p += column->buffer_stride, texture_y += texture_step) {
-    texture_sampler_scaled(texture, texture_x, texture_y, 1 + intersection->distance_steps, &rgb[0], &mask);
- 
-    if (!mask) { continue; } /* Transparent - skip */
-
-    light = lights_count ?
-      calculate_vertical_surface_light(
-        intersection->front_sector,
-        VEC3F(intersection->point.x, intersection->point.y, -texture_y),
-        lights_count,
-        lights,
-#if RAYCASTER_LIGHT_STEPS > 0
-        intersection->distance_steps
+  for (y = from; y < to; ++y, yz += yz_step, p += column->buffer_stride) {
+    row = rows ? rows[yz] : plane_row(this, distance_from_view, yz);
+    weight = (fixed32)M_MIN(FIXED_ONE, ((uint64_t)row.distance_fixed * distance_scale) >> 32);
+    dx = start_x + fixed_mul(weight, delta_x);
+    dy = start_y + fixed_mul(weight, delta_y);
+
+    /* Consecutive pixels mostly land in the same cell, only look it up when leaving it */
+    if (dx < cell_min_x || dx >= cell_max_x || dy < cell_min_y || dy >= cell_max_y) {
+      position = VEC2F(origin_x + fixed_to_float(dx), origin_y + fixed_to_float(dy));
+      cell = map_cache_cell_at_bounded(&this->frame_info.level->cache, position, &cell_min, &cell_max);
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+      lights_mask = cell ? gbuffer_light_mask(this, cell->lights_count, cell->lights) : 0;
 #else
-        intersection->light_falloff
+      lights_count = cell ? cell->lights_count : 0;
+#ifdef SHADOW_CACHES
+      cache = lights_count ? cell->shadows[is_floor ? 0 : 1] : NULL;
 #endif
-      ) : light;
+#endif
+      cell_min_x = fixed_from_float(cell_min.x - origin_x);
+      cell_min_y = fixed_from_float(cell_min.y - origin_y);
+      cell_max_x = fixed_from_float(cell_max.x - origin_x);
+      cell_max_y = fixed_from_float(cell_max.y - origin_y);
+    }
 
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
-#ifdef __ARM_NEON
-    vst1q_s32(temp, vcvtq_s32_f32(vminq_f32(vmulq_f32((float32x4_t){ rgb[0], rgb[1], rgb[2] }, vdupq_n_f32(light)), vdupq_n_f32(255.0f))));
+    sampler(texture, (float)(origin_x + fixed_floor(dx)), (float)(origin_y + fixed_floor(dy)), row.mip_level, &rgb[0], NULL);
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+    write_gbuffer(GBUFFER_AT(column, y), VEC3F(origin_x + fixed_to_float(dx), origin_y + fixed_to_float(dy), height), surface, rgb, lights_mask, gbuffer_dimming(row.light),
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(origin_x + fixed_to_float(dx), origin_y + fixed_to_float(dy), height)));
 #else
-    _mm_storeu_si128((__m128i*)temp, _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_set_ps(0, rgb[2], rgb[1], rgb[0]), _mm_set1_ps(light)), _mm_set1_ps(255.0f))));
+#ifdef SHADOW_SPANS
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      span.block_end_position = plane_point(this, intersection, rows, distance_from_view, yz + ((int32_t)(span.block_end - y) * yz_step), height);
+    }
+#elif defined(SHADOW_PACKETS)
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      for (k = 0; k < span.block_size; ++k) {
+        span.positions[k] = plane_point(this, intersection, rows, distance_from_view, yz + ((int32_t)k * yz_step), height);
+      }
+    }
 #endif
-    *p = 0xFF000000 | (temp[0] << 16) | (temp[1] << 8) | temp[2];
+    light = lights_count ? light_to_fixed(calculate_horizontal_surface_light(
+      intersection->front_sector,
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(origin_x + fixed_to_float(dx), origin_y + fixed_to_float(dy), height)),
+      VEC3F(origin_x + fixed_to_float(dx), origin_y + fixed_to_float(dy), height),
+      is_floor,
+      lights_count,
+      cell->lights,
+      shadows,
+      cache,
+      row.light
+#ifdef RAYCASTER_LIGHTMAPS
+    )) : M_MAX(0, (baked ? brightness_to_fixed(lightmap_sample(baked, VEC3F(origin_x + fixed_to_float(dx), origin_y + fixed_to_float(dy), height))) : brightness) - row.dimming_fixed);
 #else
-    *p = 0xFF000000|((uint8_t)math_min((rgb[0]*light),255)<<16)|((uint8_t)math_min((rgb[1]*light),255)<<8)|(uint8_t)math_min((rgb[2]*light),255);
+    )) : M_MAX(0, brightness - row.dimming_fixed);
+#endif
+
+    *p = shade_pixel_fixed(this, rgb, light);
 #endif
 
     INSERT_RENDER_BREAKPOINT
   }
 }
+#endif
 
 static void
 draw_floor_segment(
@@ -864,66 +2960,112 @@ draw_floor_segment(
   uint32_t from,
   uint32_t to
 ) {
-  if (from >= to ||
-      this->frame_info.view_z < intersection->front_sector->floor.height ||
+  if (from >= to) {
+    return;
+  }
+
+  if (this->frame_info.view_z < intersection->front_sector->floor.height ||
       intersection->front_sector->floor.texture == TEXTURE_NONE) {
+    fill_column_segment(this, column, from, to);
     return;
   }
 
+#ifdef RAYCASTER_FIXED_POINT
+  draw_plane_segment_fixed(this, intersection, column, from, to,
+    (this->frame_info.view_z - intersection->front_sector->floor.height) * this->frame_info.unit_size,
+    from - this->frame_info.half_h, 1, true);
+#else
+
   register uint32_t y, yz;
-  register float light=-1, distance, weight, wx, wy;
+  register float weight, wx, wy;
   const float distance_from_view = (this->frame_info.view_z - intersection->front_sector->floor.height) * this->frame_info.unit_size;
-  uint32_t *p = column->buffer_start + (from*column->buffer_stride);
-  uint8_t rgb[3], lights_count;
-  map_cache_cell *cell;
-
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
-  int32_t temp[4];
+  const renderer_plane_row *rows = find_plane_rows(this, intersection->front_sector->floor.height);
+  const vec2f ray_delta = vec2f_sub(intersection->point, intersection->ray.origin);
+  renderer_plane_row row;
+  pixel_type *p = column->buffer_start + (from*column->buffer_stride);
+  uint8_t rgb[3];
+  map_cache_cell *cell = NULL;
+  vec2f cell_min = VEC2F(0, 0), cell_max = VEC2F(0, 0);
+  void (*const sampler)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*) =
+    texture_sampler_plane ? texture_sampler_plane : texture_sampler_scaled;
+#ifdef RAYCASTER_LIGHTMAPS
+  const lightmap *baked = intersection->front_sector->lightmaps[0];
+#endif
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  const uint16_t surface = gbuffer_surface(this, RENDERER_SURFACE_FLOOR, intersection->front_sector);
+  uint64_t lights_mask = 0;
+#else
+  register pixel_light light;
+  uint8_t lights_count = 0;
+#if defined(SHADOW_SPANS) || defined(SHADOW_PACKETS)
+  shadow_span span = { 0 }, *shadows = &span;
+#else
+  shadow_span *shadows = NULL;
+#endif
+#ifdef SHADOW_PACKETS
+  register uint8_t k;
+#endif
+  shadow_cache *cache = NULL;
 #endif
 
   for (y = from, yz = from - this->frame_info.half_h; y < to; ++y, p += column->buffer_stride) {
-    distance = (distance_from_view * this->depth_values[yz++]);
-    weight = math_min(1.f, distance * intersection->point_distance_inverse);
-    wx = (weight * intersection->point.x) + ((1-weight) * intersection->ray.origin.x);
-    wy = (weight * intersection->point.y) + ((1-weight) * intersection->ray.origin.y);
-    cell = map_cache_cell_at(&this->frame_info.level->cache, VEC2F(wx, wy));
-    lights_count = cell ? cell->lights_count : 0;
+    row = rows ? rows[yz] : plane_row(this, distance_from_view, yz);
+    yz++;
+    weight = math_min(1.f, row.distance * intersection->point_distance_inverse);
+    wx = intersection->ray.origin.x + (weight * ray_delta.x);
+    wy = intersection->ray.origin.y + (weight * ray_delta.y);
+
+    /* Consecutive pixels mostly land in the same cell, only look it up when leaving it */
+    if (wx < cell_min.x || wx >= cell_max.x || wy < cell_min.y || wy >= cell_max.y) {
+      cell = map_cache_cell_at_bounded(&this->frame_info.level->cache, VEC2F(wx, wy), &cell_min, &cell_max);
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+      lights_mask = cell ? gbuffer_light_mask(this, cell->lights_count, cell->lights) : 0;
+#else
+      lights_count = cell ? cell->lights_count : 0;
+#ifdef SHADOW_CACHES
+      cache = lights_count ? cell->shadows[0] : NULL;
+#endif
+#endif
+    }
 
-    texture_sampler_scaled(intersection->front_sector->floor.texture, wx, wy, 1 + (uint8_t)(distance * LIGHT_STEP_DISTANCE_INVERSE), &rgb[0], NULL);
+    sampler(intersection->front_sector->floor.texture, wx, wy, row.mip_level, &rgb[0], NULL);
 
-    light = lights_count ? calculate_horizontal_surface_light(
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+    write_gbuffer(GBUFFER_AT(column, y), VEC3F(wx, wy, intersection->front_sector->floor.height), surface, rgb, lights_mask, gbuffer_dimming(row.light),
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(wx, wy, intersection->front_sector->floor.height)));
+#else
+#ifdef SHADOW_SPANS
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      span.block_end_position = plane_point(this, intersection, rows, distance_from_view, span.block_end - this->frame_info.half_h, intersection->front_sector->floor.height);
+    }
+#elif defined(SHADOW_PACKETS)
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      for (k = 0; k < span.block_size; ++k) {
+        span.positions[k] = plane_point(this, intersection, rows, distance_from_view, y + k - this->frame_info.half_h, intersection->front_sector->floor.height);
+      }
+    }
+#endif
+    light = light_to_pixel_light(lights_count ? calculate_horizontal_surface_light(
       intersection->front_sector,
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(wx, wy, intersection->front_sector->floor.height)),
       VEC3F(wx, wy, intersection->front_sector->floor.height),
       true,
       lights_count,
       cell ? cell->lights : NULL,
-#if RAYCASTER_LIGHT_STEPS > 0
-      distance * LIGHT_STEP_DISTANCE_INVERSE
-#else
-      distance * DIMMING_DISTANCE_INVERSE
-#endif
+      shadows,
+      cache,
+      row.light
     ) : calculate_basic_brightness(
-      intersection->front_sector->brightness,
-#if RAYCASTER_LIGHT_STEPS > 0
-      distance * LIGHT_STEP_DISTANCE_INVERSE
-#else
-      distance * DIMMING_DISTANCE_INVERSE
-#endif
-    );
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(wx, wy, intersection->front_sector->floor.height)),
+      row.light
+    ));
 
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
-#ifdef __ARM_NEON
-    vst1q_s32(temp, vcvtq_s32_f32(vminq_f32(vmulq_f32((float32x4_t){ rgb[0], rgb[1], rgb[2] }, vdupq_n_f32(light)), vdupq_n_f32(255.0f))));
-#else
-    _mm_storeu_si128((__m128i*)temp, _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_set_ps(0, rgb[2], rgb[1], rgb[0]), _mm_set1_ps(light)), _mm_set1_ps(255.0f))));
-#endif
-    *p = 0xFF000000 | (temp[0] << 16) | (temp[1] << 8) | temp[2];
-#else
-    *p = 0xFF000000|((uint8_t)math_min((rgb[0]*light),255)<<16)|((uint8_t)math_min((rgb[1]*light),255)<<8)|(uint8_t)math_min((rgb[2]*light),255);
+    *p = shade_pixel(this, rgb, light);
 #endif
 
     INSERT_RENDER_BREAKPOINT
   } 
+#endif
 }
 
 static void
@@ -934,86 +3076,348 @@ draw_ceiling_segment(
   uint32_t from,
   uint32_t to
 ) {
+  if (from >= to) {
+    return;
+  }
+
   /* Camera above the ceiling */
-  if (from >= to || this->frame_info.view_z > intersection->front_sector->ceiling.height) {
+  if (this->frame_info.view_z > intersection->front_sector->ceiling.height) {
+    fill_column_segment(this, column, from, to);
     return;
   }
 
+#ifdef RAYCASTER_FIXED_POINT
+  draw_plane_segment_fixed(this, intersection, column, from, to,
+    (intersection->front_sector->ceiling.height - this->frame_info.view_z) * this->frame_info.unit_size,
+    this->frame_info.half_h - from - 1, -1, false);
+#else
+
   register uint32_t y, yz;
-  register float light=-1, distance, weight, wx, wy;
+  register float weight, wx, wy;
   const float distance_from_view = (intersection->front_sector->ceiling.height - this->frame_info.view_z) * this->frame_info.unit_size;
-  uint32_t *p = column->buffer_start + (from*column->buffer_stride);
-  uint8_t rgb[3], lights_count;
-  map_cache_cell *cell;
-
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
-  int32_t temp[4];
+  const renderer_plane_row *rows = find_plane_rows(this, intersection->front_sector->ceiling.height);
+  const vec2f ray_delta = vec2f_sub(intersection->point, intersection->ray.origin);
+  renderer_plane_row row;
+  pixel_type *p = column->buffer_start + (from*column->buffer_stride);
+  uint8_t rgb[3];
+  map_cache_cell *cell = NULL;
+  vec2f cell_min = VEC2F(0, 0), cell_max = VEC2F(0, 0);
+  void (*const sampler)(texture_ref, float, float, uint8_t, uint8_t*, uint8_t*) =
+    texture_sampler_plane ? texture_sampler_plane : texture_sampler_scaled;
+#ifdef RAYCASTER_LIGHTMAPS
+  const lightmap *baked = intersection->front_sector->lightmaps[1];
+#endif
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+  const uint16_t surface = gbuffer_surface(this, RENDERER_SURFACE_CEILING, intersection->front_sector);
+  uint64_t lights_mask = 0;
+#else
+  register pixel_light light;
+  uint8_t lights_count = 0;
+#if defined(SHADOW_SPANS) || defined(SHADOW_PACKETS)
+  shadow_span span = { 0 }, *shadows = &span;
+#else
+  shadow_span *shadows = NULL;
+#endif
+#ifdef SHADOW_PACKETS
+  register uint8_t k;
+#endif
+  shadow_cache *cache = NULL;
 #endif
 
   for (y = from, yz = this->frame_info.half_h - from - 1; y < to; ++y, p += column->buffer_stride) {
-    distance = (distance_from_view * this->depth_values[yz--]);
-    weight = math_min(1.f, distance * intersection->point_distance_inverse);
-    wx = (weight * intersection->point.x) + ((1-weight) * intersection->ray.origin.x);
-    wy = (weight * intersection->point.y) + ((1-weight) * intersection->ray.origin.y);
-    cell = map_cache_cell_at(&this->frame_info.level->cache, VEC2F(wx, wy));
-    lights_count = cell ? cell->lights_count : 0;
+    row = rows ? rows[yz] : plane_row(this, distance_from_view, yz);
+    yz--;
+    weight = math_min(1.f, row.distance * intersection->point_distance_inverse);
+    wx = intersection->ray.origin.x + (weight * ray_delta.x);
+    wy = intersection->ray.origin.y + (weight * ray_delta.y);
+
+    /* Consecutive pixels mostly land in the same cell, only look it up when leaving it */
+    if (wx < cell_min.x || wx >= cell_max.x || wy < cell_min.y || wy >= cell_max.y) {
+      cell = map_cache_cell_at_bounded(&this->frame_info.level->cache, VEC2F(wx, wy), &cell_min, &cell_max);
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+      lights_mask = cell ? gbuffer_light_mask(this, cell->lights_count, cell->lights) : 0;
+#else
+      lights_count = cell ? cell->lights_count : 0;
+#ifdef SHADOW_CACHES
+      cache = lights_count ? cell->shadows[1] : NULL;
+#endif
+#endif
+    }
 
-    texture_sampler_scaled(intersection->front_sector->ceiling.texture, wx, wy, 1 + (uint8_t)(distance * LIGHT_STEP_DISTANCE_INVERSE), &rgb[0], NULL);
+    sampler(intersection->front_sector->ceiling.texture, wx, wy, row.mip_level, &rgb[0], NULL);
 
-    light = lights_count ? calculate_horizontal_surface_light(
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+    write_gbuffer(GBUFFER_AT(column, y), VEC3F(wx, wy, intersection->front_sector->ceiling.height), surface, rgb, lights_mask, gbuffer_dimming(row.light),
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(wx, wy, intersection->front_sector->ceiling.height)));
+#else
+#ifdef SHADOW_SPANS
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      span.block_end_position = plane_point(this, intersection, rows, distance_from_view, this->frame_info.half_h - span.block_end - 1, intersection->front_sector->ceiling.height);
+    }
+#elif defined(SHADOW_PACKETS)
+    if (lights_count && shadow_span_step(&span, y, to - 1)) {
+      for (k = 0; k < span.block_size; ++k) {
+        span.positions[k] = plane_point(this, intersection, rows, distance_from_view, this->frame_info.half_h - (y + k) - 1, intersection->front_sector->ceiling.height);
+      }
+    }
+#endif
+    light = light_to_pixel_light(lights_count ? calculate_horizontal_surface_light(
       intersection->front_sector,
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(wx, wy, intersection->front_sector->ceiling.height)),
       VEC3F(wx, wy, intersection->front_sector->ceiling.height),
       false,
       lights_count,
       cell ? cell->lights : NULL,
-#if RAYCASTER_LIGHT_STEPS > 0
-      distance * LIGHT_STEP_DISTANCE_INVERSE
-#else
-      distance * DIMMING_DISTANCE_INVERSE
-#endif
+      shadows,
+      cache,
+      row.light
     ) : calculate_basic_brightness(
-      intersection->front_sector->brightness,
-#if RAYCASTER_LIGHT_STEPS > 0
-      distance * LIGHT_STEP_DISTANCE_INVERSE
-#else
-      distance * DIMMING_DISTANCE_INVERSE
-#endif
-    );
+      SURFACE_BRIGHTNESS(baked, intersection->front_sector, VEC3F(wx, wy, intersection->front_sector->ceiling.height)),
+      row.light
+    ));
 
-#ifdef RAYCASTER_SIMD_PIXEL_LIGHTING
-#ifdef __ARM_NEON
-    vst1q_s32(temp, vcvtq_s32_f32(vminq_f32(vmulq_f32((float32x4_t){ rgb[0], rgb[1], rgb[2] }, vdupq_n_f32(light)), vdupq_n_f32(255.0f))));
-#else
-    _mm_storeu_si128((__m128i*)temp, _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_set_ps(0, rgb[2], rgb[1], rgb[0]), _mm_set1_ps(light)), _mm_set1_ps(255.0f))));
-#endif
-    *p = 0xFF000000 | (temp[0] << 16) | (temp[1] << 8) | temp[2];
-#else
-    *p = 0xFF000000|((uint8_t)math_min((rgb[0]*light),255)<<16)|((uint8_t)math_min((rgb[1]*light),255)<<8)|(uint8_t)math_min((rgb[2]*light),255);
+    *p = shade_pixel(this, rgb, light);
 #endif
 
     INSERT_RENDER_BREAKPOINT
   }
+#endif
 }
 
 static void
 draw_sky_segment(const renderer *this, const ray_intersection *intersection, const column_info *column, uint32_t from, uint32_t to)
 {
-  if (from == to || this->frame_info.sky_texture == TEXTURE_NONE) {
+  if (from >= to) {
     return;
   }
 
-  register uint16_t y;
-  uint8_t rgb[3];
-  float angle = atan2f(intersection->ray.direction_normalized.x, intersection->ray.direction_normalized.y) * (180.0f / M_PI);
-  if (angle < 0.0f) {
-    angle += 360.0f;
+  if (this->frame_info.sky_texture == TEXTURE_NONE) {
+    fill_column_segment(this, column, from, to);
+    return;
   }
-  float sky_x = angle / 360, h = (float)this->buffer_size.y; 
-  uint32_t *p = column->buffer_start + (from * column->buffer_stride);
+
+  register uint16_t y;
+  const uint16_t *row = this->sky->row;
+  const pixel_type *sky = this->sky->panorama + (this->sky->panorama_height * (
+    /* Reflected rays don't follow the screen columns */
+    intersection->ray.primary
+      ? this->sky->column[column->index]
+      : sky_panorama_column(intersection->ray.direction_normalized)
+  ));
+  pixel_type *p = column->buffer_start + (from * column->buffer_stride);
 
   for (y = from; y < to; ++y, p += column->buffer_stride) {
-    texture_sampler_normalized(this->frame_info.sky_texture, sky_x, math_min(1.f, 0.5f+(y-this->frame_info.pitch_offset)/h), 1, &rgb[0], NULL);
-    *p = 0xFF000000 | (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+    *p = sky[row[y]];
+    CLEAR_GBUFFER(column, y)
     INSERT_RENDER_BREAKPOINT
   }
 }
+
+#ifdef RAYCASTER_DEFERRED_LIGHTING
+/* level_data holds up to 64 lights, which is also the width of the G-buffer light masks */
+#define DEFERRED_MAX_LIGHTS 64
+
+/* Lights as SoA arrays, padded with unreachable lights to a multiple of 4 */
+typedef struct {
+  size_t count;
+  uint64_t mask;
+  float x[DEFERRED_MAX_LIGHTS],
+        y[DEFERRED_MAX_LIGHTS],
+        z[DEFERRED_MAX_LIGHTS],
+        radius_sq[DEFERRED_MAX_LIGHTS],
+        radius_sq_inverse[DEFERRED_MAX_LIGHTS],
+        strength[DEFERRED_MAX_LIGHTS];
+  uint64_t bit[DEFERRED_MAX_LIGHTS];
+  const light *source[DEFERRED_MAX_LIGHTS];
+} deferred_lights;
+
+/*
+ * Light values of lights 'base' to 'base + 3' at a pixel, 0 where it's out of reach.
+ * 'facing' is 1 for floors, -1 for ceilings and 0 for walls, where 'vertical' is 1 to
+ * skip the falloff the horizontal surfaces get below (or above) the light.
+ */
+M_INLINED void
+deferred_light_values(const deferred_lights *lights, size_t base, vec3f pos, float facing, float vertical, float *out)
+{
+#if defined(RAYCASTER_SIMD_PIXEL_LIGHTING) && defined(__ARM_NEON)
+  const float32x4_t dx = vsubq_f32(vld1q_f32(&lights->x[base]), vdupq_n_f32(pos.x));
+  const float32x4_t dy = vsubq_f32(vld1q_f32(&lights->y[base]), vdupq_n_f32(pos.y));
+  const float32x4_t dz = vsubq_f32(vld1q_f32(&lights->z[base]), vdupq_n_f32(pos.z));
+  const float32x4_t dsq = vmlaq_f32(vmlaq_f32(vmulq_f32(dx, dx), dy, dy), dz, dz);
+  const float32x4_t fade = vminq_f32(vdupq_n_f32(1.f), vmaxq_f32(vmulq_n_f32(dz, facing / VERTICAL_FADE_DIST), vdupq_n_f32(vertical)));
+  const float32x4_t v = vmulq_f32(vmulq_f32(vld1q_f32(&lights->strength[base]), fade), vmlsq_f32(vdupq_n_f32(1.f), dsq, vld1q_f32(&lights->radius_sq_inverse[base])));
+  vst1q_f32(out, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(v), vcleq_f32(dsq, vld1q_f32(&lights->radius_sq[base])))));
+#elif defined(RAYCASTER_SIMD_PIXEL_LIGHTING)
+  const __m128 dx = _mm_sub_ps(_mm_loadu_ps(&lights->x[base]), _mm_set1_ps(pos.x));
+  const __m128 dy = _mm_sub_ps(_mm_loadu_ps(&lights->y[base]), _mm_set1_ps(pos.y));
+  const __m128 dz = _mm_sub_ps(_mm_loadu_ps(&lights->z[base]), _mm_set1_ps(pos.z));
+  const __m128 dsq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+  const __m128 fade = _mm_min_ps(_mm_set1_ps(1.f), _mm_max_ps(_mm_mul_ps(dz, _mm_set1_ps(facing / VERTICAL_FADE_DIST)), _mm_set1_ps(vertical)));
+  const __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(&lights->strength[base]), fade), _mm_sub_ps(_mm_set1_ps(1.f), _mm_mul_ps(dsq, _mm_loadu_ps(&lights->radius_sq_inverse[base]))));
+  _mm_storeu_ps(out, _mm_and_ps(v, _mm_cmple_ps(dsq, _mm_loadu_ps(&lights->radius_sq[base]))));
+#else
+  register size_t i;
+  float dx, dy, dz, dsq;
+
+  for (i = 0; i < 4; ++i) {
+    dx = lights->x[base + i] - pos.x;
+    dy = lights->y[base + i] - pos.y;
+    dz = lights->z[base + i] - pos.z;
+    dsq = (dx * dx) + (dy * dy) + (dz * dz);
+    out[i] = dsq <= lights->radius_sq[base + i]
+      ? lights->strength[base + i] * math_min(1.f, math_max(dz * (facing / VERTICAL_FADE_DIST), vertical)) * (1.f - (dsq * lights->radius_sq_inverse[base + i]))
+      : 0.f;
+  }
+#endif
+}
+
+M_INLINED void
+deferred_lights_add(deferred_lights *lights, const light *source, vec3f pos, float radius_sq, float radius_sq_inverse, float strength, uint64_t bit)
+{
+  lights->source[lights->count] = source;
+  lights->x[lights->count] = pos.x;
+  lights->y[lights->count] = pos.y;
+  lights->z[lights->count] = pos.z;
+  lights->radius_sq[lights->count] = radius_sq;
+  lights->radius_sq_inverse[lights->count] = radius_sq_inverse;
+  lights->strength[lights->count] = strength;
+  lights->bit[lights->count] = bit;
+  lights->mask |= bit;
+  lights->count++;
+}
+
+/*
+ * Light and shade one tile. The tile gets its own list of the frame lights that
+ * some pixel in it references and whose radius reaches the bounds of the tile.
+ */
+static void
+shade_deferred_tile(const renderer *this, const deferred_lights *frame_lights, int32_t x0, int32_t y0)
+{
+  register int32_t x, y;
+  register size_t i, j;
+  const int32_t x1 = M_MIN(x0 + RENDERER_LIGHT_TILE_SIZE, this->buffer_size.x);
+  const int32_t y1 = M_MIN(y0 + RENDERER_LIGHT_TILE_SIZE, this->buffer_size.y);
+#ifndef RAYCASTER_LIGHTMAPS
+  const level_data *level = this->frame_info.level;
+#endif
+  const renderer_gbuffer_texel *g;
+  deferred_lights lights = { 0 };
+  vec3f min = VEC3F(FLT_MAX, FLT_MAX, FLT_MAX), max = VEC3F(-FLT_MAX, -FLT_MAX, -FLT_MAX), pos;
+  uint64_t mask = 0;
+  uint8_t type;
+  float v, d, dsq, values[4];
+
+  for (y = y0; y < y1; ++y) {
+    for (x = x0, g = &this->gbuffer[y * this->buffer_size.x + x0]; x < x1; ++x, ++g) {
+      if (g->lights && (g->surface >> RENDERER_SURFACE_SHIFT) != RENDERER_SURFACE_NONE) {
+        mask |= g->lights;
+        min = VEC3F(math_min(min.x, g->x), math_min(min.y, g->y), math_min(min.z, g->z));
+        max = VEC3F(math_max(max.x, g->x), math_max(max.y, g->y), math_max(max.z, g->z));
+      }
+    }
+  }
+
+  for (i = 0; mask && i < frame_lights->count; ++i) {
+    if (!(mask & frame_lights->bit[i])) {
+      continue;
+    }
+
+    /* Distance from the light to the tile bounds */
+    d = frame_lights->x[i] - math_clamp(frame_lights->x[i], min.x, max.x);
+    dsq = d * d;
+    d = frame_lights->y[i] - math_clamp(frame_lights->y[i], min.y, max.y);
+    dsq += d * d;
+    d = frame_lights->z[i] - math_clamp(frame_lights->z[i], min.z, max.z);
+    dsq += d * d;
+
+    if (dsq <= frame_lights->radius_sq[i]) {
+      deferred_lights_add(&lights, frame_lights->source[i], VEC3F(frame_lights->x[i], frame_lights->y[i], frame_lights->z[i]), frame_lights->radius_sq[i], frame_lights->radius_sq_inverse[i], frame_lights->strength[i], frame_lights->bit[i]);
+    }
+  }
+
+  while (lights.count & 3) {
+    deferred_lights_add(&lights, NULL, VEC3F(0, 0, 0), -1.f, 0.f, 0.f, 0);
+  }
+
+  for (y = y0; y < y1; ++y) {
+    for (x = x0, g = &this->gbuffer[y * this->buffer_size.x + x0]; x < x1; ++x, ++g) {
+      if ((type = g->surface >> RENDERER_SURFACE_SHIFT) == RENDERER_SURFACE_NONE) {
+        continue;
+      }
+
+#ifdef RAYCASTER_LIGHTMAPS
+      v = g->brightness;
+#else
+      v = level->sectors[g->surface & RENDERER_SURFACE_SECTOR_MASK].brightness;
+#endif
+
+      if (g->lights & lights.mask) {
+        pos = VEC3F(g->x, g->y, g->z);
+
+        for (i = 0; i < lights.count; i += 4) {
+          deferred_light_values(
+            &lights,
+            i,
+            pos,
+            type == RENDERER_SURFACE_FLOOR ? 1.f : (type == RENDERER_SURFACE_CEILING ? -1.f : 0.f),
+            type == RENDERER_SURFACE_WALL ? 1.f : 0.f,
+            values
+          );
+
+          /* Shadow rays only for lights that would make the pixel brighter */
+          for (j = 0; j < 4; ++j) {
+            if (values[j] > v && (g->lights & lights.bit[i + j])
+#ifdef RAYCASTER_DYNAMIC_SHADOWS
+              && !shadow_ray_blocked(lights.source[i + j], pos, VEC3F(lights.x[i + j], lights.y[i + j], lights.z[i + j]))
+#endif
+            ) {
+              v = values[j];
+            }
+          }
+        }
+      }
+
+      this->frame_info.buffer[y * this->frame_info.buffer_stride + x] = shade_pixel(
+        this,
+        g->albedo,
+#if RAYCASTER_LIGHT_STEPS > 0
+        light_to_pixel_light(calculate_basic_brightness(v, g->dimming))
+#else
+        light_to_pixel_light(calculate_basic_brightness(v, g->dimming * (1.f / GBUFFER_DIMMING_SCALE)))
+#endif
+      );
+    }
+  }
+}
+
+/* Lighting pass over the G-buffer written by the geometry pass, tile by tile */
+static void
+shade_deferred(const renderer *this)
+{
+  register size_t i;
+  int32_t t;
+  const level_data *level = this->frame_info.level;
+  const int32_t tiles_x = (this->buffer_size.x + RENDERER_LIGHT_TILE_SIZE - 1) / RENDERER_LIGHT_TILE_SIZE;
+  const int32_t tiles_y = (this->buffer_size.y + RENDERER_LIGHT_TILE_SIZE - 1) / RENDERER_LIGHT_TILE_SIZE;
+  deferred_lights lights = { 0 };
+
+  for (i = 0; i < level->lights_count; ++i) {
+    deferred_lights_add(
+      &lights,
+      &level->lights[i],
+      entity_world_position(&level->lights[i].entity),
+      level->lights[i].radius_sq,
+      level->lights[i].radius_sq_inverse,
+      level->lights[i].strength,
+      UINT64_C(1) << i
+    );
+  }
+
+#ifdef RAYCASTER_PARALLEL_RENDERING
+  #pragma omp parallel for schedule(dynamic)
+#endif
+  for (t = 0; t < tiles_x * tiles_y; ++t) {
+    shade_deferred_tile(this, &lights, (t % tiles_x) * RENDERER_LIGHT_TILE_SIZE, (t / tiles_x) * RENDERER_LIGHT_TILE_SIZE);
+  }
+}
+#endif
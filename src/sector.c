@@ -33,6 +33,7 @@ sector_add_linedef(sector *sect, linedef *line)
     sect->linedefs = malloc(sizeof(linedef*));
   }
   sect->linedefs[sect->linedefs_count++] = line;
+  sector_update_geometry(sect);
   return line;
 }
 
@@ -49,6 +50,7 @@ sector_remove_linedef(sector *this, linedef *line)
       this->linedefs = realloc(this->linedefs, sizeof(linedef*) * this->linedefs_count);
       if (line->side[0].sector == this) { line->side[0].sector = NULL; }
       else if (line->side[1].sector == this) { line->side[1].sector = NULL; }
+      sector_update_geometry(this);
       return;
     }
   }
@@ -62,3 +64,49 @@ sector_update_floor_ceiling_limits(sector *this)
     linedef_update_floor_ceiling_limits(this->linedefs[li]);
   }
 }
+
+void
+sector_update_geometry(sector *this)
+{
+  register size_t i;
+  const size_t capacity = (this->linedefs_count + 3) & ~(size_t)3;
+  sector_geometry *geo = &this->geometry;
+  const linedef *line;
+  float *data;
+
+  if (capacity != geo->capacity) {
+    /* One block for all arrays; each array is a multiple of 16 bytes long */
+    data = realloc(geo->capacity ? geo->v0_x : NULL, 5 * capacity * sizeof(float));
+    geo->v0_x = data;
+    geo->v0_y = data + capacity;
+    geo->direction_x = data + capacity * 2;
+    geo->direction_y = data + capacity * 3;
+    geo->facing = data + capacity * 4;
+    geo->linedefs = realloc(geo->capacity ? geo->linedefs : NULL, capacity * sizeof(linedef*));
+
+
+    geo->capacity = capacity;
+  }
+
+  /* Own copy, the linedef list is reallocated when it changes */
+  geo->count = this->linedefs_count;
+  if (this->linedefs_count) {
+    memcpy(geo->linedefs, this->linedefs, this->linedefs_count * sizeof(linedef*));
+  }
+
+  for (i = 0; i < capacity; ++i) {
+    if (i < this->linedefs_count) {
+      line = this->linedefs[i];
+      geo->v0_x[i] = line->v0->point.x;
+      geo->v0_y[i] = line->v0->point.y;
+      geo->direction_x[i] = line->direction.x;
+      geo->direction_y[i] = line->direction.y;
+      geo->facing[i] = line->side[0].sector == this ? 1.f : -1.f;
+    } else {
+      /* Zero length padding lines never produce a hit */
+      geo->v0_x[i] = geo->v0_y[i] = 0.f;
+      geo->direction_x[i] = geo->direction_y[i] = 0.f;
+      geo->facing[i] = 1.f;
+    }
+  }
+}
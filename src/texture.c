@@ -0,0 +1,339 @@
+#include "texture.h"
+
+
+/* Texels are handled as 32-bit words holding the RGBA bytes in memory order */
+#define COLOR_CHANNEL(COLOR, C) (((const uint8_t*)&(COLOR))[C])
+
+/* FORWARD DECLARATIONS */
+
+typedef struct {
+  uint32_t color, count;
+  uint16_t box;
+} color_entry;
+
+typedef struct {
+  uint32_t start, end;
+} color_box;
+
+static uint32_t
+find_unique_colors(uint32_t*, uint32_t, color_entry*);
+
+static uint16_t
+median_cut(color_entry*, uint32_t, color_box*, uint8_t palette[256][4]);
+
+
+/* PUBLIC API */
+
+bool
+palettized_texture_create(palettized_texture *this, const uint8_t *rgba, uint32_t width, uint32_t height, size_t pitch)
+{
+  register uint32_t x, y, i;
+  const uint32_t texels = width * height;
+  uint32_t *colors = malloc(texels * sizeof(uint32_t));
+  color_entry *entries = malloc(texels * sizeof(color_entry));
+  color_box *boxes = malloc(256 * sizeof(color_box));
+  uint32_t unique, lo, hi, mid, color;
+  uint8_t index;
+
+  *this = (palettized_texture) { .width = width, .height = height };
+
+  if (!colors || !entries || !boxes) {
+    goto fail;
+  }
+
+  for (y = 0; y < height; ++y) {
+    memcpy(&colors[y * width], rgba + (y * pitch), width * sizeof(uint32_t));
+  }
+
+  /* Sorts 'colors', the texels are read from 'rgba' again below */
+  unique = find_unique_colors(colors, texels, entries);
+
+  if (unique <= 256) {
+    for (i = 0; i < unique; ++i) {
+      memcpy(this->palette[i], &entries[i].color, 4);
+      entries[i].box = i;
+    }
+    this->palette_size = unique;
+  } else {
+    this->palette_size = median_cut(entries, unique, boxes, this->palette);
+  }
+
+  this->bits = this->palette_size <= 16 ? 4 : 8;
+  this->indices = calloc((texels * this->bits + 7) / 8, 1);
+
+  if (!this->indices) {
+    goto fail;
+  }
+
+  /* Entries are sorted by color, so every texel finds its palette index with a binary search */
+  for (y = 0, i = 0; y < height; ++y) {
+    for (x = 0; x < width; ++x, ++i) {
+      memcpy(&color, rgba + (y * pitch) + (x * sizeof(uint32_t)), sizeof(uint32_t));
+      lo = 0;
+      hi = unique - 1;
+
+      while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (entries[mid].color < color) { lo = mid + 1; }
+        else { hi = mid; }
+      }
+
+      index = (uint8_t)entries[lo].box;
+
+      if (this->bits == 4) {
+        this->indices[i >> 1] |= index << ((i & 1) << 2);
+      } else {
+        this->indices[i] = index;
+      }
+    }
+  }
+
+  free(colors);
+  free(entries);
+  free(boxes);
+  return true;
+
+fail:
+  free(colors);
+  free(entries);
+  free(boxes);
+  palettized_texture_destroy(this);
+  return false;
+}
+
+bool
+palettized_texture_create_columns(palettized_texture *this)
+{
+  register uint32_t x, y, i;
+  uint8_t index;
+
+  if (this->columns) {
+    return true;
+  }
+
+  if (!(this->columns = calloc((this->width * this->height * this->bits + 7) / 8, 1))) {
+    return false;
+  }
+
+  for (x = 0, i = 0; x < this->width; ++x) {
+    for (y = 0; y < this->height; ++y, ++i) {
+      index = palettized_texture_index(this, x, y);
+
+      if (this->bits == 4) {
+        this->columns[i >> 1] |= index << ((i & 1) << 2);
+      } else {
+        this->columns[i] = index;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool
+palettized_texture_create_tiles(palettized_texture *this)
+{
+  register uint32_t x, y, i;
+  uint8_t index;
+
+  if (this->tiles) {
+    return true;
+  }
+
+  if (this->width % PALETTIZED_TEXTURE_TILE_SIZE || this->height % PALETTIZED_TEXTURE_TILE_SIZE) {
+    return false;
+  }
+
+  if (!(this->tiles = calloc((this->width * this->height * this->bits + 7) / 8, 1))) {
+    return false;
+  }
+
+  for (y = 0; y < this->height; ++y) {
+    for (x = 0; x < this->width; ++x) {
+      index = palettized_texture_index(this, x, y);
+      i = palettized_texture_tile_offset(this, x, y);
+
+      if (this->bits == 4) {
+        this->tiles[i >> 1] |= index << ((i & 1) << 2);
+      } else {
+        this->tiles[i] = index;
+      }
+    }
+  }
+
+  return true;
+}
+
+void
+palettized_texture_destroy(palettized_texture *this)
+{
+  free(this->indices);
+  free(this->columns);
+  free(this->tiles);
+  this->indices = NULL;
+  this->columns = NULL;
+  this->tiles = NULL;
+  this->palette_size = 0;
+}
+
+
+/* PRIVATE FUNCTIONS */
+
+static int
+compare_colors(const void *a, const void *b)
+{
+  const uint32_t ca = *(const uint32_t*)a, cb = *(const uint32_t*)b;
+  return (ca > cb) - (ca < cb);
+}
+
+#define COMPARE_CHANNEL(C) \
+  static int \
+  compare_channel_##C(const void *a, const void *b) \
+  { \
+    const uint8_t ca = COLOR_CHANNEL(((const color_entry*)a)->color, C); \
+    const uint8_t cb = COLOR_CHANNEL(((const color_entry*)b)->color, C); \
+    return (int)ca - (int)cb; \
+  }
+
+COMPARE_CHANNEL(0)
+COMPARE_CHANNEL(1)
+COMPARE_CHANNEL(2)
+COMPARE_CHANNEL(3)
+
+static int (*const compare_channel[4])(const void*, const void*) = {
+  compare_channel_0, compare_channel_1, compare_channel_2, compare_channel_3
+};
+
+static int
+compare_entries(const void *a, const void *b)
+{
+  return compare_colors(&((const color_entry*)a)->color, &((const color_entry*)b)->color);
+}
+
+/* Sorts the colors in place and writes each distinct color with its number of texels */
+static uint32_t
+find_unique_colors(uint32_t *colors, uint32_t count, color_entry *entries)
+{
+  register uint32_t i, unique = 0;
+
+  qsort(colors, count, sizeof(uint32_t), compare_colors);
+
+  for (i = 0; i < count; ++i) {
+    if (unique && entries[unique - 1].color == colors[i]) {
+      entries[unique - 1].count++;
+    } else {
+      entries[unique++] = (color_entry) { .color = colors[i], .count = 1 };
+    }
+  }
+
+  return unique;
+}
+
+/* Widest channel of a box and its range */
+static uint8_t
+widest_channel(const color_entry *entries, const color_box *box, int32_t *range)
+{
+  register uint32_t i, c;
+  uint8_t lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0 }, v, widest = 0;
+
+  for (i = box->start; i < box->end; ++i) {
+    for (c = 0; c < 4; ++c) {
+      v = COLOR_CHANNEL(entries[i].color, c);
+      lo[c] = M_MIN(lo[c], v);
+      hi[c] = M_MAX(hi[c], v);
+    }
+  }
+
+  *range = -1;
+
+  for (c = 0; c < 4; ++c) {
+    if ((int32_t)(hi[c] - lo[c]) > *range) {
+      *range = hi[c] - lo[c];
+      widest = c;
+    }
+  }
+
+  return widest;
+}
+
+/*
+ * Split the color list into 256 boxes along the widest channel at the texel-weighted
+ * median. Every entry is tagged with its box and the box averages become the palette.
+ * Leaves the entries sorted by color again.
+ */
+static uint16_t
+median_cut(color_entry *entries, uint32_t count, color_box *boxes, uint8_t palette[256][4])
+{
+  register uint32_t i, b, c;
+  uint16_t boxes_count = 1;
+  uint64_t total, half, sum[4], weight;
+  int32_t range, best_range;
+  uint8_t channel, best_channel = 0;
+  color_box *box;
+  uint32_t split;
+
+  boxes[0] = (color_box) { 0, count };
+
+  while (boxes_count < 256) {
+    box = NULL;
+    best_range = 0;
+
+    for (b = 0; b < boxes_count; ++b) {
+      if (boxes[b].end - boxes[b].start < 2) {
+        continue;
+      }
+
+      channel = widest_channel(entries, &boxes[b], &range);
+
+      if (range > best_range) {
+        best_range = range;
+        best_channel = channel;
+        box = &boxes[b];
+      }
+    }
+
+    if (!box) {
+      break;
+    }
+
+    qsort(&entries[box->start], box->end - box->start, sizeof(color_entry), compare_channel[best_channel]);
+
+    for (total = 0, i = box->start; i < box->end; ++i) {
+      total += entries[i].count;
+    }
+
+    half = total / 2;
+
+    for (weight = 0, split = box->start; split < box->end - 1; ++split) {
+      weight += entries[split].count;
+      if (weight >= half) {
+        break;
+      }
+    }
+
+    boxes[boxes_count++] = (color_box) { split + 1, box->end };
+    box->end = split + 1;
+  }
+
+  for (b = 0; b < boxes_count; ++b) {
+    memset(sum, 0, sizeof(sum));
+    weight = 0;
+
+    for (i = boxes[b].start; i < boxes[b].end; ++i) {
+      entries[i].box = b;
+      weight += entries[i].count;
+
+      for (c = 0; c < 4; ++c) {
+        sum[c] += COLOR_CHANNEL(entries[i].color, c) * (uint64_t)entries[i].count;
+      }
+    }
+
+    for (c = 0; c < 4; ++c) {
+      palette[b][c] = (uint8_t)((sum[c] + (weight >> 1)) / weight);
+    }
+  }
+
+  qsort(entries, count, sizeof(color_entry), compare_entries);
+
+  return boxes_count;
+}
@@ -8,6 +8,25 @@
 static level_data*
 create_level();
 
+static level_data*
+create_sparse_level();
+
+#ifdef RAYCASTER_SHADOW_MAPS
+static level_data*
+create_stepped_level();
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+static level_data*
+create_two_room_level();
+#endif
+
+static bool
+intersect_any_linedef(const level_data*, vec3f, vec3f);
+
+static void
+assert_cells_hold_linedefs(const level_data*);
+
 TEST_GROUP(level_data);
 
 TEST_SETUP(level_data) {}
@@ -34,9 +53,399 @@ TEST(level_data, intersect_3d)
   );
 }
 
+TEST(level_data, intersect_3d_skips_empty_blocks)
+{
+  register int i;
+  level_data *level = create_sparse_level();
+  vec3f start, end;
+
+  srand(47);
+
+  for (i = 0; i < 4096; ++i) {
+    start = VEC3F(50 + rand() % 4000, 50 + rand() % 4000, 64);
+    end = VEC3F(50 + rand() % 4000, 50 + rand() % 4000, 128);
+
+    TEST_ASSERT_EQUAL(intersect_any_linedef(level, start, end), map_cache_intersect_3d(&level->cache, start, end));
+  }
+}
+
+TEST(level_data, intersect_3d_n)
+{
+  register int i, r;
+  level_data *level = create_sparse_level();
+  vec3f starts[MAP_CACHE_PACKET_SIZE], ends[MAP_CACHE_PACKET_SIZE];
+  uint8_t expected;
+
+  srand(46);
+
+  for (i = 0; i < 1024; ++i) {
+    for (expected = 0, r = 0; r < MAP_CACHE_PACKET_SIZE; ++r) {
+      starts[r] = VEC3F(50 + rand() % 4000, 50 + rand() % 4000, 64);
+      ends[r] = VEC3F(50 + rand() % 4000, 50 + rand() % 4000, 128);
+      expected |= map_cache_intersect_3d(&level->cache, starts[r], ends[r]) << r;
+    }
+
+    TEST_ASSERT_EQUAL_HEX8(expected, map_cache_intersect_3d_n(&level->cache, starts, ends, MAP_CACHE_PACKET_SIZE));
+    TEST_ASSERT_EQUAL_HEX8(expected & 3, map_cache_intersect_3d_n(&level->cache, starts, ends, 2));
+  }
+}
+
+TEST(level_data, intersect_3d_n_many_cells)
+{
+  register int x, y;
+  map_builder builder = { .cell_size = 64.f };
+  level_data *level;
+  vec3f starts[MAP_CACHE_PACKET_SIZE], ends[MAP_CACHE_PACKET_SIZE];
+
+  /* Open 40 x 40 grid of sectors, one per cell, with a closed one in the middle */
+  for (y = 0; y < 40; ++y) {
+    for (x = 0; x < 40; ++x) {
+      map_builder_add_polygon(&builder, 0, (x == 20 && y == 20) ? 0 : 256, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+        VEC2F(x*64, y*64),
+        VEC2F(x*64 + 64, y*64),
+        VEC2F(x*64 + 64, y*64 + 64),
+        VEC2F(x*64, y*64 + 64)
+      ));
+    }
+  }
+
+  level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  /* The first three rays cross more than MAP_CACHE_PACKET_CELLS cells before the last one is walked */
+  for (y = 0; y < 3; ++y) {
+    starts[y] = VEC3F(10, 100 + y*200, 64);
+    ends[y] = VEC3F(2550, 100 + y*200, 64);
+  }
+
+  starts[3] = VEC3F(1200, 1300, 64);
+  ends[3] = VEC3F(1400, 1300, 64);
+
+  for (y = 0; y < MAP_CACHE_PACKET_SIZE; ++y) {
+    TEST_ASSERT_EQUAL(y == 3, map_cache_intersect_3d(&level->cache, starts[y], ends[y]));
+  }
+
+  TEST_ASSERT_EQUAL_HEX8(0x8, map_cache_intersect_3d_n(&level->cache, starts, ends, MAP_CACHE_PACKET_SIZE));
+}
+
+#ifdef RAYCASTER_SHADOW_MAPS
+TEST(level_data, shadow_map)
+{
+  register int i, j, k;
+  level_data *level = create_stepped_level();
+  const vec3f light_pos = VEC3F(700, 500, 160);
+  light *lt = level_data_add_light(level, light_pos, 700.f, 1.f);
+  const int32_t bins = SHADOW_MAP_ANGLES;
+  int32_t bin, vertex_bin;
+  uint8_t visibility;
+  const sector *sect;
+  vec3f pos, further, closer;
+  bool blocked;
+  float d;
+  int answered[2] = { 0, 0 };
+
+  srand(44);
+
+  for (i = 0; i < 8192; ++i) {
+    pos = VEC3F(10 + rand() % 1004, 10 + rand() % 1004, 0);
+
+    for (j = 0, sect = NULL; j < (int)level->sectors_count; ++j) {
+      if (sector_point_inside(&level->sectors[j], VEC2F(pos.x, pos.y))) {
+        sect = &level->sectors[j];
+      }
+    }
+
+    if (!sect || sect->floor.height >= sect->ceiling.height || math_length(VEC2F(pos.x - light_pos.x, pos.y - light_pos.y)) >= lt->radius) {
+      continue;
+    }
+
+    pos.z = sect->floor.height + 1 + rand() % (sect->ceiling.height - sect->floor.height - 1);
+
+    /* Angles an occluder ends in merge it with what's beside it, so only the others have to be exact */
+    bin = (int32_t)(light_shadow_map_direction_angle(pos.x - light_pos.x, pos.y - light_pos.y) * (bins / 4)) % bins;
+
+    for (k = 0; k < (int)level->vertices_count; ++k) {
+      vertex_bin = (int32_t)(light_shadow_map_direction_angle(level->vertices[k].point.x - light_pos.x, level->vertices[k].point.y - light_pos.y) * (bins / 4)) % bins;
+
+      if (abs(((bin - vertex_bin + bins + bins / 2) % bins) - bins / 2) <= 1) {
+        break;
+      }
+    }
+
+    if (k < (int)level->vertices_count) {
+      continue;
+    }
+
+    visibility = light_shadow_map_test(lt, pos, light_pos);
+
+    if (visibility == SHADOW_MAP_UNKNOWN) {
+      continue;
+    }
+
+    /* Nor do points close to an occluder edge in height or along the ray */
+    d = math_length(VEC2F(pos.x - light_pos.x, pos.y - light_pos.y));
+    blocked = map_cache_intersect_3d(&level->cache, pos, light_pos);
+    further = VEC3F(pos.x + ((pos.x - light_pos.x) / d) * 8.f, pos.y + ((pos.y - light_pos.y) / d) * 8.f, pos.z);
+    closer = VEC3F(pos.x - ((pos.x - light_pos.x) / d) * 8.f, pos.y - ((pos.y - light_pos.y) / d) * 8.f, pos.z);
+
+    if (blocked != map_cache_intersect_3d(&level->cache, VEC3F(pos.x, pos.y, pos.z - 2), light_pos) ||
+        blocked != map_cache_intersect_3d(&level->cache, VEC3F(pos.x, pos.y, pos.z + 2), light_pos) ||
+        blocked != map_cache_intersect_3d(&level->cache, further, light_pos) ||
+        blocked != map_cache_intersect_3d(&level->cache, closer, light_pos)) {
+      continue;
+    }
+
+    TEST_ASSERT_EQUAL(blocked ? SHADOW_MAP_HIDDEN : SHADOW_MAP_VISIBLE, visibility);
+    answered[blocked]++;
+  }
+
+  /* Most points are answered by the map, both lit and in shadow */
+  TEST_ASSERT_GREATER_THAN(1000, answered[false]);
+  TEST_ASSERT_GREATER_THAN(200, answered[true]);
+}
+#endif
+
+#ifdef SHADOW_CACHES
+TEST(level_data, shadow_cache_slots)
+{
+  register uint8_t i;
+  shadow_cache *cache = shadow_cache_create_horizontal(VEC2F(0, 0), VEC2F(8, 8));
+  light lights[MAX_LIGHTS_PER_SURFACE + 1] = { 0 };
+  light *surface[MAX_LIGHTS_PER_SURFACE];
+  uint8_t *texel = shadow_cache_texel(cache, VEC3F(1, 1, 0)), slots[MAX_LIGHTS_PER_SURFACE];
+
+  for (i = 0; i < MAX_LIGHTS_PER_SURFACE; ++i) {
+    surface[i] = &lights[i];
+  }
+
+  shadow_cache_assign_lights(cache, surface, MAX_LIGHTS_PER_SURFACE);
+
+  for (i = 0; i < MAX_LIGHTS_PER_SURFACE; ++i) {
+    TEST_ASSERT_LESS_THAN(MAX_LIGHTS_PER_SURFACE, slots[i] = shadow_cache_find_slot(cache, &lights[i]));
+    texel[slots[i]] = SHADOW_CACHE_HIDDEN;
+  }
+
+  /* A light replacing one that left the surface takes its slot, the others keep theirs and their texels */
+  surface[1] = &lights[MAX_LIGHTS_PER_SURFACE];
+  shadow_cache_assign_lights(cache, surface, MAX_LIGHTS_PER_SURFACE);
+
+  TEST_ASSERT_EQUAL(MAX_LIGHTS_PER_SURFACE, shadow_cache_find_slot(cache, &lights[1]));
+  TEST_ASSERT_EQUAL(slots[1], shadow_cache_find_slot(cache, &lights[MAX_LIGHTS_PER_SURFACE]));
+  TEST_ASSERT_EQUAL(SHADOW_CACHE_UNKNOWN, texel[slots[1]]);
+
+  for (i = 0; i < MAX_LIGHTS_PER_SURFACE; ++i) {
+    if (i != 1) {
+      TEST_ASSERT_EQUAL(slots[i], shadow_cache_find_slot(cache, &lights[i]));
+      TEST_ASSERT_EQUAL(SHADOW_CACHE_HIDDEN, texel[slots[i]]);
+    }
+  }
+
+  /* Lights whose shadows changed start over */
+  lights[0].shadow_version++;
+  TEST_ASSERT_EQUAL(MAX_LIGHTS_PER_SURFACE, shadow_cache_find_slot(cache, &lights[0]));
+  shadow_cache_assign_lights(cache, surface, MAX_LIGHTS_PER_SURFACE);
+  TEST_ASSERT_LESS_THAN(MAX_LIGHTS_PER_SURFACE, shadow_cache_find_slot(cache, &lights[0]));
+  TEST_ASSERT_EQUAL(SHADOW_CACHE_UNKNOWN, texel[shadow_cache_find_slot(cache, &lights[0])]);
+  TEST_ASSERT_EQUAL(SHADOW_CACHE_HIDDEN, texel[slots[2]]);
+
+  shadow_cache_destroy(cache);
+}
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+TEST(level_data, bake_lightmaps)
+{
+  register size_t i;
+  level_data *level = create_two_room_level();
+  const sector *lit = NULL, *dark = NULL;
+  const linedef *lit_wall, *dark_wall;
+
+  level_data_add_static_light(level, VEC3F(100, 100, 128), 1000.f, 1.f);
+
+  /* Static lights are only seen through the lightmaps */
+  TEST_ASSERT_EQUAL(0, level->lights_count);
+  TEST_ASSERT_EQUAL(1, level->static_lights_count);
+
+  level_data_bake_lightmaps(level, 8.f);
+
+  for (i = 0; i < level->sectors_count; ++i) {
+    if (sector_point_inside(&level->sectors[i], VEC2F(150, 120))) {
+      lit = &level->sectors[i];
+    } else if (sector_point_inside(&level->sectors[i], VEC2F(800, 100))) {
+      dark = &level->sectors[i];
+    }
+  }
+
+  TEST_ASSERT_NOT_NULL(lit);
+  TEST_ASSERT_NOT_NULL(dark);
+  TEST_ASSERT_NOT_NULL(lit->lightmaps[0]);
+  TEST_ASSERT_NOT_NULL(dark->lightmaps[0]);
+
+  /* Floor in view of the light and behind the pillar from it */
+  TEST_ASSERT_GREATER_THAN_FLOAT(lit->brightness, lightmap_sample(lit->lightmaps[0], VEC3F(150, 120, 0)));
+  TEST_ASSERT_EQUAL_FLOAT(lit->brightness, lightmap_sample(lit->lightmaps[0], VEC3F(350, 350, 0)));
+  TEST_ASSERT_EQUAL_FLOAT(lit->brightness, lightmap_sample(lit->lightmaps[0], VEC3F(400, 330, 0)));
+
+  /* The room beyond the wall is in reach of the light, but none of it reaches there */
+  for (i = 0; i < 64; ++i) {
+    TEST_ASSERT_EQUAL_FLOAT(dark->brightness, lightmap_sample(dark->lightmaps[0], VEC3F(610 + (i % 8) * 48, 10 + (i / 8) * 62, 0)));
+  }
+
+  lit_wall = level_data_find_linedef(level, VEC2F(512, 0), VEC2F(512, 512));
+  dark_wall = level_data_find_linedef(level, VEC2F(1000, 0), VEC2F(1000, 512));
+
+  TEST_ASSERT_NOT_NULL(lit_wall);
+  TEST_ASSERT_NOT_NULL(dark_wall);
+  TEST_ASSERT_NOT_NULL(lit_wall->side[0].lightmap);
+  TEST_ASSERT_NOT_NULL(dark_wall->side[0].lightmap);
+
+  TEST_ASSERT_GREATER_THAN_FLOAT(lit->brightness, lightmap_sample(lit_wall->side[0].lightmap, VEC3F(512, 100, 64)));
+  TEST_ASSERT_EQUAL_FLOAT(dark->brightness, lightmap_sample(dark_wall->side[0].lightmap, VEC3F(1000, 100, 64)));
+}
+#endif
+
+TEST(level_data, map_cache_cell_size)
+{
+  register size_t i;
+  level_data *level = create_sparse_level();
+  map_builder builder = { .cell_size = 100.f };
+  float length = 0.f;
+
+  for (i = 0; i < level->linedefs_count; ++i) {
+    length += math_length(level->linedefs[i].direction);
+  }
+
+  /* Few long walls, so the average length wins over the cells per linedef limit */
+  TEST_ASSERT_EQUAL_FLOAT(length / level->linedefs_count, map_cache_auto_cell_size(level));
+  TEST_ASSERT_EQUAL_FLOAT(map_cache_auto_cell_size(level), level->cache.cell_size);
+
+  map_builder_add_polygon(&builder, 0, 128, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(0, 0),
+    VEC2F(1000, 0),
+    VEC2F(1000, 500),
+    VEC2F(0, 500)
+  ));
+
+  level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  TEST_ASSERT_EQUAL_FLOAT(100.f, level->cache.cell_size);
+  TEST_ASSERT_EQUAL(10, level->cache.w);
+  TEST_ASSERT_EQUAL(5, level->cache.h);
+
+  /* Too large for the maximum cell size, cells grow until their counts fit */
+  builder = (map_builder) { 0 };
+
+  map_builder_add_polygon(&builder, 0, 128, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(0, 0),
+    VEC2F(40000000, 0),
+    VEC2F(40000000, 32),
+    VEC2F(0, 32)
+  ));
+
+  level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  TEST_ASSERT_EQUAL_FLOAT(40000000.f / INT16_MAX, level->cache.cell_size);
+  TEST_ASSERT_LESS_OR_EQUAL(INT16_MAX, level->cache.w);
+  TEST_ASSERT_GREATER_THAN(INT16_MAX - 2, level->cache.w);
+  TEST_ASSERT_EQUAL(1, level->cache.h);
+  TEST_ASSERT_TRUE(map_cache_intersect_3d(&level->cache, VEC3F(39999000, 16, 64), VEC3F(40001000, 16, 64)));
+  TEST_ASSERT_FALSE(map_cache_intersect_3d(&level->cache, VEC3F(39990000, 16, 64), VEC3F(39999000, 16, 64)));
+}
+
+TEST(level_data, map_cache_crowded_cell)
+{
+  register int i, x, y;
+  map_builder builder = { .cell_size = 1024.f };
+  level_data *level;
+  vec3f start, end;
+
+  map_builder_add_polygon(&builder, 0, 256, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(0, 0),
+    VEC2F(1000, 0),
+    VEC2F(1000, 1000),
+    VEC2F(0, 1000)
+  ));
+
+  /* 400 pillar walls, all of them in the one cell */
+  for (y = 0; y < 10; ++y) {
+    for (x = 0; x < 10; ++x) {
+      map_builder_add_polygon(&builder, 64, 64, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+        VEC2F(50 + x*100, 50 + y*100),
+        VEC2F(58 + x*100, 50 + y*100),
+        VEC2F(58 + x*100, 58 + y*100),
+        VEC2F(50 + x*100, 58 + y*100)
+      ));
+    }
+  }
+
+  level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  TEST_ASSERT_EQUAL(1, level->cache.w * level->cache.h);
+  TEST_ASSERT_GREATER_THAN(255, level->cache.cells[0].count);
+  TEST_ASSERT_EQUAL(level->linedefs_count, level->cache.cells[0].count);
+
+  srand(49);
+
+  for (i = 0; i < 1024; ++i) {
+    start = VEC3F(1 + rand() % 998, 1 + rand() % 998, rand() % 128);
+    end = VEC3F(1 + rand() % 998, 1 + rand() % 998, rand() % 128);
+
+    TEST_ASSERT_EQUAL(intersect_any_linedef(level, start, end), map_cache_intersect_3d(&level->cache, start, end));
+  }
+
+  /* The map cache keeps its own copy of the heights */
+  start = VEC3F(20, 54, 100);
+  end = VEC3F(980, 54, 100);
+  TEST_ASSERT_TRUE(map_cache_intersect_3d(&level->cache, start, end));
+
+  for (i = 0; i < (int)level->sectors_count; ++i) {
+    if (level->sectors[i].floor.height == 64) {
+      level->sectors[i].floor.height = 0;
+      level->sectors[i].ceiling.height = 256;
+      level_data_update_sector_heights(level, &level->sectors[i]);
+    }
+  }
+
+  TEST_ASSERT_FALSE(map_cache_intersect_3d(&level->cache, start, end));
+}
+
+TEST(level_data, map_cache_cells)
+{
+  level_data *level = create_level();
+
+  /* create_level moves the vertices around after building the level */
+  map_cache_destroy(&level->cache);
+  map_cache_process_level_data(&level->cache, level, 0.f);
+  assert_cells_hold_linedefs(level);
+
+  /* Pillar walls lie on cell edges */
+  level = create_sparse_level();
+  map_cache_destroy(&level->cache);
+  map_cache_process_level_data(&level->cache, level, 8.f);
+  assert_cells_hold_linedefs(level);
+}
+
 TEST_GROUP_RUNNER(level_data)
 {
   RUN_TEST_CASE(level_data, intersect_3d);
+  RUN_TEST_CASE(level_data, intersect_3d_skips_empty_blocks);
+  RUN_TEST_CASE(level_data, intersect_3d_n);
+  RUN_TEST_CASE(level_data, intersect_3d_n_many_cells);
+#ifdef RAYCASTER_SHADOW_MAPS
+  RUN_TEST_CASE(level_data, shadow_map);
+#endif
+#ifdef SHADOW_CACHES
+  RUN_TEST_CASE(level_data, shadow_cache_slots);
+#endif
+#ifdef RAYCASTER_LIGHTMAPS
+  RUN_TEST_CASE(level_data, bake_lightmaps);
+#endif
+  RUN_TEST_CASE(level_data, map_cache_cell_size);
+  RUN_TEST_CASE(level_data, map_cache_crowded_cell);
+  RUN_TEST_CASE(level_data, map_cache_cells);
 }
 
 static level_data*
@@ -78,3 +487,184 @@ create_level()
 
   return level;
 }
+
+/* One big room with a few solid pillars, so most of the map cache is empty */
+static level_data*
+create_sparse_level()
+{
+  register int x, y;
+  map_builder builder = { 0 };
+
+  map_builder_add_polygon(&builder, 0, 256, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(0, 0),
+    VEC2F(4096, 0),
+    VEC2F(4096, 4096),
+    VEC2F(0, 4096)
+  ));
+
+  for (y = 0; y < 3; ++y) {
+    for (x = 0; x < 3; ++x) {
+      map_builder_add_polygon(&builder, 0, 0, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+        VEC2F(600 + x*1300, 600 + y*1300),
+        VEC2F(664 + x*1300, 600 + y*1300),
+        VEC2F(664 + x*1300, 664 + y*1300),
+        VEC2F(600 + x*1300, 664 + y*1300)
+      ));
+    }
+  }
+
+  level_data *level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  return level;
+}
+
+#ifdef RAYCASTER_SHADOW_MAPS
+/* Room with solid pillars, a raised step and a low ceiling between them */
+static level_data*
+create_stepped_level()
+{
+  map_builder builder = { 0 };
+
+  map_builder_add_polygon(&builder, 0, 256, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(0, 0),
+    VEC2F(1024, 0),
+    VEC2F(1024, 1024),
+    VEC2F(0, 1024)
+  ));
+
+  map_builder_add_polygon(&builder, 0, 0, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(300, 300),
+    VEC2F(364, 300),
+    VEC2F(364, 364),
+    VEC2F(300, 364)
+  ));
+
+  map_builder_add_polygon(&builder, 0, 0, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(820, 700),
+    VEC2F(880, 700),
+    VEC2F(880, 760),
+    VEC2F(820, 760)
+  ));
+
+  map_builder_add_polygon(&builder, 96, 256, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(100, 600),
+    VEC2F(500, 600),
+    VEC2F(500, 900),
+    VEC2F(100, 900)
+  ));
+
+  map_builder_add_polygon(&builder, 0, 120, 1.f, WALLTEX(TEXTURE_NONE), TEXTURE_NONE, TEXTURE_NONE, VERTICES(
+    VEC2F(600, 100),
+    VEC2F(950, 100),
+    VEC2F(950, 250),
+    VEC2F(600, 250)
+  ));
+
+  level_data *level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  return level;
+}
+#endif
+
+#ifdef RAYCASTER_LIGHTMAPS
+/* Room with a solid pillar and a lighter, separate room across a gap east of it */
+static level_data*
+create_two_room_level()
+{
+  map_builder builder = { 0 };
+
+  map_builder_add_polygon(&builder, 0, 256, 0.25f, WALLTEX(1), 2, 3, VERTICES(
+    VEC2F(0, 0),
+    VEC2F(512, 0),
+    VEC2F(512, 512),
+    VEC2F(0, 512)
+  ));
+
+  map_builder_add_polygon(&builder, 0, 0, 0.25f, WALLTEX(1), 2, 3, VERTICES(
+    VEC2F(200, 200),
+    VEC2F(264, 200),
+    VEC2F(264, 264),
+    VEC2F(200, 264)
+  ));
+
+  map_builder_add_polygon(&builder, 0, 256, 0.4f, WALLTEX(1), 2, 3, VERTICES(
+    VEC2F(600, 0),
+    VEC2F(1000, 0),
+    VEC2F(1000, 512),
+    VEC2F(600, 512)
+  ));
+
+  level_data *level = map_builder_build(&builder);
+  map_builder_free(&builder);
+
+  return level;
+}
+#endif
+
+/* Reference for map_cache_intersect_3d testing every linedef of the level */
+static bool
+intersect_any_linedef(const level_data *level, vec3f start, vec3f end)
+{
+  register size_t i;
+  const vec2f start_xy = VEC2F(start.x, start.y);
+  const vec2f direction = VEC2F(end.x - start.x, end.y - start.y);
+  const linedef *line;
+  float det, z;
+
+  for (i = 0; i < level->linedefs_count; ++i) {
+    line = &level->linedefs[i];
+
+    if (math_find_line_intersection_cached(start_xy, line->v0->point, direction, line->direction, NULL, &det, NULL) && det > MATHS_EPSILON) {
+      z = start.z + (end.z - start.z)*det;
+      if (!line->side[1].sector || z < line->max_floor_height || z > line->min_ceiling_height) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/* Every linedef crossing a cell's edges or lying inside it has to be in the cell */
+static void
+assert_cells_hold_linedefs(const level_data *level)
+{
+  register size_t i, c;
+  register int x, y;
+  const map_cache *cache = &level->cache;
+  const float size = cache->cell_size;
+  const map_cache_cell *cell;
+  vec2f v0, v1, p0, p1, p2, p3;
+  bool found;
+
+  for (y = 0; y < cache->h; ++y) {
+    for (x = 0; x < cache->w; ++x) {
+      cell = &cache->cells[y*cache->w + x];
+      p0 = VEC2F(x*size, y*size);
+      p1 = VEC2F(x*size+size, y*size);
+      p2 = VEC2F(x*size+size, y*size+size);
+      p3 = VEC2F(x*size, y*size+size);
+
+      for (i = 0; i < level->linedefs_count; ++i) {
+        v0 = vec2f_sub(level->linedefs[i].v0->point, cache->origin);
+        v1 = vec2f_sub(level->linedefs[i].v1->point, cache->origin);
+
+        if (math_find_line_intersection(v0, v1, p0, p1, NULL, NULL) ||
+            math_find_line_intersection(v0, v1, p1, p2, NULL, NULL) ||
+            math_find_line_intersection(v0, v1, p2, p3, NULL, NULL) ||
+            math_find_line_intersection(v0, v1, p3, p0, NULL, NULL) ||
+            ((v0.x >= p0.x && v0.y >= p0.y && v0.x < p2.x && v0.y < p2.y) &&
+             (v1.x >= p0.x && v1.y >= p0.y && v1.x < p2.x && v1.y < p2.y))
+        ) {
+          for (c = cell->offset, found = false; c < cell->offset + cell->count && !found; ++c) {
+            found = cache->references[c] == i;
+          }
+
+          TEST_ASSERT_TRUE(found);
+        }
+      }
+    }
+  }
+}
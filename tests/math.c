@@ -93,10 +93,21 @@ TEST(math, point_in_triangle)
   TEST_ASSERT_FALSE(math_point_in_triangle(VEC2F(0, -6), VEC2F(0, -5), VEC2F(-5, 5), VEC2F(5, 5)));
 }
 
+TEST(math, fixed_point)
+{
+  TEST_ASSERT_EQUAL_INT32(FIXED_ONE + (FIXED_ONE >> 1), fixed_from_float(1.5f));
+  TEST_ASSERT_EQUAL_DOUBLE(-2.25, fixed_to_float(fixed_from_float(-2.25f)));
+  TEST_ASSERT_EQUAL_INT32(3, fixed_floor(fixed_from_float(3.75f)));
+  TEST_ASSERT_EQUAL_INT32(-4, fixed_floor(fixed_from_float(-3.25f)));
+  TEST_ASSERT_EQUAL_INT32(fixed_from_float(-7.5f), fixed_mul(fixed_from_float(2.5f), fixed_from_float(-3.f)));
+  TEST_ASSERT_EQUAL_INT32(fixed_from_float(12288.f), fixed_mul(fixed_from_float(16384.f), fixed_from_float(0.75f)));
+}
+
 TEST_GROUP_RUNNER(math)
 {
   RUN_TEST_CASE(math, find_line_intersection);
   RUN_TEST_CASE(math, line_segment_point_perpendicular_distance);
   RUN_TEST_CASE(math, sign);
   RUN_TEST_CASE(math, point_in_triangle);
+  RUN_TEST_CASE(math, fixed_point);
 }
@@ -47,6 +47,8 @@ TEST(sector, add_linedef)
 
   TEST_ASSERT_EQUAL_INT(5, sect->linedefs_count);
   TEST_ASSERT_TRUE(sector_references_vertex(sect, &vertices[4], 0));
+  TEST_ASSERT_EQUAL_INT(5, sect->geometry.count);
+  TEST_ASSERT_EQUAL_PTR(&linedefs[4], sect->geometry.linedefs[4]);
 }
 
 TEST(sector, remove_linedef)
@@ -61,6 +63,8 @@ TEST(sector, remove_linedef)
 
   TEST_ASSERT_EQUAL_INT(3, sect->linedefs_count);
   TEST_ASSERT_FALSE(sector_connects_vertices(sect, &vertices[0], &vertices[3]));
+  TEST_ASSERT_EQUAL_INT(3, sect->geometry.count);
+  TEST_ASSERT_EQUAL_PTR(&linedefs[2], sect->geometry.linedefs[2]);
 }
 
 TEST(sector, point_inside)
@@ -84,7 +88,7 @@ static sector* create_test_sector(vertex **vertices, linedef **linedefs)
 {
   vertex *verts = (vertex *)malloc(5 * sizeof(vertex));
   linedef *lines = (linedef *)malloc(5 * sizeof(linedef));
-  sector *sect = (sector *)malloc(sizeof(sector));
+  sector *sect = (sector *)calloc(1, sizeof(sector));
 
   verts[0] = (vertex) { VEC2F(0, 0) };
   verts[1] = (vertex) { VEC2F(100, 0) };
@@ -0,0 +1,169 @@
+#include "unity.h"
+#include "fixture.h"
+#include "texture.h"
+
+TEST_GROUP(texture);
+
+TEST_SETUP(texture) {}
+TEST_TEAR_DOWN(texture) {}
+
+/*  ┌────────────┐
+    │ TEST CASES │
+    └────────────┘ */
+
+TEST(texture, palettize_few_colors)
+{
+  palettized_texture tex;
+  uint8_t rgba[8][8][4], pixel[3], mask;
+  int x, y;
+
+  for (y = 0; y < 8; ++y) {
+    for (x = 0; x < 8; ++x) {
+      rgba[y][x][0] = (x & 3) * 80;
+      rgba[y][x][1] = (y & 1) * 200;
+      rgba[y][x][2] = 17;
+      rgba[y][x][3] = x == 7 ? 0 : 255;
+    }
+  }
+
+  TEST_ASSERT_TRUE(palettized_texture_create(&tex, &rgba[0][0][0], 8, 8, sizeof(rgba[0])));
+  TEST_ASSERT_EQUAL_UINT8(4, tex.bits);
+  TEST_ASSERT_EQUAL_UINT16(10, tex.palette_size);
+
+  for (y = 0; y < 8; ++y) {
+    for (x = 0; x < 8; ++x) {
+      palettized_texture_sample(&tex, x, y, pixel, &mask);
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(rgba[y][x], pixel, 3);
+      TEST_ASSERT_EQUAL_UINT8(rgba[y][x][3], mask);
+    }
+  }
+
+  palettized_texture_destroy(&tex);
+}
+
+TEST(texture, palettize_many_colors)
+{
+  palettized_texture tex;
+  static uint8_t rgba[32][48][4];
+  uint8_t pixel[3], mask;
+  int x, y, c;
+
+  for (y = 0; y < 32; ++y) {
+    for (x = 0; x < 32; ++x) {
+      rgba[y][x][0] = x * 8;
+      rgba[y][x][1] = y * 8;
+      rgba[y][x][2] = (x ^ y) * 8;
+      rgba[y][x][3] = 255;
+    }
+  }
+
+  /* A transparent corner of a single color keeps its own palette entry */
+  for (y = 0; y < 4; ++y) {
+    memset(rgba[y], 0, 4 * sizeof(rgba[0][0]));
+  }
+
+  /* Only the first 32 columns of each row are part of the texture */
+  TEST_ASSERT_TRUE(palettized_texture_create(&tex, &rgba[0][0][0], 32, 32, sizeof(rgba[0])));
+  TEST_ASSERT_EQUAL_UINT8(8, tex.bits);
+  TEST_ASSERT_EQUAL_UINT16(256, tex.palette_size);
+
+  for (y = 0; y < 32; ++y) {
+    for (x = 0; x < 32; ++x) {
+      palettized_texture_sample(&tex, x, y, pixel, &mask);
+      TEST_ASSERT_EQUAL_UINT8(rgba[y][x][3], mask);
+
+      if (!mask) {
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(rgba[y][x], pixel, 3);
+      }
+
+      for (c = 0; c < 3; ++c) {
+        TEST_ASSERT_UINT8_WITHIN(32, rgba[y][x][c], pixel[c]);
+      }
+    }
+  }
+
+  palettized_texture_destroy(&tex);
+}
+
+TEST(texture, column_major_copy)
+{
+  palettized_texture tex;
+  uint8_t rgba[16][4][4], row_pixel[3], column_pixel[3], row_mask, column_mask;
+  int x, y, bits;
+
+  for (bits = 4; bits <= 8; bits += 4) {
+    for (y = 0; y < 16; ++y) {
+      for (x = 0; x < 4; ++x) {
+        rgba[y][x][0] = bits == 4 ? x * 60 : y * 16;
+        rgba[y][x][1] = bits == 4 ? (y & 1) * 60 : x * 60;
+        rgba[y][x][2] = 0;
+        rgba[y][x][3] = 255;
+      }
+    }
+
+    memset(rgba[0], 0, sizeof(rgba[0]));
+
+    TEST_ASSERT_TRUE(palettized_texture_create(&tex, &rgba[0][0][0], 4, 16, sizeof(rgba[0])));
+    TEST_ASSERT_EQUAL_UINT8(bits, tex.bits);
+    TEST_ASSERT_TRUE(palettized_texture_create_columns(&tex));
+
+    for (y = 0; y < 16; ++y) {
+      for (x = 0; x < 4; ++x) {
+        palettized_texture_sample(&tex, x, y, row_pixel, &row_mask);
+        palettized_texture_sample_column(&tex, x, y, column_pixel, &column_mask);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(row_pixel, column_pixel, 3);
+        TEST_ASSERT_EQUAL_UINT8(row_mask, column_mask);
+      }
+    }
+
+    palettized_texture_destroy(&tex);
+  }
+}
+
+TEST(texture, tiled_copy)
+{
+  palettized_texture tex;
+  static uint8_t rgba[16][24][4];
+  uint8_t row_pixel[3], tiled_pixel[3], row_mask, tiled_mask;
+  int x, y;
+
+  for (y = 0; y < 16; ++y) {
+    for (x = 0; x < 24; ++x) {
+      rgba[y][x][0] = x * 10;
+      rgba[y][x][1] = y * 15;
+      rgba[y][x][2] = 0;
+      rgba[y][x][3] = 255;
+    }
+  }
+
+  TEST_ASSERT_TRUE(palettized_texture_create(&tex, &rgba[0][0][0], 24, 16, sizeof(rgba[0])));
+  TEST_ASSERT_TRUE(palettized_texture_create_tiles(&tex));
+
+  for (y = 0; y < 16; ++y) {
+    for (x = 0; x < 24; ++x) {
+      palettized_texture_sample(&tex, x, y, row_pixel, &row_mask);
+      palettized_texture_sample_tiled(&tex, x, y, tiled_pixel, &tiled_mask);
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(row_pixel, tiled_pixel, 3);
+      TEST_ASSERT_EQUAL_UINT8(row_mask, tiled_mask);
+    }
+  }
+
+  /* Neighbouring rows of a tile are next to each other */
+  TEST_ASSERT_EQUAL_UINT32(PALETTIZED_TEXTURE_TILE_SIZE, palettized_texture_tile_offset(&tex, 0, 1));
+  TEST_ASSERT_EQUAL_UINT32(PALETTIZED_TEXTURE_TILE_SIZE * PALETTIZED_TEXTURE_TILE_SIZE, palettized_texture_tile_offset(&tex, PALETTIZED_TEXTURE_TILE_SIZE, 0));
+
+  palettized_texture_destroy(&tex);
+
+  /* Dimensions have to be whole tiles */
+  TEST_ASSERT_TRUE(palettized_texture_create(&tex, &rgba[0][0][0], 20, 16, sizeof(rgba[0])));
+  TEST_ASSERT_FALSE(palettized_texture_create_tiles(&tex));
+  palettized_texture_destroy(&tex);
+}
+
+TEST_GROUP_RUNNER(texture)
+{
+  RUN_TEST_CASE(texture, palettize_few_colors);
+  RUN_TEST_CASE(texture, palettize_many_colors);
+  RUN_TEST_CASE(texture, column_major_copy);
+  RUN_TEST_CASE(texture, tiled_copy);
+}